@@ -0,0 +1,92 @@
+/*This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.*/
+/* Michael Welsch (c) 2018 */
+
+#include "distance_cache.hpp" // back reference for header only use
+#include <algorithm>
+
+namespace metric_space
+{
+    template <class Distance>
+    DistanceCache<Distance>::DistanceCache(std::size_t capacity)
+        : buckets(std::max<std::size_t>(1, capacity / ways)), locks(new std::mutex[n_locks]) {}
+
+    template <class Distance>
+    std::size_t DistanceCache<Distance>::bucket_(std::uint64_t key) const {
+        // IDs are dense and consecutive, mix them before taking the bucket
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return std::size_t(key % buckets.size());
+    }
+
+    template <class Distance>
+    bool DistanceCache<Distance>::find(unsigned a, unsigned b, Distance &out) {
+        auto key = key_(a, b);
+        auto i = bucket_(key);
+        std::lock_guard<std::mutex> lk(lock_(i));
+        for (auto &slot : buckets[i].slots) {
+            if (slot.key == key) {
+                if (slot.uses < max_uses)
+                    slot.uses++;
+                out = slot.value;
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    template <class Distance>
+    void DistanceCache<Distance>::store(unsigned a, unsigned b, Distance value) {
+        auto key = key_(a, b);
+        auto i = bucket_(key);
+        std::lock_guard<std::mutex> lk(lock_(i));
+        auto &slots = buckets[i].slots;
+        Slot *victim = &slots[0];
+        for (auto &slot : slots) {
+            if (slot.key == key)
+                return; // another thread was first
+            if (slot.key == empty) {
+                victim = &slot;
+                break;
+            }
+            if (slot.uses < victim->uses)
+                victim = &slot;
+        }
+        if (victim->key == empty) {
+            entries.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            // age the survivors, a once frequent pair that is no longer used gives way eventually
+            for (auto &slot : slots)
+                if (&slot != victim && slot.uses > 0)
+                    slot.uses--;
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        victim->key = key;
+        victim->value = value;
+        victim->uses = 1;
+    }
+
+    template <class Distance>
+    void DistanceCache<Distance>::clear() {
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
+            std::lock_guard<std::mutex> lk(lock_(i));
+            buckets[i] = Bucket();
+        }
+        entries = 0;
+    }
+
+    template <class Distance>
+    typename DistanceCache<Distance>::Stats DistanceCache<Distance>::stats() const {
+        Stats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.entries = entries;
+        return s;
+    }
+
+} // end namespace
@@ -0,0 +1,88 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_SPACE_DISTANCE_CACHE_HPP
+#define _METRIC_SPACE_DISTANCE_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace metric_space
+{
+/*
+    _ \   _)        |                                |
+    |  |  |  (_-<    _|   _` |    \    _|   -_)    _|   _` |   _|   \    -_)
+   ___/  _|  ___/  \__| \__,_| _| _| \__| \___|  \__| \__,_| \__| _| _| \___|
+
+  bounded memo of distances between two records, keyed by their IDs
+*/
+    template <class Distance>
+    class DistanceCache
+    {
+    public:
+        struct Stats {
+            std::size_t hits = 0;
+            std::size_t misses = 0;
+            std::size_t evictions = 0;
+            std::size_t entries = 0;
+        };
+
+        /***
+          capacity entries in small set associative buckets, one lock per group of buckets. A full
+          bucket evicts its least used entry and ages the others, so pairs that recur across many
+          operations (the upper levels every insert descends through) stay while the pairs of one
+          descent or one rebalance are reused while fresh and then make room.
+         */
+        explicit DistanceCache(std::size_t capacity);
+        DistanceCache(const DistanceCache &) = delete;
+        DistanceCache &operator=(const DistanceCache &) = delete;
+
+        bool find(unsigned a, unsigned b, Distance &out); // symmetric in a and b
+        void store(unsigned a, unsigned b, Distance value);
+        void clear();
+
+        Stats stats() const;
+
+    private:
+        static constexpr std::size_t ways = 4;
+        static constexpr std::uint64_t empty = ~std::uint64_t(0); // a == b is never stored
+        static constexpr std::uint8_t max_uses = 15;
+
+        struct Slot {
+            std::uint64_t key = empty;
+            Distance value = Distance();
+            std::uint8_t uses = 0;
+        };
+        struct Bucket {
+            Slot slots[ways];
+        };
+
+        static std::uint64_t key_(unsigned a, unsigned b) {
+            return a < b ? (std::uint64_t(a) << 32) | b : (std::uint64_t(b) << 32) | a;
+        }
+        std::size_t bucket_(std::uint64_t key) const;
+        std::mutex &lock_(std::size_t bucket) { return locks[bucket % n_locks]; }
+
+        static constexpr std::size_t n_locks = 64;
+
+        std::vector<Bucket> buckets;
+        std::unique_ptr<std::mutex[]> locks;
+        std::atomic<std::size_t> hits{0};
+        std::atomic<std::size_t> misses{0};
+        std::atomic<std::size_t> evictions{0};
+        std::atomic<std::size_t> entries{0};
+    };
+
+} // end namespace
+
+#include "distance_cache.cpp" // include the implementation
+
+#endif //_METRIC_SPACE_DISTANCE_CACHE_HPP
@@ -27,7 +27,7 @@ Graph<WeightType, isDense, isSymmetric>::Graph(const std::vector<std::pair<size_
 }
 
 template <typename WeightType, bool isDense, bool isSymmetric>
-Graph<WeightType, isDense, isSymmetric>::Graph(MatrixType && matrix) /*: m(matrix)*/
+Graph<WeightType, isDense, isSymmetric>::Graph(MatrixType && matrix) : nodesNumber(matrix.rows()), valid(true)
 {
     m = std::move(matrix);
 }
@@ -0,0 +1,345 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#include "hnsw.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+
+namespace metric {
+namespace graph {
+
+template <class recType, class Metric>
+HNSW<recType, Metric>::HNSW(Metric d, HNSWOptions options) : metric_(d), options_(options) {
+    options_.M = std::max<std::size_t>(options_.M, 2);
+}
+
+template <class recType, class Metric>
+HNSW<recType, Metric>::HNSW(const std::vector<recType> &p, Metric d, HNSWOptions options) : HNSW(d, options) {
+    insert(p);
+}
+
+template <class recType, class Metric>
+bool HNSW<recType, Metric>::insert(const recType &p) {
+    std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    link_(add_node_(p)->ID);
+    return true;
+}
+
+/*** nodes are allocated up front, so the IDs of a batch are consecutive and nodes_ does not move while linking ***/
+template <class recType, class Metric>
+bool HNSW<recType, Metric>::insert(const std::vector<recType> &p) {
+    std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    auto first = nodes_.size();
+    nodes_.reserve(first + p.size());
+    for (auto &r : p)
+        add_node_(r);
+    auto &pool = metric_space::ThreadPool::global();
+    pool.parallel_for(p.size(), 64, [&](std::size_t begin, std::size_t end, metric_space::ThreadPool::Worker) {
+        for (auto i = begin; i < end; ++i)
+            link_(first + i);
+    });
+    return true;
+}
+
+template <class recType, class Metric>
+recType HNSW<recType, Metric>::operator[](std::size_t id) const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    return nodes_[id]->data;
+}
+
+template <class recType, class Metric>
+typename HNSW<recType, Metric>::Node_ptr HNSW<recType, Metric>::get_node(std::size_t id) const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    return id < nodes_.size() ? nodes_[id].get() : nullptr;
+}
+
+template <class recType, class Metric>
+std::size_t HNSW<recType, Metric>::size() const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    return nodes_.size();
+}
+
+template <class recType, class Metric>
+int HNSW<recType, Metric>::max_level() const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    return top_;
+}
+
+template <class recType, class Metric>
+void HNSW<recType, Metric>::set_ef(std::size_t ef) {
+    std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    options_.ef = ef;
+}
+
+template <class recType, class Metric>
+typename HNSW<recType, Metric>::Node_ptr HNSW<recType, Metric>::nn(const recType &p) const {
+    auto found = knn(p, 1);
+    return found.empty() ? nullptr : found[0].first;
+}
+
+template <class recType, class Metric>
+std::vector<std::pair<typename HNSW<recType, Metric>::Node_ptr, typename HNSW<recType, Metric>::Distance>>
+HNSW<recType, Metric>::knn(const recType &p, unsigned k) const {
+    std::size_t ef;
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        ef = options_.ef;
+    }
+    return knn(p, k, ef);
+}
+
+template <class recType, class Metric>
+std::vector<std::pair<typename HNSW<recType, Metric>::Node_ptr, typename HNSW<recType, Metric>::Distance>>
+HNSW<recType, Metric>::knn(const recType &p, unsigned k, std::size_t ef) const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    std::vector<std::pair<Node_ptr, Distance>> result;
+    if (top_ < 0 || k == 0)
+        return result;
+    Distance d = metric_(p, nodes_[entry_]->data);
+    auto ep = greedy_(p, entry_, d, top_, 0, false);
+    std::vector<Candidate> found;
+    search_layer_(p, std::vector<Candidate>(1, Candidate(d, ep)), std::max<std::size_t>(ef, k), 0, false, found);
+    if (found.size() > k)
+        found.resize(k);
+    result.reserve(found.size());
+    for (auto &c : found)
+        result.emplace_back(nodes_[c.second].get(), c.first);
+    return result;
+}
+
+template <class recType, class Metric>
+Graph<bool, false, false> HNSW<recType, Metric>::get_graph(int layer) const {
+    std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+    (void)lk;
+    auto n = nodes_.size();
+    std::size_t nonzeros = 0;
+    for (auto &node : nodes_)
+        if (node->level >= layer)
+            nonzeros += node->links[layer].size();
+    blaze::CompressedMatrix<bool> matrix(n, n);
+    matrix.reserve(nonzeros);
+    std::vector<std::size_t> row;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (nodes_[i]->level >= layer) {
+            row = nodes_[i]->links[layer];
+            std::sort(row.begin(), row.end());
+            for (auto j : row)
+                matrix.append(i, j, true);
+        }
+        matrix.finalize(i);
+    }
+    return make_graph(std::move(matrix));
+}
+
+/*** floor(-ln(u) / ln(M)) from a splitmix64 hash of seed and ID ***/
+template <class recType, class Metric>
+int HNSW<recType, Metric>::draw_level_(std::size_t id) const {
+    std::uint64_t z = options_.seed + 0x9e3779b97f4a7c15ull * (id + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    double u = double((z >> 11) + 1) / double(std::uint64_t(1) << 53); // (0, 1]
+    return int(-std::log(u) / std::log(double(options_.M)));
+}
+
+template <class recType, class Metric>
+typename HNSW<recType, Metric>::Node_ptr HNSW<recType, Metric>::add_node_(const recType &p) {
+    std::unique_ptr<Node> node(new Node());
+    node->data = p;
+    node->ID = nodes_.size();
+    node->level = draw_level_(node->ID);
+    node->links.resize(node->level + 1);
+    nodes_.push_back(std::move(node));
+    return nodes_.back().get();
+}
+
+/***
+  a node that becomes the new entry point keeps entry_mut_ until it is linked, the other ones
+  only lock the node they read or change, one at a time
+*/
+template <class recType, class Metric>
+void HNSW<recType, Metric>::link_(std::size_t id) {
+    Node &x = *nodes_[id];
+    std::unique_lock<std::mutex> entry_lock(entry_mut_);
+    if (top_ < 0) {
+        entry_ = id;
+        top_ = x.level;
+        return;
+    }
+    auto ep = entry_;
+    auto top = top_;
+    if (x.level <= top)
+        entry_lock.unlock();
+
+    Distance d = metric_(x.data, nodes_[ep]->data);
+    ep = greedy_(x.data, ep, d, top, x.level, true);
+    std::vector<Candidate> entry(1, Candidate(d, ep)), found, shrink;
+    std::vector<std::size_t> chosen;
+    for (int layer = std::min(x.level, top); layer >= 0; --layer) {
+        search_layer_(x.data, entry, options_.ef_construction, layer, true, found);
+        select_(found, options_.M, chosen);
+        // x is already reachable from its upper layers, another thread may have linked back to it here
+        auto m_max = layer == 0 ? 2 * options_.M : options_.M;
+        {
+            std::lock_guard<std::mutex> lk(x.mut);
+            auto &links = x.links[layer];
+            for (auto n : chosen)
+                if (std::find(links.begin(), links.end(), n) == links.end())
+                    links.push_back(n);
+            if (links.size() > m_max) {
+                shrink.clear();
+                for (auto o : links)
+                    shrink.emplace_back(metric_(x.data, nodes_[o]->data), o);
+                std::sort(shrink.begin(), shrink.end());
+                select_(shrink, m_max, links);
+            }
+        }
+        // back links, a full list keeps the most diverse of its links and the new one
+        for (auto n : chosen) {
+            Node &y = *nodes_[n];
+            std::lock_guard<std::mutex> lk(y.mut);
+            auto &links = y.links[layer];
+            if (std::find(links.begin(), links.end(), id) != links.end())
+                continue;
+            if (links.size() < m_max) {
+                links.push_back(id);
+                continue;
+            }
+            shrink.clear();
+            shrink.emplace_back(metric_(y.data, x.data), id);
+            for (auto o : links)
+                shrink.emplace_back(metric_(y.data, nodes_[o]->data), o);
+            std::sort(shrink.begin(), shrink.end());
+            select_(shrink, m_max, links);
+        }
+        entry.swap(found);
+    }
+    if (x.level > top) {
+        entry_ = id;
+        top_ = x.level;
+    }
+}
+
+template <class recType, class Metric>
+void HNSW<recType, Metric>::links_of_(const Node &node, int layer, bool locked, std::vector<std::size_t> &out) const {
+    if (locked) {
+        std::lock_guard<std::mutex> lk(const_cast<Node &>(node).mut);
+        out = node.links[layer];
+    } else {
+        out = node.links[layer];
+    }
+}
+
+template <class recType, class Metric>
+std::size_t HNSW<recType, Metric>::greedy_(const recType &q, std::size_t ep, Distance &d, int from, int to, bool locked) const {
+    std::vector<std::size_t> links;
+    for (int layer = from; layer > to; --layer) {
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            links_of_(*nodes_[ep], layer, locked, links);
+            for (auto n : links) {
+                Distance dn = metric_(q, nodes_[n]->data);
+                if (dn < d) {
+                    d = dn;
+                    ep = n;
+                    moved = true;
+                }
+            }
+        }
+    }
+    return ep;
+}
+
+/*** beam search: expand the closest open candidate until it is farther than the ef-th closest found ***/
+template <class recType, class Metric>
+void HNSW<recType, Metric>::search_layer_(const recType &q, const std::vector<Candidate> &entry, std::size_t ef, int layer,
+                                          bool locked, std::vector<Candidate> &found) const {
+    // visited marks per thread, a new epoch per search instead of clearing them
+    struct Visited {
+        std::vector<std::uint32_t> marks;
+        std::uint32_t epoch = 0;
+    };
+    static thread_local Visited visited;
+    if (visited.marks.size() < nodes_.size())
+        visited.marks.resize(nodes_.size(), 0);
+    if (++visited.epoch == 0) {
+        std::fill(visited.marks.begin(), visited.marks.end(), 0);
+        visited.epoch = 1;
+    }
+
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> open; // closest first
+    std::priority_queue<Candidate> best;                                                 // farthest of the ef closest on top
+    for (auto &c : entry) {
+        if (visited.marks[c.second] == visited.epoch)
+            continue;
+        visited.marks[c.second] = visited.epoch;
+        open.push(c);
+        best.push(c);
+        if (best.size() > ef)
+            best.pop();
+    }
+    std::vector<std::size_t> links;
+    while (!open.empty()) {
+        auto c = open.top();
+        if (best.size() >= ef && c.first > best.top().first)
+            break;
+        open.pop();
+        links_of_(*nodes_[c.second], layer, locked, links);
+        for (auto n : links) {
+            if (visited.marks[n] == visited.epoch)
+                continue;
+            visited.marks[n] = visited.epoch;
+            Distance d = metric_(q, nodes_[n]->data);
+            if (best.size() < ef || d < best.top().first) {
+                open.emplace(d, n);
+                best.emplace(d, n);
+                if (best.size() > ef)
+                    best.pop();
+            }
+        }
+    }
+    found.resize(best.size());
+    for (auto i = found.size(); i > 0; --i) {
+        found[i - 1] = best.top();
+        best.pop();
+    }
+}
+
+/*** neighbour heuristic: a candidate is kept if it is closer to the query than to every one kept before it ***/
+template <class recType, class Metric>
+void HNSW<recType, Metric>::select_(const std::vector<Candidate> &candidates, std::size_t m, std::vector<std::size_t> &chosen) const {
+    chosen.clear();
+    for (auto &c : candidates) {
+        if (chosen.size() >= m)
+            break;
+        bool diverse = true;
+        for (auto r : chosen) {
+            if (metric_(nodes_[c.second]->data, nodes_[r]->data) < c.first) {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse)
+            chosen.push_back(c.second);
+    }
+}
+
+} // namespace graph
+} // namespace metric
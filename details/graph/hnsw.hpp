@@ -0,0 +1,113 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_GRAPH_HNSW_HPP
+#define _METRIC_GRAPH_HNSW_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../graph.hpp"
+#include "../thread_pool.hpp"
+
+namespace metric {
+namespace graph {
+/*
+  |  | \ |  __|\ \      /
+  __ |.  |\__ \ \ \ \  /
+ _| _|_|\_|____/  \_/\_/
+
+  hierarchical navigable small world graph: approximate nearest neighbours for any metric
+*/
+
+/*** build and search parameters of HNSW ***/
+struct HNSWOptions {
+    std::size_t M = 16;                // links per record on the upper layers, 2 M on layer 0
+    std::size_t ef_construction = 200; // beam width while linking a new record
+    std::size_t ef = 50;               // beam width of nn and knn, k at least
+    std::uint64_t seed = 42;           // layers are drawn from the seed and the ID, independent of thread timing
+};
+
+/***
+  records sit on layer 0 and, with a probability falling by a factor M per layer, on the layers
+  above. A search descends greedily from the entry point on the top layer and widens to a beam
+  of ef candidates on layer 0. Unlike the cover tree its cost does not grow towards brute force
+  with the intrinsic dimension of the data, but the results are approximate: raise ef for recall.
+  nn and knn answer like Tree's, so either index can be picked per dataset.
+ */
+template <class recType, class Metric>
+class HNSW {
+public:
+    using Distance = typename std::result_of<Metric(recType, recType)>::type;
+
+    struct Node {
+        recType data;
+        std::size_t ID;
+        int level;                                   // top layer of the record
+        std::vector<std::vector<std::size_t>> links; // IDs of the neighbours, per layer 0..level
+        std::mutex mut;                              // guards links while the graph is built in parallel
+
+        recType get_data() const { return data; }
+        std::size_t get_ID() const { return ID; }
+    };
+    using Node_ptr = Node *;
+
+    /*** Constructors ***/
+    explicit HNSW(Metric d = Metric(), HNSWOptions options = HNSWOptions());                // empty graph
+    HNSW(const std::vector<recType> &p, Metric d = Metric(), HNSWOptions options = HNSWOptions()); // built in parallel
+    HNSW(const HNSW &) = delete;
+    HNSW &operator=(const HNSW &) = delete;
+
+    /*** Access Operations ***/
+    bool insert(const recType &p);              // link one record
+    bool insert(const std::vector<recType> &p); // link the records in parallel on metric_space::ThreadPool::global()
+    recType operator[](std::size_t id) const;   // access a data record by ID
+    Node_ptr get_node(std::size_t id) const;    // nullptr if the ID is unknown
+    std::size_t size() const;
+    int max_level() const;                      // top layer, -1 while empty
+
+    /*** Nearest Neighbour search, approximate ***/
+    Node_ptr nn(const recType &p) const;
+    std::vector<std::pair<Node_ptr, Distance>> knn(const recType &p, unsigned k = 10) const;
+    std::vector<std::pair<Node_ptr, Distance>> knn(const recType &p, unsigned k, std::size_t ef) const; // beam width of this query
+    void set_ef(std::size_t ef);                                                                       // beam width of later queries
+
+    /*** links of one layer as a directed graph over the IDs ***/
+    Graph<bool, false, false> get_graph(int layer = 0) const;
+
+private:
+    using Candidate = std::pair<Distance, std::size_t>; // distance to the query, ID
+
+    Metric metric_;
+    HNSWOptions options_;
+    std::vector<std::unique_ptr<Node>> nodes_; // node of every ID
+    std::size_t entry_ = 0;                    // record on the top layer where every search starts
+    int top_ = -1;                             // its level, -1 while empty
+    std::mutex entry_mut_;                     // entry point while records are linked in parallel
+    mutable std::shared_timed_mutex global_mut; // inserts exclusive, queries shared
+
+    int draw_level_(std::size_t id) const;
+    Node_ptr add_node_(const recType &p); // unlinked node with the next ID
+    void link_(std::size_t id);           // connect a node to the graph, safe to run for several nodes at once
+    std::size_t greedy_(const recType &q, std::size_t ep, Distance &d, int from, int to, bool locked) const; // closest on layer to + 1
+    void search_layer_(const recType &q, const std::vector<Candidate> &entry, std::size_t ef, int layer, bool locked,
+                       std::vector<Candidate> &found) const; // found: the ef closest seen, ascending
+    void select_(const std::vector<Candidate> &candidates, std::size_t m, std::vector<std::size_t> &chosen) const;
+    void links_of_(const Node &node, int layer, bool locked, std::vector<std::size_t> &out) const;
+};
+
+} // namespace graph
+} // namespace metric
+
+#include "hnsw.cpp"
+
+#endif // header guards
@@ -0,0 +1,76 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#include "range_join.hpp"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace metric {
+namespace graph {
+
+template <class recType, class Metric>
+Graph<float> range_join(const metric_space::Tree<recType, Metric> &tree,
+                        typename std::result_of<Metric(recType, recType)>::type distance) {
+    std::vector<std::size_t> labels;
+    return range_join(tree, distance, labels);
+}
+
+/*** the rows are appended in order, the reserve/append/finalize way of filling a compressed matrix ***/
+template <class recType, class Metric>
+Graph<float> range_join(const metric_space::Tree<recType, Metric> &tree,
+                        typename std::result_of<Metric(recType, recType)>::type distance, std::vector<std::size_t> &labels) {
+    auto upper = tree.range_pairs(distance);
+    auto n = upper.size();
+
+    // mirror: visiting the rows in ascending order keeps every lower row sorted
+    std::vector<std::vector<std::pair<std::size_t, float>>> lower(n);
+    std::size_t nonzeros = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        for (auto &e : upper[i])
+            lower[e.first].emplace_back(i, float(e.second));
+        nonzeros += 2 * upper[i].size();
+    }
+    blaze::CompressedMatrix<float> matrix(n, n);
+    matrix.reserve(nonzeros);
+    for (std::size_t i = 0; i < n; ++i) {
+        for (auto &e : lower[i])
+            matrix.append(i, e.first, e.second);
+        for (auto &e : upper[i])
+            matrix.append(i, e.first, float(e.second));
+        matrix.finalize(i);
+    }
+
+    // union find over the edges, components numbered by their smallest ID
+    std::vector<std::size_t> parent(n);
+    std::iota(parent.begin(), parent.end(), std::size_t(0));
+    auto find = [&](std::size_t i) {
+                    while (parent[i] != i)
+                        i = parent[i] = parent[parent[i]];
+                    return i;
+                };
+    for (std::size_t i = 0; i < n; ++i) {
+        for (auto &e : upper[i]) {
+            auto a = find(i), b = find(e.first);
+            if (a != b)
+                parent[std::max(a, b)] = std::min(a, b);
+        }
+    }
+    labels.assign(n, std::numeric_limits<std::size_t>::max());
+    std::size_t components = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (tree.get_node(unsigned(i)) == nullptr)
+            continue;
+        auto r = find(i);
+        labels[i] = r == i ? components++ : labels[r];
+    }
+    return Graph<float>(blaze::SymmetricMatrix<blaze::CompressedMatrix<float>>(matrix));
+}
+
+} // namespace graph
+} // namespace metric
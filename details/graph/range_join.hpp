@@ -0,0 +1,39 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_GRAPH_RANGE_JOIN_HPP
+#define _METRIC_GRAPH_RANGE_JOIN_HPP
+
+#include <type_traits>
+#include <vector>
+#include "../graph.hpp"
+#include "../tree.hpp"
+
+namespace metric {
+namespace graph {
+
+/***
+  similarity self join of a tree: every pair of records closer than distance (see Tree::range_pairs)
+  as a sparse graph over the IDs, weighted by their distance. With labels every ID also gets the
+  connected component it belongs to (DBSCAN style grouping without the density condition),
+  components are numbered by their smallest ID and erased IDs are labeled
+  std::numeric_limits<std::size_t>::max().
+*/
+template <class recType, class Metric>
+Graph<float> range_join(const metric_space::Tree<recType, Metric> &tree,
+                        typename std::result_of<Metric(recType, recType)>::type distance);
+template <class recType, class Metric>
+Graph<float> range_join(const metric_space::Tree<recType, Metric> &tree,
+                        typename std::result_of<Metric(recType, recType)>::type distance, std::vector<std::size_t> &labels);
+
+} // namespace graph
+} // namespace metric
+
+#include "range_join.cpp"
+
+#endif // header guards
@@ -0,0 +1,112 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_SPACE_METRIC_TRAITS_HPP
+#define _METRIC_SPACE_METRIC_TRAITS_HPP
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace metric_space
+{
+/*
+   \  |        |       _)            |                 _)  |
+  |\/ |   -_)   _|   _| |   _|        _|   _| _` |  |   _| (_-<
+ _|  _| \___| \__| _|  _| \__|      \__| _| \__,_| _| \__| ___/
+
+  optional extension points of a metric, detected at compile time
+*/
+    template <class...>
+    struct void_type {
+        using type = void;
+    };
+
+/*** stands in for the prepared form of metrics without prepare ***/
+    struct no_prepared_form {};
+
+    /***
+      prepare: a metric may offer
+
+          Prepared prepare(const recType &r) const;
+          Distance operator()(const Prepared &a, const Prepared &b) const;
+
+      next to its plain operator(). The tree then prepares every record once when it is inserted
+      and every query once per call, and evaluates the metric on the prepared forms only. Norms,
+      padded copies or index arrays a metric would otherwise rebuild on every call belong there.
+      Both operators must give the same distance for the same records.
+     */
+    template <class Metric, class recType, class = void>
+    struct prepare_traits {
+        static constexpr bool has_prepare = false;
+        using prepared_type = no_prepared_form;
+    };
+
+    template <class Metric, class recType>
+    struct prepare_traits<Metric, recType,
+                          typename void_type<decltype(std::declval<const Metric &>().prepare(std::declval<const recType &>()))>::type> {
+        static constexpr bool has_prepare = true;
+        using prepared_type = typename std::decay<decltype(std::declval<const Metric &>().prepare(std::declval<const recType &>()))>::type;
+    };
+
+    /***
+      bounded: a metric may offer
+
+          Distance operator()(const Arg &a, const Arg &b, Distance bound) const;
+
+      on the arguments the tree passes (the prepared forms if there is prepare, the records
+      otherwise). It returns the distance if that is at most bound. Once a partial sum or a row
+      minimum shows the distance exceeds bound it may stop and return any value in (bound, distance],
+      the tree then only uses it as a lower bound.
+     */
+    template <class Metric, class Arg, class = void>
+    struct bounded_traits {
+        static constexpr bool has_bounded = false;
+    };
+
+    template <class Metric, class Arg>
+    struct bounded_traits<Metric, Arg,
+                          typename void_type<decltype(std::declval<const Metric &>()(
+                              std::declval<const Arg &>(), std::declval<const Arg &>(),
+                              std::declval<const Metric &>()(std::declval<const Arg &>(), std::declval<const Arg &>())))>::type> {
+        static constexpr bool has_bounded = true;
+    };
+
+    /***
+      lower bounds: a metric may offer
+
+          std::tuple<Bound1, Bound2, ...> lower_bounds() const;
+
+      function objects with Distance operator()(const Arg &a, const Arg &b) const on the same
+      arguments as above, each at most the distance, listed cheapest first (a difference of norms
+      before an envelope bound, say). The tree tries them in that order on a candidate and calls
+      the metric only if none of them already puts it out of reach, see Tree::lower_bound_stats.
+     */
+    template <class Metric, class = void>
+    struct lower_bound_traits {
+        static constexpr std::size_t lower_bound_count = 0;
+        using lower_bounds_type = std::tuple<>;
+    };
+
+    template <class Metric>
+    struct lower_bound_traits<Metric, typename void_type<decltype(std::declval<const Metric &>().lower_bounds())>::type> {
+        using lower_bounds_type = typename std::decay<decltype(std::declval<const Metric &>().lower_bounds())>::type;
+        static constexpr std::size_t lower_bound_count = std::tuple_size<lower_bounds_type>::value;
+    };
+
+/*** all extension points of Metric on recType ***/
+    template <class Metric, class recType>
+    struct metric_traits : prepare_traits<Metric, recType>, lower_bound_traits<Metric> {
+        using argument_type = typename std::conditional<prepare_traits<Metric, recType>::has_prepare,
+                                                        typename prepare_traits<Metric, recType>::prepared_type, recType>::type;
+        static constexpr bool has_bounded = bounded_traits<Metric, argument_type>::has_bounded;
+    };
+
+} // end namespace
+
+#endif //_METRIC_SPACE_METRIC_TRAITS_HPP
@@ -0,0 +1,152 @@
+/*This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.*/
+/* Michael Welsch (c) 2018 */
+
+#include "result_cache.hpp" // back reference for header only use
+#include <algorithm>
+#include <limits>
+
+namespace metric_space
+{
+    template <class recType, class Value, class Distance>
+    ResultCache<recType, Value, Distance>::ResultCache(std::size_t capacity, Hash hash, bool by_region)
+        : hash(std::move(hash)), by_region(by_region) {
+        // one lock per shard, small caches get fewer shards so that uneven hashing does not evict early
+        std::size_t n = std::max<std::size_t>(1, std::min<std::size_t>(16, capacity / 64));
+        shard_capacity = std::max<std::size_t>(1, capacity / n);
+        for (std::size_t i = 0; i < n; ++i)
+            shards.emplace_back(new Shard);
+    }
+
+    template <class recType, class Value, class Distance>
+    std::size_t ResultCache<recType, Value, Distance>::key_(const recType &q, std::size_t k, Distance r) const {
+        std::size_t key = hash(q);
+        key ^= std::hash<std::size_t>()(k) + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+        key ^= std::hash<Distance>()(r) + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+        return key;
+    }
+
+    template <class recType, class Value, class Distance>
+    typename std::list<typename ResultCache<recType, Value, Distance>::Entry>::iterator
+    ResultCache<recType, Value, Distance>::lookup_(Shard &shard, std::size_t key, const recType &q, std::size_t k, Distance r) {
+        auto range = shard.index.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto &entry = *it->second;
+            if (entry.k == k && entry.r == r && entry.query == q)
+                return it->second;
+        }
+        return shard.lru.end();
+    }
+
+    template <class recType, class Value, class Distance>
+    void ResultCache<recType, Value, Distance>::erase_(Shard &shard, typename std::list<Entry>::iterator it) {
+        auto range = shard.index.equal_range(it->key);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == it) {
+                shard.index.erase(i);
+                break;
+            }
+        }
+        shard.lru.erase(it);
+    }
+
+/*** an entry is stale if it predates the log, or a logged change since its epoch reaches into its radius ***/
+    template <class recType, class Value, class Distance>
+    template <class DistanceFunction>
+    bool ResultCache<recType, Value, Distance>::stale_(const Entry &entry, DistanceFunction &dist) const {
+        if (!by_region || entry.epoch < first_logged || entry.radius == std::numeric_limits<Distance>::max())
+            return true;
+        for (auto i = entry.epoch - first_logged; i < log.size(); ++i) {
+            if (dist(entry.query, log[i].center) - log[i].radius <= entry.radius)
+                return true;
+        }
+        return false;
+    }
+
+    template <class recType, class Value, class Distance>
+    template <class DistanceFunction>
+    bool ResultCache<recType, Value, Distance>::find(const recType &q, std::size_t k, Distance r, Value &out,
+                                                    DistanceFunction &&dist) {
+        std::size_t key = key_(q, k, r);
+        auto &shard = shard_(key);
+        std::lock_guard<std::mutex> lk(shard.mut);
+        auto it = lookup_(shard, key, q, k, r);
+        if (it == shard.lru.end()) {
+            misses++;
+            return false;
+        }
+        std::uint64_t now = epoch_;
+        if (it->epoch != now) {
+            if (stale_(*it, dist)) {
+                erase_(shard, it);
+                invalidated++;
+                misses++;
+                return false;
+            }
+            it->epoch = now;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it);
+        out = it->value;
+        hits++;
+        return true;
+    }
+
+    template <class recType, class Value, class Distance>
+    void ResultCache<recType, Value, Distance>::store(const recType &q, std::size_t k, Distance r, const Value &value,
+                                                      Distance radius) {
+        std::size_t key = key_(q, k, r);
+        auto &shard = shard_(key);
+        std::lock_guard<std::mutex> lk(shard.mut);
+        auto it = lookup_(shard, key, q, k, r);
+        if (it != shard.lru.end()) {
+            it->value = value;
+            it->radius = radius;
+            it->epoch = epoch_;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it);
+            return;
+        }
+        shard.lru.push_front(Entry{q, k, r, key, value, radius, epoch_});
+        shard.index.emplace(key, shard.lru.begin());
+        if (shard.lru.size() > shard_capacity)
+            erase_(shard, std::prev(shard.lru.end()));
+    }
+
+    template <class recType, class Value, class Distance>
+    void ResultCache<recType, Value, Distance>::changed(const recType &center, Distance radius) {
+        if (by_region) {
+            log.push_back(Change{center, radius});
+            if (log.size() > max_log) {
+                log.pop_front();
+                first_logged++;
+            }
+        }
+        epoch_++;
+    }
+
+    template <class recType, class Value, class Distance>
+    void ResultCache<recType, Value, Distance>::clear() {
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lk(shard->mut);
+            shard->lru.clear();
+            shard->index.clear();
+        }
+        log.clear();
+        epoch_++;
+        first_logged = epoch_;
+    }
+
+    template <class recType, class Value, class Distance>
+    typename ResultCache<recType, Value, Distance>::Stats ResultCache<recType, Value, Distance>::stats() const {
+        Stats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.invalidated = invalidated;
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lk(shard->mut);
+            s.entries += shard->lru.size();
+        }
+        return s;
+    }
+
+} // end namespace
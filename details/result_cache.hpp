@@ -0,0 +1,115 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_SPACE_RESULT_CACHE_HPP
+#define _METRIC_SPACE_RESULT_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace metric_space
+{
+/*
+   _ \                    |  |       __|             |
+     /   -_) (_-<  |  |   |   _|    (      _` |   _|    \    -_)
+  _|_\ \___| ___/ \_,_| _| \__|   \___| \__,_| \__| _| _| \___|
+
+  bounded query result cache, invalidated by the mutation epoch of the tree
+*/
+    template <class recType, class Value, class Distance>
+    class ResultCache
+    {
+    public:
+        using Hash = std::function<std::size_t(const recType &)>;
+
+        struct Stats {
+            std::size_t hits = 0;
+            std::size_t misses = 0;
+            std::size_t invalidated = 0; // entries found stale because of a later change
+            std::size_t entries = 0;
+        };
+
+        /***
+          capacity entries in total, least recently used ones are evicted first. hash must be
+          consistent with recType's operator==, which decides whether a query is a repeat.
+
+          without by_region every change of the tree makes all entries stale. With by_region an
+          entry only becomes stale if a change came within its radius, the last changes are kept
+          for that and an entry is validated against them when it is found again.
+         */
+        ResultCache(std::size_t capacity, Hash hash, bool by_region);
+        ResultCache(const ResultCache &) = delete;
+        ResultCache &operator=(const ResultCache &) = delete;
+
+        /***
+          find and store may run concurrently, changed and clear not with any other call.
+          The key is (q, k, r), dist(a, b) is only called to validate an entry by region.
+         */
+        template <class DistanceFunction>
+        bool find(const recType &q, std::size_t k, Distance r, Value &out, DistanceFunction &&dist);
+        void store(const recType &q, std::size_t k, Distance r, const Value &value,
+                   Distance radius); // the result only depends on records within radius of q
+        void changed(const recType &center, Distance radius); // records within radius of center changed
+        void clear();
+
+        Stats stats() const;
+        std::uint64_t epoch() const { return epoch_; }
+
+    private:
+        struct Entry {
+            recType query;
+            std::size_t k;
+            Distance r;
+            std::size_t key;     // hash of (query, k, r)
+            Value value;
+            Distance radius;
+            std::uint64_t epoch; // epoch the entry is known to be valid at
+        };
+        struct Change {
+            recType center;
+            Distance radius;
+        };
+        struct Shard {
+            std::mutex mut;
+            std::list<Entry> lru; // most recently used first
+            std::unordered_multimap<std::size_t, typename std::list<Entry>::iterator> index;
+        };
+
+        std::size_t key_(const recType &q, std::size_t k, Distance r) const;
+        Shard &shard_(std::size_t key) { return *shards[key % shards.size()]; }
+        typename std::list<Entry>::iterator lookup_(Shard &shard, std::size_t key, const recType &q, std::size_t k, Distance r);
+        void erase_(Shard &shard, typename std::list<Entry>::iterator it);
+        template <class DistanceFunction>
+        bool stale_(const Entry &entry, DistanceFunction &dist) const;
+
+        static constexpr std::size_t max_log = 256; // changes kept for validation by region
+
+        Hash hash;
+        bool by_region;
+        std::size_t shard_capacity;
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::atomic<std::uint64_t> epoch_{0};
+        std::deque<Change> log;         // log[i] moved the epoch from first_logged + i to first_logged + i + 1
+        std::uint64_t first_logged = 0;
+        std::atomic<std::size_t> hits{0};
+        std::atomic<std::size_t> misses{0};
+        std::atomic<std::size_t> invalidated{0};
+    };
+
+} // end namespace
+
+#include "result_cache.cpp" // include the implementation
+
+#endif //_METRIC_SPACE_RESULT_CACHE_HPP
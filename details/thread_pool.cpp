@@ -0,0 +1,130 @@
+/*This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.*/
+/* Michael Welsch (c) 2018 */
+
+#include "thread_pool.hpp" // back reference for header only use
+#include <algorithm>
+
+namespace metric_space
+{
+    inline ThreadPool::ThreadPool(std::size_t threads) {
+        // queue size() belongs to the threads calling parallel_for
+        for (std::size_t i = 0; i <= threads; ++i)
+            queues.emplace_back(new Queue);
+        for (std::size_t i = 0; i < threads; ++i)
+            workers.emplace_back(&ThreadPool::work, this, i);
+    }
+
+    inline ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(sleep_mut);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers)
+            w.join();
+    }
+
+    inline std::size_t ThreadPool::default_threads() {
+        auto cores = std::thread::hardware_concurrency();
+        return cores > 1 ? cores - 1 : 0;
+    }
+
+    inline ThreadPool &ThreadPool::global() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    inline void ThreadPool::push(Task task) {
+        auto &queue = *queues[next_queue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lk(queue.mut);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lk(sleep_mut);
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+/*** a calling thread passes its group and only helps with its own tasks, workers take any ***/
+    inline bool ThreadPool::run_one(Worker worker, const void *group) {
+        Task task;
+        for (std::size_t i = 0; i < queues.size() && !task.run; ++i) {
+            auto &queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lk(queue.mut);
+            if (queue.tasks.empty())
+                continue;
+            if (group != nullptr) {
+                auto it = std::find_if(queue.tasks.begin(), queue.tasks.end(),
+                                       [group](const Task &t) { return t.group == group; });
+                if (it != queue.tasks.end()) {
+                    task = std::move(*it);
+                    queue.tasks.erase(it);
+                }
+            } else if (i == 0) { // own queue, newest first
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else { // steal the oldest
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task.run)
+            return false;
+        pending--;
+        task.run(worker);
+        return true;
+    }
+
+    inline void ThreadPool::work(Worker worker) {
+        while (true) {
+            if (run_one(worker))
+                continue;
+            std::unique_lock<std::mutex> lk(sleep_mut);
+            wake.wait(lk, [this] { return stop || pending > 0; });
+            if (stop)
+                return;
+        }
+    }
+
+    template <class Function>
+    void ThreadPool::parallel_for(std::size_t n, std::size_t grain, Function &&f) {
+        if (n == 0)
+            return;
+        grain = std::max<std::size_t>(grain, 1);
+        std::size_t chunks = (n + grain - 1) / grain;
+        if (workers.empty() || chunks == 1) {
+            f(std::size_t(0), n, size());
+            return;
+        }
+
+        // the tasks only refer to this frame, it is left after the last chunk reported back
+        std::atomic<std::size_t> remaining(chunks);
+        std::exception_ptr error;
+        std::mutex error_mut;
+        for (std::size_t c = 0; c < chunks; ++c) {
+            std::size_t begin = c * grain;
+            std::size_t end = std::min(n, begin + grain);
+            push({&remaining, [&, begin, end](Worker worker) {
+                try {
+                    f(begin, end, worker);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lk(error_mut);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                remaining--;
+            }});
+        }
+        while (remaining > 0) {
+            if (!run_one(size(), &remaining))
+                std::this_thread::yield();
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+} // end namespace
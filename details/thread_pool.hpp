@@ -0,0 +1,87 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Signal Empowering Technology ®Michael Welsch
+*/
+
+#ifndef _METRIC_SPACE_THREAD_POOL_HPP
+#define _METRIC_SPACE_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace metric_space
+{
+/*
+  __ __|  |                            |       _ \               |
+     |      \    _| -_)  _` |   _` |    |      __/  _ \   _ \   |
+    _|   _| _| _| \___| \__,_| \__,_|   _|     _|  \___/ \___/  _|
+
+  work stealing pool for batch queries
+*/
+    class ThreadPool
+    {
+    public:
+        /*** index of a worker, the thread calling parallel_for helps with index size() ***/
+        using Worker = std::size_t;
+
+        explicit ThreadPool(std::size_t threads = default_threads());
+        ~ThreadPool();
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        std::size_t size() const { return workers.size(); } // number of worker threads
+
+        /***
+          call f(begin, end, worker) for chunks of at most grain indices covering [0, n)
+
+          chunks are dealt round robin to the worker queues, idle workers steal from the others
+          and the calling thread takes part in its own chunks until every chunk is done. worker
+          is in [0, size()] and no two chunks of one call run with the same worker at once, so
+          per worker scratch data can be indexed by it. The first exception thrown by f is
+          rethrown after all chunks finished.
+         */
+        template <class Function>
+        void parallel_for(std::size_t n, std::size_t grain, Function &&f);
+
+        /*** process wide pool, one worker per core next to the calling thread ***/
+        static ThreadPool &global();
+        static std::size_t default_threads();
+
+    private:
+        struct Task {
+            const void *group = nullptr; // the parallel_for call the task belongs to
+            std::function<void(Worker)> run;
+        };
+        struct Queue {
+            std::mutex mut;
+            std::deque<Task> tasks;
+        };
+
+        void push(Task task);
+        bool run_one(Worker worker, const void *group = nullptr); // own queue from the back, else steal from the front of another
+        void work(Worker worker);
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<std::size_t> pending{0}; // queued, not yet taken tasks
+        std::atomic<std::size_t> next_queue{0};
+        std::atomic<bool> stop{false};
+        std::mutex sleep_mut;
+        std::condition_variable wake;
+    };
+
+} // end namespace
+
+#include "thread_pool.cpp" // include the implementation
+
+#endif //_METRIC_SPACE_THREAD_POOL_HPP
@@ -18,6 +18,12 @@
 #define SERIALIZATION_NVP(variable) (variable)
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define METRIC_SPACE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define METRIC_SPACE_PREFETCH(address)
+#endif
+
 #ifdef BOOST_SERIALIZATION_SPLIT_MEMBER
 #define SERIALIZE_SPLIT_MEMBERS BOOST_SERIALIZATION_SPLIT_MEMBER
 #else
@@ -48,6 +54,20 @@ namespace metric_space {
             }
             return std::sqrt(sum);
         }
+
+        // stops once the partial sum passes bound, looked at every 8 coordinates
+        result_type operator()(const Container &a, const Container &b, result_type bound) const {
+            result_type sum = 0;
+            result_type limit = bound * bound;
+            std::size_t n = 0;
+            for (auto it1 = a.begin(), it2 = b.begin();
+                 it1 != a.end() || it2 != b.end(); ++it1, ++it2) {
+                sum += (*it1 - *it2) * (*it1 - *it2);
+                if ((++n & 7) == 0 && sum > limit)
+                    break;
+            }
+            return std::sqrt(sum);
+        }
     };
 
 /*
@@ -78,18 +98,23 @@ namespace metric_space {
         // private:
         Distance base;
         recType data; // data record associated with the node
+        typename Tree<recType, Metric>::Prepared prepared; // prepared form of data, see metric_traits.hpp
         recType center_of_mass;
 
         Node_ptr parent = nullptr;      // parent of current node
         std::vector<Node_ptr> children; // list of children
         int level = 0;                  // current level of the node
-        Distance parent_dist = 0; // upper bound of distance to any of descendants
+        Distance parent_dist = 0; // distance to the parent
+        Distance maxdist = 0;     // upper bound of distance to any of descendants, loosened by root raise and erase
+        AttributeSummary summary; // attributes of the record and all descendants, see Tree::set_summary
+        std::size_t subtree_size = 1; // records in the subtree, the node included
         unsigned ID = 0;          // unique ID of current node
 
         //    mutable std::shared_timed_mutex mut; // lock for current node
     public:
         unsigned get_ID() const { return ID; }
         void set_ID(const unsigned v) { ID = v; }
+        void set_tree(Tree<recType, Metric> *tree) { tree_ptr = tree; }
         const recType get_data() const { return data; }
         void set_data(const recType &r) { data = r; }
         Node_ptr get_parent() const { return parent; }
@@ -99,6 +124,7 @@ namespace metric_space {
         void set_level(int l) { level = l; }
         Distance get_parent_dist() const { return parent_dist; }
         void set_parent_dist(const Distance &d) { parent_dist = d; }
+        Distance get_maxdist() const { return maxdist; }
 
         Distance covdist(); // covering distance of subtree at current node
         Distance sepdist(); // separating distance between nodes at current level
@@ -106,6 +132,8 @@ namespace metric_space {
         Distance
         dist(const recType &pp) const;   // distance between this node and point pp
         Distance dist(Node_ptr n) const; // distance between this node and node n
+        Distance dist(const recType &pp, Distance bound) const; // exact up to bound, beyond only a lower bound above it
+        Distance dist(Node_ptr n, Distance bound) const;
 
         Node_ptr
         setChild(const recType &p,
@@ -142,7 +170,8 @@ namespace metric_space {
         }
         template <typename Archive> void serialize(Archive &ar, const unsigned int) {
             ar &SERIALIZATION_NVP(base) & SERIALIZATION_NVP(level) &
-                SERIALIZATION_NVP(parent_dist) & SERIALIZATION_NVP(ID) &
+                SERIALIZATION_NVP(parent_dist) & SERIALIZATION_NVP(maxdist) &
+                SERIALIZATION_NVP(subtree_size) & SERIALIZATION_NVP(ID) &
                 SERIALIZATION_NVP(data);
         }
     };
@@ -209,14 +238,51 @@ namespace metric_space {
     template <class recType, class Metric>
     typename Node<recType, Metric>::Distance
     Node<recType, Metric>::dist(const recType &pp) const {
-        return tree_ptr->metric(data, pp);
+        return tree_ptr->metric(*this, pp);
     }
 
 /*** distance between current node and node n ***/
     template <class recType, class Metric>
     typename Node<recType, Metric>::Distance
     Node<recType, Metric>::dist(Node_ptr n) const {
-        return tree_ptr->metric(data, n->data);
+#ifndef METRIC_SPACE_DISABLE_DISTANCE_CACHE
+        // IDs are never reused, so a pair's distance stays valid for as long as both nodes exist
+        auto cache = tree_ptr->distance_cache_.get();
+        if (cache != nullptr && ID != n->ID) {
+            Distance d;
+            if (cache->find(ID, n->ID, d))
+                return d;
+            d = tree_ptr->metric(*this, *n);
+            cache->store(ID, n->ID, d);
+            return d;
+        }
+#endif
+        return tree_ptr->metric(*this, *n);
+    }
+
+/*** distance that only has to be exact up to bound ***/
+    template <class recType, class Metric>
+    typename Node<recType, Metric>::Distance
+    Node<recType, Metric>::dist(const recType &pp, Distance bound) const {
+        return tree_ptr->metric(*this, pp, bound);
+    }
+
+    template <class recType, class Metric>
+    typename Node<recType, Metric>::Distance
+    Node<recType, Metric>::dist(Node_ptr n, Distance bound) const {
+#ifndef METRIC_SPACE_DISABLE_DISTANCE_CACHE
+        auto cache = tree_ptr->distance_cache_.get();
+        if (cache != nullptr && ID != n->ID) {
+            Distance d;
+            if (cache->find(ID, n->ID, d))
+                return d;
+            d = tree_ptr->metric(*this, *n, bound);
+            if (!(d > bound)) // beyond the bound it is no distance to remember
+                cache->store(ID, n->ID, d);
+            return d;
+        }
+#endif
+        return tree_ptr->metric(*this, *n, bound);
     }
 
 /*** insert a new child of current node with point p ***/
@@ -291,13 +357,9 @@ namespace metric_space {
         min_scale = 1000;
         max_scale = 0;
         truncate_level = truncateArg;
-        N = 1;
+        N = 0;
 
-        root = std::make_unique<NodeType>();
-        root->data = p;
-        root->level = 0;
-        root->parent_dist = 0;
-        root->ID = 0;
+        root = make_node_(p);
     }
 
 /*** constructor: with a vector data records **/
@@ -308,13 +370,9 @@ namespace metric_space {
         min_scale = 1000;
         max_scale = 0;
         truncate_level = truncateArg;
-        N = 1;
+        N = 0;
 
-        root = new NodeType(this); // std::make_unique<NodeType>();
-        root->data = p[0];
-        root->level = 0;
-        root->parent_dist = 0;
-        root->ID = 0;
+        root = make_node_(p[0]);
 
         for (std::size_t i = 1; i < p.size(); ++i) {
             insert(p[i]);
@@ -350,6 +408,243 @@ namespace metric_space {
         return std::make_tuple(idx, dists);
     }
 
+/***
+  append the sorted (distance, child index) pairs of p to sorted and return the offset of the segment.
+  From parallel children on (parallel > 0) the distances are evaluated on ThreadPool::global()
+*/
+    template <class recType, class Metric>
+    template <typename pointOrNodeType>
+    std::size_t Tree<recType, Metric>::sortChildrenByDistance(
+        Node_ptr p, const pointOrNodeType &x,
+        std::vector<std::pair<Distance, int>> &sorted, std::size_t parallel) const {
+        auto begin = sorted.size();
+        auto num_children = p->children.size();
+        if (parallel > 0 && num_children >= parallel) {
+            sorted.resize(begin + num_children);
+            auto &pool = ThreadPool::global();
+            auto grain = std::max<std::size_t>(1, num_children / (4 * (pool.size() + 1)));
+            pool.parallel_for(num_children, grain, [&](std::size_t first, std::size_t last, ThreadPool::Worker) {
+                for (auto i = first; i < last; ++i)
+                    sorted[begin + i] = std::make_pair(p->children[i]->dist(x), int(i));
+            });
+        } else {
+            for (unsigned i = 0; i < num_children; ++i) {
+                sorted.emplace_back(p->children[i]->dist(x), i);
+            }
+        }
+        std::sort(sorted.begin() + begin, sorted.end());
+        return begin;
+    }
+
+/***
+  sortChildrenByDistance minus the children whose subtree is at least radius away from x. The pivot bound
+  rules out children before they are evaluated, then the lower bounds of the metric, cheapest first, and
+  a bounded metric (see metric_traits.hpp) gives up on the rest as soon as they are out
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::sortPivotedChildren_(Node_ptr p, const recType &x, std::vector<std::pair<Distance, int>> &sorted,
+                                                     std::size_t parallel, const Distance *pivots, Context &ctx,
+                                                     Distance radius, std::size_t k) const {
+        const bool bounded = Traits::has_bounded || Traits::lower_bound_count > 0;
+        if (pivots == nullptr && !bounded) {
+            sortChildrenByDistance(p, x, sorted, parallel);
+            return;
+        }
+        auto begin = sorted.size();
+        auto count = pivots == nullptr ? 0 : pivots_.size();
+        auto num_children = p->children.size();
+        for (std::size_t i = 0; i < num_children; ++i) {
+            Node_ptr child = p->children[i];
+            Distance lower = 0;
+            if (count > 0) {
+                const Distance *row = &pivot_table_[child->ID * count];
+                for (std::size_t j = 0; j < count; ++j)
+                    lower = std::max(lower, pivots[j] > row[j] ? pivots[j] - row[j] : row[j] - pivots[j]);
+            }
+            if (lower - child->maxdist < radius)
+                sorted.emplace_back(lower, int(i));
+        }
+        auto kept = sorted.size() - begin;
+        ctx.evaluations -= num_children - kept; // the visit charged every child
+        const Distance abandoned = std::numeric_limits<Distance>::max();
+        auto bounds = lower_bounds_();
+        Prepared scratch;
+        const Argument *q = Traits::lower_bound_count > 0 ? &query_argument_(x, scratch) : nullptr;
+        auto evaluate = [&](std::pair<Distance, int> &entry, Distance r, LowerBoundCounts &counts) {
+            Node_ptr child = p->children[entry.second];
+            auto bound = bound_(r, child->maxdist);
+            Distance lower = 0;
+            if (Traits::lower_bound_count > 0 && lower_bounded_(bounds, argument_(*child), *q, bound, counts, lower)) {
+                entry.first = abandoned;
+                return;
+            }
+            entry.first = Traits::has_bounded ? child->dist(x, bound) : child->dist(x);
+            if (entry.first > bound)
+                entry.first = abandoned;
+        };
+        std::size_t skipped = 0;
+        if (parallel > 0 && kept >= parallel) {
+            auto &pool = ThreadPool::global();
+            auto grain = std::max<std::size_t>(1, kept / (4 * (pool.size() + 1)));
+            std::atomic<std::size_t> pruned(0);
+            pool.parallel_for(kept, grain, [&](std::size_t first, std::size_t last, ThreadPool::Worker) {
+                LowerBoundCounts counts{};
+                for (auto i = first; i < last; ++i)
+                    evaluate(sorted[begin + i], radius, counts);
+                count_lower_bounds_(counts);
+                pruned += std::accumulate(counts.begin(), counts.end() - 1, std::size_t(0));
+            });
+            skipped = pruned;
+        } else {
+            // the k closest children are results at the latest, the k-th of them bounds the children after it
+            LowerBoundCounts counts{};
+            auto &closest = ctx.closest;
+            closest.clear();
+            for (auto i = begin; i < sorted.size(); ++i) {
+                auto r = closest.size() == k && k > 0 ? std::min(radius, closest.front()) : radius;
+                evaluate(sorted[i], r, counts);
+                if (k == 0 || sorted[i].first == abandoned)
+                    continue;
+                if (closest.size() < k) {
+                    closest.push_back(sorted[i].first);
+                    std::push_heap(closest.begin(), closest.end());
+                } else if (sorted[i].first < closest.front()) {
+                    std::pop_heap(closest.begin(), closest.end());
+                    closest.back() = sorted[i].first;
+                    std::push_heap(closest.begin(), closest.end());
+                }
+            }
+            count_lower_bounds_(counts);
+            skipped = std::accumulate(counts.begin(), counts.end() - 1, std::size_t(0));
+        }
+        ctx.evaluations -= skipped; // ruled out by a lower bound, the metric was not called
+        if (bounded) {
+            // an abandoned distance is only a lower bound, its child is out
+            auto out = [&](const std::pair<Distance, int> &entry) {
+                return entry.first == abandoned || !(entry.first - p->children[entry.second]->maxdist < radius);
+            };
+            sorted.erase(std::remove_if(sorted.begin() + begin, sorted.end(), out), sorted.end());
+        }
+        std::sort(sorted.begin() + begin, sorted.end());
+    }
+
+/*
+  \ \      /      |  |
+   \ \ \  /  _` |  |  | /
+    \_/\_/ \__,_| _| _\_\
+  non-recursive traversal engine
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::WalkPolicy::order(
+        Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+        for (std::size_t i = 0; i < node->children.size(); ++i) {
+            children.emplace_back(Distance(0), i);
+        }
+    }
+
+/*** depth first walk on an explicit stack kept in ctx, so any depth is safe and no frame allocates ***/
+    template <class recType, class Metric>
+    template <class Policy>
+    void Tree<recType, Metric>::walk(Node_ptr start, Distance dist_start,
+                                     Policy &policy, Context &ctx) const {
+        auto base_frames = ctx.frames.size();
+        auto base_children = ctx.children.size();
+
+        auto enter = [&](Node_ptr node, Distance dist) {
+            if (!policy.visit(node, dist)) {
+                policy.leave(node);
+                return;
+            }
+            auto begin = ctx.children.size();
+            policy.order(node, ctx.children);
+            ctx.frames.push_back({node, begin, begin});
+        };
+
+        enter(start, dist_start);
+        while (ctx.frames.size() > base_frames && !policy.done()) {
+            // the top frame is the deepest one, its segment runs to the end of ctx.children
+            auto &frame = ctx.frames.back();
+            if (frame.next == ctx.children.size()) {
+                Node_ptr node = frame.node;
+                ctx.children.resize(frame.begin);
+                ctx.frames.pop_back();
+                policy.leave(node);
+                continue;
+            }
+            Node_ptr parent = frame.node;
+            auto entry = ctx.children[frame.next++];
+            Node_ptr child = parent->children[entry.second];
+            if (frame.next < ctx.children.size()) {
+                // the sibling after this one is expanded next, fetch its children while we descend
+                METRIC_SPACE_PREFETCH(parent->children[ctx.children[frame.next].second]->children.data());
+            }
+            if (policy.prune(parent, child, entry.first))
+                continue;
+            enter(child, entry.first);
+        }
+        ctx.frames.resize(base_frames);
+        ctx.children.resize(base_children);
+    }
+
+    template <class recType, class Metric>
+    Tree<recType, Metric>::BudgetPolicy::BudgetPolicy(const QueryOptions &options, Context &ctx)
+        : options(options), ctx(ctx), shared(ctx.shared_bound) {
+        if (options.max_time.count() > 0)
+            deadline = std::chrono::steady_clock::now() + options.max_time;
+        ctx.exact = options.epsilon == 0;
+        ctx.evaluations = 1; // the start node
+        ctx.visited = 0;
+    }
+
+/*** count the node and the distances to its children, stop before any limit is passed ***/
+    template <class recType, class Metric>
+    bool Tree<recType, Metric>::BudgetPolicy::charge(Node_ptr node) {
+        auto evaluations = ctx.evaluations + node->children.size();
+        if ((options.max_visited > 0 && ctx.visited >= options.max_visited) ||
+            (options.max_evaluations > 0 && evaluations > options.max_evaluations) ||
+            (options.max_time.count() > 0 && std::chrono::steady_clock::now() > deadline)) {
+            exhausted = true;
+            ctx.exact = false;
+            return false;
+        }
+        ctx.visited++;
+        ctx.evaluations = evaluations;
+        return true;
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::BudgetPolicy::relaxed(Distance lower_bound) const {
+        if (options.epsilon == 0)
+            return lower_bound;
+        return lower_bound * (1 + options.epsilon);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::BudgetPolicy::radius(Distance bound) const {
+        if (options.epsilon == 0 || bound == std::numeric_limits<Distance>::max())
+            return bound;
+        return bound / (1 + options.epsilon);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::BudgetPolicy::bound(Distance local) const {
+        if (shared == nullptr)
+            return local;
+        return std::min(local, shared->load(std::memory_order_relaxed));
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::BudgetPolicy::publish(Distance local) {
+        if (shared == nullptr)
+            return;
+        auto current = shared->load(std::memory_order_relaxed);
+        while (local < current && !shared->compare_exchange_weak(current, local, std::memory_order_relaxed)) {
+        }
+    }
+
 /*
   _ _|                      |
    |      \  (_-<   -_)   _| _|
@@ -360,20 +655,60 @@ namespace metric_space {
                                                  Distance treshold) {
         std::size_t inserted = 0;
         for (const auto &rec : p) {
-            if (root->dist(rec) > treshold) {
-                insert(rec);
+            if (insert_if(rec, treshold))
                 inserted++;
-            }
         }
         return inserted;
     }
+
+/*** near duplicate check and insertion share one descent: the walk that looks for a record within treshold also records where p goes ***/
     template <class recType, class Metric>
     bool Tree<recType, Metric>::insert_if(const recType &p, Distance treshold) {
-        if (root->dist(p) > treshold) {
-            insert(p);
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        PreparedQuery prepared(*this, p);
+        if (root == nullptr) {
+            root = make_node_(p);
             return true;
         }
-        return false;
+        Distance dist_root = root->dist(p);
+        if (dist_root <= treshold)
+            return false;
+        // outside the root's cover the root is raised, there is no descent to record
+        bool raise = dist_root > root->covdist();
+        std::vector<std::pair<Node_ptr, Distance>> path;
+        Context ctx;
+        if (within_(p, treshold, dist_root, raise ? nullptr : &path, ctx))
+            return false;
+        if (raise)
+            root = insert(root, make_node_(p));
+        else
+            attach_(path, make_node_(p));
+        return true;
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr Tree<recType, Metric>::make_node_(const recType &x) {
+        Node_ptr node = new NodeType(this);
+        node->data = x;
+        node->prepared = prepare_(x);
+        node->set_level(0);
+        node->set_parent_dist(0);
+        node->set_ID(next_id++);
+        node->set_parent(nullptr);
+        if (summary_)
+            node->summary = summary_(node);
+        index_.push_back(node);
+        for (std::size_t i = 0; i < pivots_.size(); ++i)
+            pivot_table_.push_back(call_(argument_(*node), pivot_argument_(i)));
+        N++;
+        if (cache_)
+            cache_->changed(x, 0);
+        if (rknn_) {
+            rknn_->pending.push_back(node->ID);
+            rknn_->inserts++;
+        }
+        return node;
     }
 
 /*** vector of data record insertion  **/
@@ -393,12 +728,7 @@ namespace metric_space {
         std::unique_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk; // prevent AppleCLang warning;
 
-        Node_ptr node = new NodeType(this);
-        node->data = x;
-        node->set_level(0);
-        node->set_parent_dist(0);
-        node->set_ID(N++);
-        node->set_parent(nullptr);
+        Node_ptr node = make_node_(x);
 
         // root insertion
         if (root == NULL) {
@@ -427,10 +757,15 @@ namespace metric_space {
                 }
                 if (parent != NULL) {
                     parent->children.pop_back();
+                    for (Node_ptr a = parent; a != nullptr; a = a->parent)
+                        a->subtree_size--;
                     current->set_level(p->get_level() + 1);
                     current->children.push_back(p);
                     p->parent = current;
                     p->parent_dist = p->dist(current);
+                    current->maxdist = p->parent_dist + p->maxdist;
+                    current->summary.merge(p->summary);
+                    current->subtree_size = 1 + p->subtree_size;
                     p = current;
                     p->parent = nullptr;
                     p->parent_dist = 0;
@@ -443,6 +778,9 @@ namespace metric_space {
             x->children.push_back(p);
             // x->ID = N++;
             p->parent_dist = p->dist(x);
+            x->maxdist = std::max(x->maxdist, p->parent_dist + p->maxdist);
+            x->summary.merge(p->summary);
+            x->subtree_size += p->subtree_size;
             p->parent = x;
             p = x;
             max_scale = p->level;
@@ -529,15 +867,22 @@ namespace metric_space {
         // find the best node to inser
         std::unique_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk; // prevent AppleCLang warning
+        PreparedQuery prepared(*this, p);
 
+        Context ctx;
         std::pair<Node_ptr, Distance> result(root, root->dist(p));
-        nn_(root, result.second, p, result);
+        nn_(root, result.second, p, result, ctx, QueryOptions());
 
         if (result.second <= 0.0) {
             Node_ptr node_p = result.first;
             Node_ptr parent_p = node_p->get_parent();
+            if (cache_)
+                cache_->changed(node_p->data, 0);
+            if (rknn_)
+                rknn_->erased.push_back(node_p->data);
 
             if (node_p == root) {
+                index_[node_p->ID] = nullptr;
                 if (node_p->get_children().empty()) {
                     delete root;
                     root = nullptr;
@@ -545,12 +890,21 @@ namespace metric_space {
                     return true;
                 }
                 auto leaf = findAnyLeaf();
+                for (Node_ptr a = leaf->parent; a != nullptr; a = a->parent)
+                    a->subtree_size--;
                 extractNode(leaf);
                 leaf->set_level(root->get_level());
                 root = leaf;
                 leaf->children.assign(node_p->children.begin(), node_p->children.end());
+                leaf->maxdist = 0;
+                leaf->summary = summary_ ? summary_(leaf) : AttributeSummary();
+                leaf->subtree_size = 1;
                 for (auto l : leaf->get_children()) {
                     l->set_parent(leaf);
+                    l->parent_dist = leaf->dist(l);
+                    leaf->maxdist = std::max(leaf->maxdist, l->parent_dist + l->maxdist);
+                    leaf->summary.merge(l->summary);
+                    leaf->subtree_size += l->subtree_size;
                 }
                 ret_val = true;
                 N--;
@@ -559,7 +913,10 @@ namespace metric_space {
             }
 
             else {
-                // erase node from parent's list of child
+                index_[node_p->ID] = nullptr;
+                // erase node from parent's list of child, its children come back with their subtrees below
+                for (Node_ptr a = parent_p; a != nullptr; a = a->parent)
+                    a->subtree_size -= node_p->subtree_size;
                 unsigned num_children = parent_p->children.size();
                 for (unsigned i = 0; i < num_children; ++i) {
                     if (parent_p->children[i] == node_p) {
@@ -581,6 +938,87 @@ namespace metric_space {
         return ret_val;
     }
 
+/*
+   -_) \ \ /  |  (_-<   _| (_-<
+ \___|  _\_\ _|  ___/ \__| ___/
+  existence within a radius
+*/
+    template <class recType, class Metric>
+    bool Tree<recType, Metric>::exists_within(const recType &p, Distance r) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        if (root == nullptr)
+            return false;
+        PreparedQuery prepared(*this, p);
+        Context ctx;
+        return within_(p, r, root->dist(p), nullptr, ctx);
+    }
+
+/***
+  nearest child first, stop at the first record within r and skip every subtree whose lower bound
+  exceeds r. With path, the nodes of the insert descent of p (the first child covering p, level by
+  level, as insert_ takes it) are recorded with their distances and always entered.
+*/
+    template <class recType, class Metric>
+    bool Tree<recType, Metric>::within_(const recType &p, Distance r, Distance dist_root,
+                                        std::vector<std::pair<Node_ptr, Distance>> *path, Context &ctx) const {
+        struct Policy : WalkPolicy {
+            const TreeType &tree;
+            const recType &p;
+            Distance r;
+            std::vector<std::pair<Node_ptr, Distance>> *path;
+            Node_ptr next; // next node of the insert descent
+            bool found = false;
+            Policy(const TreeType &tree, const recType &p, Distance r,
+                   std::vector<std::pair<Node_ptr, Distance>> *path)
+                : tree(tree), p(p), r(r), path(path), next(path ? tree.root : nullptr) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                if (dist <= r) {
+                    found = true;
+                    return false;
+                }
+                if (node == next)
+                    path->emplace_back(node, dist);
+                return true;
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) {
+                auto begin = tree.sortChildrenByDistance(node, p, children);
+                if (node != next)
+                    return;
+                next = nullptr;
+                for (auto i = begin; i < children.size(); ++i) {
+                    Node_ptr child = node->children[children[i].second];
+                    if (children[i].first <= child->covdist()) {
+                        next = child;
+                        break;
+                    }
+                }
+            }
+            bool prune(Node_ptr, Node_ptr child, Distance d) {
+                return child != next && d - child->maxdist > r;
+            }
+            bool done() const { return found; }
+        } policy(*this, p, r, path);
+        walk(root, dist_root, policy, ctx);
+        return policy.found;
+    }
+
+/*** hang x below the last node of a recorded insert descent, every node on it gains x as descendant ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::attach_(const std::vector<std::pair<Node_ptr, Distance>> &path, Node_ptr x) {
+        for (auto &step : path) {
+            step.first->maxdist = std::max(step.first->maxdist, step.second + x->maxdist);
+            step.first->summary.merge(x->summary);
+            step.first->subtree_size += x->subtree_size;
+        }
+        Node_ptr parent = path.back().first;
+        parent->children.push_back(x);
+        x->parent = parent;
+        x->parent_dist = path.back().second;
+        x->level = parent->level - 1;
+    }
+
 /*
 
    \     \
@@ -591,39 +1029,80 @@ namespace metric_space {
     template <class recType, class Metric>
     typename Tree<recType, Metric>::Node_ptr
     Tree<recType, Metric>::nn(const recType &p) const {
+        Context ctx;
+        return nn(p, ctx);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr
+    Tree<recType, Metric>::nn(const recType &p, Context &ctx) const {
+        return nn(p, ctx, QueryOptions());
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr
+    Tree<recType, Metric>::nn(const recType &p, Context &ctx,
+                              const QueryOptions &options) const {
         std::shared_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk;
+        return nn_impl(p, ctx, options);
+    }
 
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr
+    Tree<recType, Metric>::nn_search_(const recType &p, Context &ctx,
+                                      const QueryOptions &options) const {
+        if (options.order != SearchOrder::depth_first || (options.parallel && !options.budgeted())) {
+            if (options.order == SearchOrder::depth_first)
+                parallel_search_(p, 1, std::numeric_limits<Distance>::max(), ctx, options);
+            else if (options.order == SearchOrder::best_first)
+                knn_best_first_(p, 1, ctx, options);
+            else
+                level_search_(p, 1, std::numeric_limits<Distance>::max(), ctx, options);
+            return ctx.result[0].first;
+        }
+        ctx.children.clear();
+        auto pivots = query_pivots_(p, ctx);
         std::pair<Node_ptr, Distance> result(root, root->dist(p));
-        nn_(root, result.second, p, result);
+        nn_(root, result.second, p, result, ctx, options, pivots);
+        if (pivots != nullptr)
+            ctx.evaluations += pivots_.size();
+        ctx.result.assign(1, result);
         return result.first;
     }
 
     template <class recType, class Metric>
     void Tree<recType, Metric>::nn_(Node_ptr current, Distance dist_current,
                                     const recType &p,
-                                    std::pair<Node_ptr, Distance> &nn) const {
-
-        if (dist_current < nn.second) // If the current node is the nearest neighbour
-        {
-            nn.first = current;
-            nn.second = dist_current;
-        }
-
-        auto idx__dists = sortChildrenByDistance(current, p);
-        auto idx = std::get<0>(idx__dists);
-        auto dists = std::get<1>(idx__dists);
-        // Distance max_dist = 0;
-        // for(std::size_t i = 0; i < idx.size();i++) {
-        //     if(p->children[i])
-        // }
-        for (const auto &child_idx : idx) {
-            Node_ptr child = current->children[child_idx];
-            Distance dist_child = dists[child_idx];
-
-            if (nn.second > dist_child - child->parent_dist)
-                nn_(child, dist_child, p, nn);
-        }
+                                    std::pair<Node_ptr, Distance> &nn,
+                                    Context &ctx, const QueryOptions &options,
+                                    const Distance *pivots) const {
+        struct Policy : BudgetPolicy {
+            const TreeType &tree;
+            const recType &p;
+            std::pair<Node_ptr, Distance> &nn;
+            const Distance *pivots;
+            Policy(const TreeType &tree, const recType &p, std::pair<Node_ptr, Distance> &nn,
+                   const QueryOptions &options, Context &ctx, const Distance *pivots)
+                : BudgetPolicy(options, ctx), tree(tree), p(p), nn(nn), pivots(pivots) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                if (dist < nn.second) // If the current node is the nearest neighbour
+                {
+                    nn.first = node;
+                    nn.second = dist;
+                }
+                return this->charge(node);
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+                tree.sortPivotedChildren_(node, p, children, this->options.parallel_children, pivots, this->ctx,
+                                          this->radius(nn.second), 1);
+            }
+            bool prune(Node_ptr, Node_ptr child, Distance dist_child) const {
+                return !(nn.second > this->relaxed(dist_child - child->maxdist));
+            }
+        } policy(*this, p, nn, options, ctx, pivots);
+        walk(current, dist_current, policy, ctx);
     }
 
 /*
@@ -635,58 +1114,377 @@ namespace metric_space {
     template <class recType, class Metric>
     std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
                           typename Tree<recType, Metric>::Distance>>
-    Tree<recType, Metric>::knn(const recType &queryPt, unsigned numNbrs) const {
+    Tree<recType, Metric>::knn(const recType &queryPt, unsigned numNbrs,
+                               SearchOrder order) const {
+        Context ctx;
+        knn(queryPt, numNbrs, ctx, order);
+        return std::move(ctx.result);
+    }
+
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
+                                typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::knn(const recType &queryPt, unsigned numNbrs,
+                               Context &ctx, SearchOrder order) const {
+        QueryOptions options;
+        options.order = order;
+        return knn(queryPt, numNbrs, ctx, options);
+    }
+
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
+                                typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::knn(const recType &queryPt, unsigned numNbrs,
+                               Context &ctx, const QueryOptions &options) const {
         std::shared_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk;
+        knn_impl(queryPt, numNbrs, ctx, options);
+        return ctx.result;
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_search_(const recType &queryPt, unsigned numNbrs,
+                                            Context &ctx, const QueryOptions &options) const {
+        if (options.order == SearchOrder::best_first) {
+            knn_best_first_(queryPt, numNbrs, ctx, options);
+            return;
+        }
+        if (options.order == SearchOrder::level_synchronous) {
+            ctx.result.clear();
+            if (numNbrs > 0)
+                level_search_(queryPt, numNbrs, std::numeric_limits<Distance>::max(), ctx, options);
+            return;
+        }
+        if (options.parallel && !options.budgeted()) {
+            ctx.result.clear();
+            if (numNbrs > 0)
+                parallel_search_(queryPt, numNbrs, std::numeric_limits<Distance>::max(), ctx, options);
+            return;
+        }
 
-        using NodePtr = typename Tree<recType, Metric>::Node_ptr;
         // Do the worst initialization
-        std::pair<NodePtr, Distance> dummy(nullptr,
-                                           std::numeric_limits<Distance>::max());
+        std::pair<Node_ptr, Distance> dummy(nullptr,
+                                            std::numeric_limits<Distance>::max());
         // List of k-nearest points till now
-        std::vector<std::pair<NodePtr, Distance>> nnList(numNbrs, dummy);
+        ctx.children.clear();
+        ctx.result.assign(numNbrs, dummy);
+        if (numNbrs == 0)
+            return;
 
         // Call with root
+        auto pivots = query_pivots_(queryPt, ctx);
         Distance dist_root = root->dist(queryPt);
         std::size_t nnSize = 0;
-        nnSize = knn_(root, dist_root, queryPt, nnList, nnSize);
-        if (nnSize < nnList.size()) {
-            nnList.resize(nnSize);
+        nnSize = knn_(root, dist_root, queryPt, ctx.result, nnSize, ctx, options, pivots);
+        if (pivots != nullptr)
+            ctx.evaluations += pivots_.size();
+        if (nnSize < ctx.result.size()) {
+            ctx.result.resize(nnSize);
         }
-        return nnList;
     }
     template <class recType, class Metric>
     std::size_t
     Tree<recType, Metric>::knn_(Node_ptr current, Distance dist_current,
                                 const recType &p,
                                 std::vector<std::pair<Node_ptr, Distance>> &nnList,
-                                std::size_t nnSize) const {
-        if (dist_current <
-            nnList.back()
-            .second) // If the current node is eligible to get into the list
-        {
-            auto comp_x = [](std::pair<Node_ptr, Distance> a,
-                             std::pair<Node_ptr, Distance> b) {
-                              return a.second < b.second;
-                          };
-            std::pair<Node_ptr, Distance> temp(current, dist_current);
-            nnList.insert(std::upper_bound(nnList.begin(), nnList.end(), temp, comp_x),
-                          temp);
-            nnList.pop_back();
-            nnSize++;
-        }
-
-        auto idx__dists = sortChildrenByDistance(current, p);
-        auto idx = std::get<0>(idx__dists);
-        auto dists = std::get<1>(idx__dists);
-
-        for (const auto &child_idx : idx) {
-            Node_ptr child = current->children[child_idx];
-            Distance dist_child = dists[child_idx];
-            if (nnList.back().second > dist_child - child->parent_dist)
-                nnSize = knn_(child, dist_child, p, nnList, nnSize);
-        }
-        return nnSize;
+                                std::size_t nnSize, Context &ctx,
+                                const QueryOptions &options, const Distance *pivots) const {
+        struct Policy : BudgetPolicy {
+            const TreeType &tree;
+            const recType &p;
+            std::vector<std::pair<Node_ptr, Distance>> &nnList;
+            std::size_t nnSize;
+            const Distance *pivots;
+            Policy(const TreeType &tree, const recType &p,
+                   std::vector<std::pair<Node_ptr, Distance>> &nnList, std::size_t nnSize,
+                   const QueryOptions &options, Context &ctx, const Distance *pivots)
+                : BudgetPolicy(options, ctx), tree(tree), p(p), nnList(nnList), nnSize(nnSize), pivots(pivots) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                if (dist < nnList.back().second) // If the current node is eligible to get into the list
+                {
+                    auto comp_x = [](std::pair<Node_ptr, Distance> a,
+                                     std::pair<Node_ptr, Distance> b) {
+                                      return a.second < b.second;
+                                  };
+                    std::pair<Node_ptr, Distance> temp(node, dist);
+                    // shift the tail by hand, insert() + pop_back() would outgrow the capacity
+                    auto pos = std::upper_bound(nnList.begin(), nnList.end(), temp, comp_x);
+                    std::move_backward(pos, nnList.end() - 1, nnList.end());
+                    *pos = temp;
+                    nnSize++;
+                    if (nnSize >= nnList.size())
+                        this->publish(nnList.back().second);
+                }
+                return this->charge(node);
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+                tree.sortPivotedChildren_(node, p, children, this->options.parallel_children, pivots, this->ctx,
+                                          this->radius(this->bound(nnList.back().second)), nnList.size());
+            }
+            bool prune(Node_ptr, Node_ptr child, Distance dist_child) const {
+                return !(this->bound(nnList.back().second) > this->relaxed(dist_child - child->maxdist));
+            }
+        } policy(*this, p, nnList, nnSize, options, ctx, pivots);
+        walk(current, dist_current, policy, ctx);
+        return policy.nnSize;
+    }
+
+/*** best first: expand the frontier subtree with the smallest lower bound, keep the k best in a max-heap ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_best_first_(const recType &p, std::size_t k,
+                                                Context &ctx, const QueryOptions &options) const {
+        using Candidate = typename Context::Candidate;
+        auto &result = ctx.result;
+        auto &frontier = ctx.frontier;
+        result.clear();
+        frontier.clear();
+        if (k == 0)
+            return;
+        BudgetPolicy budget(options, ctx);
+
+        auto farther = [](const std::pair<Node_ptr, Distance> &a,
+                          const std::pair<Node_ptr, Distance> &b) {
+                           return a.second < b.second;
+                       };
+        auto looser = [](const Candidate &a, const Candidate &b) { return a.bound > b.bound; };
+        // the k-th distance found so far, nothing can be pruned before the heap is full
+        auto bound = [&]() {
+                         return result.size() < k ? std::numeric_limits<Distance>::max()
+                                                  : result.front().second;
+                     };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (result.size() < k) {
+                             result.emplace_back(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         } else if (dist < result.front().second) {
+                             std::pop_heap(result.begin(), result.end(), farther);
+                             result.back() = std::make_pair(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         }
+                     };
+
+        Distance dist_root = root->dist(p);
+        offer(root, dist_root);
+        frontier.push_back({Distance(0), dist_root, root});
+        while (!frontier.empty()) {
+            std::pop_heap(frontier.begin(), frontier.end(), looser);
+            Candidate current = frontier.back();
+            frontier.pop_back();
+            if (!(bound() > budget.relaxed(current.bound)))
+                break; // every remaining subtree is at least as far
+            if (!budget.charge(current.node))
+                break;
+            for (auto child : current.node->children) {
+                Distance dist_child = child->dist(p);
+                offer(child, dist_child);
+                Distance lower = dist_child - child->maxdist;
+                if (!child->children.empty() && bound() > budget.relaxed(lower)) {
+                    frontier.push_back({lower, dist_child, child});
+                    std::push_heap(frontier.begin(), frontier.end(), looser);
+                }
+            }
+        }
+        std::sort_heap(result.begin(), result.end(), farther);
+    }
+
+/***
+  level synchronous (cover set) search. All children of the current cover set are gathered and their
+  distances evaluated in one contiguous batch, on the thread pool for wide levels. Children whose
+  subtree can still beat the bound form the next cover set. k > 0 keeps the k nearest, k == 0
+  collects everything closer than radius.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::level_search_(const recType &p, std::size_t k, Distance radius,
+                                              Context &ctx, const QueryOptions &options) const {
+        const std::size_t parallel_level = 2048; // children of a level worth spreading over the pool
+        auto &result = ctx.result;
+        auto &cover = ctx.frontier;
+        auto &next = ctx.cover;
+        result.clear();
+        cover.clear();
+
+        auto farther = [](const std::pair<Node_ptr, Distance> &a,
+                          const std::pair<Node_ptr, Distance> &b) {
+                           return a.second < b.second;
+                       };
+        auto bound = [&]() {
+                         if (k == 0)
+                             return radius;
+                         return result.size() < k ? std::numeric_limits<Distance>::max()
+                                                  : result.front().second;
+                     };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (k == 0) {
+                             if (dist < radius)
+                                 result.emplace_back(node, dist);
+                         } else if (result.size() < k) {
+                             result.emplace_back(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         } else if (dist < result.front().second) {
+                             std::pop_heap(result.begin(), result.end(), farther);
+                             result.back() = std::make_pair(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         }
+                     };
+
+        BudgetPolicy budget(options, ctx);
+        Distance dist_root = root->dist(p);
+        offer(root, dist_root);
+        cover.push_back({dist_root - root->maxdist, dist_root, root});
+        while (!cover.empty()) {
+            // gather the children of every cover node that can still contribute
+            ctx.level.clear();
+            for (auto &c : cover) {
+                if (!(bound() > budget.relaxed(c.bound)))
+                    continue;
+                if (!budget.charge(c.node))
+                    break;
+                ctx.level.insert(ctx.level.end(), c.node->children.begin(), c.node->children.end());
+            }
+
+            // one batch of distance evaluations for the whole level
+            auto n = ctx.level.size();
+            ctx.level_dists.resize(n);
+            auto evaluate = [&](std::size_t begin, std::size_t end, ThreadPool::Worker) {
+                                for (auto i = begin; i < end; ++i)
+                                    ctx.level_dists[i] = ctx.level[i]->dist(p);
+                            };
+            auto &pool = ThreadPool::global();
+            if (n >= parallel_level && pool.size() > 0)
+                pool.parallel_for(n, parallel_level / 4, evaluate);
+            else
+                evaluate(0, n, pool.size());
+
+            next.clear();
+            for (std::size_t i = 0; i < n; ++i)
+                offer(ctx.level[i], ctx.level_dists[i]);
+            for (std::size_t i = 0; i < n; ++i) {
+                Node_ptr node = ctx.level[i];
+                Distance lower = ctx.level_dists[i] - node->maxdist;
+                if (!node->children.empty() && bound() > budget.relaxed(lower))
+                    next.push_back({lower, ctx.level_dists[i], node});
+            }
+            std::swap(cover, next);
+            if (budget.done())
+                break;
+        }
+        if (k > 0)
+            std::sort_heap(result.begin(), result.end(), farther);
+    }
+
+/***
+  intra query parallelism: the largest subtrees are split until there are enough of them to keep
+  every worker busy, then each one is searched depth first as a task on ThreadPool::global().
+  Tasks on one worker share a result list, knn tasks prune with the tightest k-th distance any of
+  them found so far, published through an atomic shared bound. k == 0 collects everything closer
+  than radius.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::parallel_search_(const recType &p, std::size_t k, Distance radius,
+                                                 Context &ctx, const QueryOptions &options) const {
+        using Candidate = typename Context::Candidate;
+        auto &pool = ThreadPool::global();
+        const std::size_t tasks = 8 * (pool.size() + 1); // enough subtrees to steal from
+        auto &result = ctx.result;
+        auto &cover = ctx.cover;
+        result.clear();
+        cover.clear();
+        std::atomic<Distance> shared(k == 0 ? radius : std::numeric_limits<Distance>::max());
+        BudgetPolicy budget(options, ctx);
+
+        // nodes expanded while splitting are offered here, the tasks offer the rest
+        auto farther = [](const std::pair<Node_ptr, Distance> &a,
+                          const std::pair<Node_ptr, Distance> &b) {
+                           return a.second < b.second;
+                       };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (k == 0) {
+                             if (dist < radius)
+                                 result.emplace_back(node, dist);
+                             return;
+                         }
+                         if (result.size() < k) {
+                             result.emplace_back(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         } else if (dist < result.front().second) {
+                             std::pop_heap(result.begin(), result.end(), farther);
+                             result.back() = std::make_pair(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         }
+                         if (result.size() == k)
+                             budget.publish(result.front().second);
+                     };
+        budget.shared = &shared;
+
+        Distance dist_root = root->dist(p);
+        cover.push_back({dist_root - root->maxdist, dist_root, root});
+        while (cover.size() < tasks) {
+            std::size_t largest = cover.size();
+            for (std::size_t i = 0; i < cover.size(); ++i) {
+                if (!cover[i].node->children.empty() &&
+                    (largest == cover.size() || cover[i].node->subtree_size > cover[largest].node->subtree_size))
+                    largest = i;
+            }
+            if (largest == cover.size())
+                break; // only leaves left
+            Candidate split = cover[largest];
+            cover[largest] = cover.back();
+            cover.pop_back();
+            offer(split.node, split.dist);
+            budget.charge(split.node);
+            ctx.children.clear();
+            sortChildrenByDistance(split.node, p, ctx.children, options.parallel_children);
+            for (auto &child : ctx.children) {
+                Node_ptr node = split.node->children[child.second];
+                Distance lower = child.first - node->maxdist;
+                if (budget.bound(radius) > budget.relaxed(lower))
+                    cover.push_back({lower, child.first, node});
+            }
+        }
+        ctx.children.clear();
+        // closest subtrees first, they tighten the shared bound early
+        std::sort(cover.begin(), cover.end(),
+                  [](const Candidate &a, const Candidate &b) { return a.bound < b.bound; });
+
+        std::vector<Context> locals(pool.size() + 1);
+        std::vector<std::size_t> sizes(locals.size(), 0), evaluations(locals.size(), 0), visited(locals.size(), 0);
+        const Prepared *prepared = scoped_(p); // the scope of the caller, the workers borrow it instead of preparing p again
+        for (auto &local : locals) {
+            local.shared_bound = &shared;
+            if (k > 0)
+                local.result.assign(k, std::make_pair(Node_ptr(nullptr), std::numeric_limits<Distance>::max()));
+        }
+        pool.parallel_for(cover.size(), 1, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            auto &local = locals[worker];
+            PreparedQuery scope(*this, p, prepared);
+            for (auto i = begin; i < end; ++i) {
+                auto &c = cover[i];
+                if (!(budget.bound(radius) > budget.relaxed(c.bound)))
+                    continue; // a tighter bound arrived meanwhile
+                if (k == 0) {
+                    auto append = [&local](Node_ptr node, Distance dist) { local.result.emplace_back(node, dist); };
+                    rnn_(c.node, c.dist, p, radius, append, local, options);
+                } else {
+                    sizes[worker] = knn_(c.node, c.dist, p, local.result, sizes[worker], local, options);
+                }
+                evaluations[worker] += local.evaluations - 1; // the task root was evaluated while splitting
+                visited[worker] += local.visited;
+            }
+        });
+
+        for (std::size_t w = 0; w < locals.size(); ++w) {
+            auto &local = locals[w].result;
+            auto n = k == 0 ? local.size() : std::min(sizes[w], k);
+            result.insert(result.end(), local.begin(), local.begin() + n);
+            ctx.evaluations += evaluations[w];
+            ctx.visited += visited[w];
+        }
+        if (k > 0) {
+            std::sort(result.begin(), result.end(), farther);
+            if (result.size() > k)
+                result.resize(k);
+        }
     }
 
 /*
@@ -699,56 +1497,1706 @@ namespace metric_space {
     std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
                           typename Tree<recType, Metric>::Distance>>
     Tree<recType, Metric>::rnn(const recType &queryPt, Distance distance) const {
+        Context ctx;
+        rnn(queryPt, distance, ctx, QueryOptions());
+        return std::move(ctx.result);
+    }
 
-        std::vector<std::pair<Node_ptr, Distance>>
-            nnList; // List of nearest neighbors in the rnn
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
+                                typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::rnn(const recType &queryPt, Distance distance,
+                               Context &ctx) const {
+        return rnn(queryPt, distance, ctx, QueryOptions());
+    }
 
-        Distance dist_root = root->dist(queryPt);
-        rnn_(root, dist_root, queryPt, distance, nnList); // Call with root
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr,
+                                typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::rnn(const recType &queryPt, Distance distance,
+                               Context &ctx, const QueryOptions &options) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        rnn_impl(queryPt, distance, ctx, options);
+        return ctx.result;
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rnn_search_(const recType &queryPt, Distance distance,
+                                            Context &ctx, const QueryOptions &options) const {
+        if (options.order == SearchOrder::level_synchronous) {
+            level_search_(queryPt, 0, distance, ctx, options);
+            return;
+        }
+        if (options.parallel && !options.budgeted()) {
+            parallel_search_(queryPt, 0, distance, ctx, options);
+            return;
+        }
+        ctx.children.clear();
+        ctx.result.clear(); // List of nearest neighbors in the rnn
 
-        return nnList;
+        auto pivots = query_pivots_(queryPt, ctx);
+        Distance dist_root = root->dist(queryPt);
+        auto append = [&ctx](Node_ptr node, Distance dist) { ctx.result.emplace_back(node, dist); };
+        rnn_(root, dist_root, queryPt, distance, append, ctx, options, pivots); // Call with root
+        if (pivots != nullptr)
+            ctx.evaluations += pivots_.size();
     }
     template <class recType, class Metric>
+    template <class Sink>
     void Tree<recType, Metric>::rnn_(
         Node_ptr current, Distance dist_current, const recType &p,
-        Distance distance,
-        std::vector<std::pair<Node_ptr, Distance>> &nnList) const {
+        Distance distance, Sink &sink, Context &ctx,
+        const QueryOptions &options, const Distance *pivots) const {
+        struct Policy : BudgetPolicy {
+            const TreeType &tree;
+            const recType &p;
+            Distance distance;
+            Sink &sink;
+            const Distance *pivots;
+            Policy(const TreeType &tree, const recType &p, Distance distance, Sink &sink,
+                   const QueryOptions &options, Context &ctx, const Distance *pivots)
+                : BudgetPolicy(options, ctx), tree(tree), p(p), distance(distance), sink(sink), pivots(pivots) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                if (dist < distance) // If the current node is eligible to get into the list
+                {
+                    sink(node, dist);
+                }
+                return this->charge(node);
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+                tree.sortPivotedChildren_(node, p, children, this->options.parallel_children, pivots, this->ctx,
+                                          this->radius(distance), 0);
+            }
+            bool prune(Node_ptr, Node_ptr child, Distance dist_child) const {
+                return !(distance > this->relaxed(dist_child - child->maxdist));
+            }
+        } policy(*this, p, distance, sink, options, ctx, pivots);
+        walk(current, dist_current, policy, ctx);
+    }
 
-        if (dist_current <
-            distance) // If the current node is eligible to get into the list
-        {
-            std::pair<Node_ptr, Distance> temp(current, dist_current);
-            nnList.push_back(temp);
-        }
+    template <class recType, class Metric>
+    template <class Callback>
+    void Tree<recType, Metric>::rnn(const recType &queryPt, Distance distance, Callback callback) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        if (root == nullptr)
+            return;
+        PreparedQuery prepared(*this, queryPt);
+        Context ctx;
+        rnn_(root, root->dist(queryPt), queryPt, distance, callback, ctx, QueryOptions());
+    }
 
-        // auto[idx, dists] = sortChildrenByDistance(current, p);
-        auto idx__dists = sortChildrenByDistance(current, p);
-        auto idx = std::get<0>(idx__dists);
-        auto dists = std::get<1>(idx__dists);
+    template <class recType, class Metric>
+    std::size_t Tree<recType, Metric>::rnn_count(const recType &queryPt, Distance distance) const {
+        Context ctx;
+        return rnn_count(queryPt, distance, ctx);
+    }
 
-        for (const auto &child_idx : idx) {
-            Node_ptr child = current->children[child_idx];
-            Distance dist_child = dists[child_idx];
-            if (distance > dist_child - child->parent_dist)
-                rnn_(child, dist_child, p, distance, nnList);
+/*** a subtree within distance - maxdist lies entirely in range and counts by its size, its children are never evaluated ***/
+    template <class recType, class Metric>
+    std::size_t Tree<recType, Metric>::rnn_count(const recType &queryPt, Distance distance, Context &ctx) const {
+        struct Policy : BudgetPolicy {
+            const recType &p;
+            Distance distance;
+            std::size_t count = 0;
+            Policy(const recType &p, Distance distance, const QueryOptions &options, Context &ctx)
+                : BudgetPolicy(options, ctx), p(p), distance(distance) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                if (dist + node->maxdist < distance) {
+                    count += node->subtree_size;
+                    return false;
+                }
+                if (dist < distance)
+                    count++;
+                return this->charge(node);
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+                for (std::size_t i = 0; i < node->children.size(); ++i)
+                    children.emplace_back(node->children[i]->dist(p), i);
+            }
+            bool prune(Node_ptr, Node_ptr child, Distance dist_child) const {
+                return !(distance > dist_child - child->maxdist);
+            }
+        };
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        QueryOptions options;
+        Policy policy(queryPt, distance, options, ctx);
+        if (root == nullptr) {
+            ctx.evaluations = 0;
+            return 0;
         }
+        PreparedQuery prepared(*this, queryPt);
+        ctx.children.clear();
+        walk(root, root->dist(queryPt), policy, ctx);
+        return policy.count;
     }
 
 /*
-  _)
-  (_-<  | _  /   -_)
-  ___/ _| ___| \___|
-  tree size
+   _|  _)
+   _|   |    \   _` |   -_)   _|
+ _|    _| _| _| \__, | \___| _|
+                ____/
+  finger search from a hint node
 */
-    template <class recType, class Metric> size_t Tree<recType, Metric>::size() {
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr Tree<recType, Metric>::get_node(unsigned id) const {
         std::shared_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk;
-        return size_t(N);
+        return id < index_.size() ? index_[id] : nullptr;
     }
 
-/*
-   |        \ \   /           |
-  _|   _ \ \ \ /  -_)   _|   _|   _ \   _|
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr Tree<recType, Metric>::nn(const recType &p, Node_ptr hint) const {
+        Context ctx;
+        auto &result = knn(p, 1, hint, ctx);
+        return result.empty() ? nullptr : result[0].first;
+    }
+
+    template <class recType, class Metric>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::knn(const recType &p, unsigned k, Node_ptr hint) const {
+        Context ctx;
+        knn(p, k, hint, ctx);
+        return std::move(ctx.result);
+    }
+
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::knn(const recType &p, unsigned k, Node_ptr hint, Context &ctx) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        finger_(p, k, hint != nullptr ? hint : root, ctx);
+        return ctx.result;
+    }
+
+    template <class recType, class Metric>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::knn_by_id(unsigned id, unsigned k) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        Context ctx;
+        if (id < index_.size() && index_[id] != nullptr)
+            finger_(index_[id]->data, k, index_[id], ctx);
+        return std::move(ctx.result);
+    }
+
+/***
+  search the subtree of hint, then climb. For an ancestor only its distance interval is known, from
+  the distance to the child below it and their parent distance; an ancestor is evaluated only if
+  that interval, or the bound it gives on a sibling subtree (|d(p, ancestor) - parent_dist| - maxdist),
+  can still beat the k-th distance. Siblings that survive are searched closest bound first.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::finger_(const recType &p, std::size_t k, Node_ptr hint, Context &ctx) const {
+        PreparedQuery prepared(*this, p);
+        auto &nnList = ctx.result;
+        nnList.assign(k, std::make_pair(Node_ptr(nullptr), std::numeric_limits<Distance>::max()));
+        ctx.children.clear();
+        ctx.cover.clear();
+        ctx.exact = true;
+        if (k == 0 || hint == nullptr) {
+            nnList.clear();
+            ctx.evaluations = 0;
+            ctx.visited = 0;
+            return;
+        }
+
+        QueryOptions options;
+        std::size_t nnSize = 0, evaluations = 1, visited = 0;
+        auto search = [&](Node_ptr node, Distance dist) {
+                          nnSize = knn_(node, dist, p, nnList, nnSize, ctx, options);
+                          evaluations += ctx.evaluations - 1; // node itself was evaluated here
+                          visited += ctx.visited;
+                      };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (!(dist < nnList.back().second))
+                             return;
+                         auto pos = std::upper_bound(nnList.begin(), nnList.end(), std::make_pair(node, dist),
+                                                     [](const std::pair<Node_ptr, Distance> &a,
+                                                        const std::pair<Node_ptr, Distance> &b) {
+                                                         return a.second < b.second;
+                                                     });
+                         std::move_backward(pos, nnList.end() - 1, nnList.end());
+                         *pos = std::make_pair(node, dist);
+                         nnSize++;
+                     };
+
+        Distance dist_hint = hint->dist(p);
+        search(hint, dist_hint);
+        Distance lower = dist_hint, upper = dist_hint; // distance from p to the current ancestor
+        for (Node_ptr child = hint; child->parent != nullptr; child = child->parent) {
+            Node_ptr ancestor = child->parent;
+            lower = std::max(Distance(0), lower - child->parent_dist);
+            upper = upper + child->parent_dist;
+            auto gap = [&](Node_ptr sibling) {
+                           Distance to_sibling = std::max(lower - sibling->parent_dist, sibling->parent_dist - upper);
+                           return std::max(Distance(0), to_sibling) - sibling->maxdist;
+                       };
+            bool needed = lower < nnList.back().second;
+            for (std::size_t i = 0; i < ancestor->children.size() && !needed; ++i)
+                needed = ancestor->children[i] != child && gap(ancestor->children[i]) < nnList.back().second;
+            if (!needed)
+                continue;
+
+            Distance dist_ancestor = ancestor->dist(p);
+            evaluations++;
+            visited++;
+            lower = upper = dist_ancestor;
+            offer(ancestor, dist_ancestor);
+            ctx.cover.clear();
+            for (auto sibling : ancestor->children) {
+                if (sibling != child)
+                    ctx.cover.push_back({gap(sibling), Distance(0), sibling});
+            }
+            std::sort(ctx.cover.begin(), ctx.cover.end(),
+                      [](const typename Context::Candidate &a, const typename Context::Candidate &b) {
+                          return a.bound < b.bound;
+                      });
+            for (std::size_t i = 0; i < ctx.cover.size(); ++i) {
+                if (!(ctx.cover[i].bound < nnList.back().second))
+                    break;
+                Node_ptr sibling = ctx.cover[i].node;
+                Distance dist_sibling = sibling->dist(p);
+                evaluations++;
+                if (dist_sibling - sibling->maxdist < nnList.back().second)
+                    search(sibling, dist_sibling);
+            }
+        }
+        ctx.cover.clear();
+        ctx.evaluations = evaluations;
+        ctx.visited = visited;
+        if (nnSize < nnList.size())
+            nnList.resize(nnSize);
+    }
+
+/*** climb to the first ancestor of hint that covers p and insert below it, the ancestors above are evaluated only if their maxdist may grow ***/
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr Tree<recType, Metric>::insert(const recType &p, Node_ptr hint) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        Node_ptr x = make_node_(p);
+        if (root == nullptr) {
+            root = x;
+            return x;
+        }
+        Node_ptr start = hint != nullptr ? hint : root;
+        Distance dist = start->dist(x);
+        while (dist > start->covdist() && start->parent != nullptr) {
+            start = start->parent;
+            dist = start->dist(x);
+        }
+        if (start->parent == nullptr) {
+            root = insert(root, x);
+            return x;
+        }
+        // an ancestor above start is bounded through the parent distances and only evaluated where that
+        // bound exceeds its maxdist, so maxdist widens by the exact distance as with a root insert
+        Distance up = dist;
+        for (Node_ptr c = start; c->parent != nullptr; c = c->parent) {
+            up += c->parent_dist;
+            if (up > c->parent->maxdist) {
+                up = c->parent->dist(x);
+                c->parent->maxdist = std::max(c->parent->maxdist, up);
+            }
+            c->parent->summary.merge(x->summary);
+            c->parent->subtree_size += x->subtree_size;
+        }
+        insert_(start, x);
+        return x;
+    }
+
+/*
+   _|   _` |   _|    \    -_)
+ \__| \__,_| \__| _| _| \___|
+  result cache for repeated queries
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::set_cache(std::size_t capacity, std::function<std::size_t(const recType &)> hash,
+                                          bool by_region) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        cache_.reset(capacity > 0 ? new Cache(capacity, std::move(hash), by_region) : nullptr);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::CacheStats Tree<recType, Metric>::cache_stats() const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        return cache_ ? cache_->stats() : CacheStats();
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::invalidate_cache(const recType &center, Distance radius) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        if (cache_)
+            cache_->changed(center, radius);
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::invalidate_cache() {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        if (cache_)
+            cache_->clear();
+    }
+
+/*** distance memo, see Node::dist ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::set_distance_cache(std::size_t capacity) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        distance_cache_.reset(capacity > 0 ? new DistanceCache<Distance>(capacity) : nullptr);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::DistanceCacheStats Tree<recType, Metric>::distance_cache_stats() const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        return distance_cache_ ? distance_cache_->stats() : DistanceCacheStats();
+    }
+
+/*** prepared forms, see metric_traits.hpp ***/
+    template <class recType, class Metric>
+    Tree<recType, Metric>::PreparedQuery::PreparedQuery(const TreeType &tree, const recType &record)
+        : tree(&tree), record(&record), own(tree.prepare_(record)), prepared(&own), outer(nullptr) {
+        if (Traits::has_prepare) {
+            outer = top();
+            top() = this;
+        }
+    }
+
+    template <class recType, class Metric>
+    Tree<recType, Metric>::PreparedQuery::PreparedQuery(const TreeType &tree, const recType &record, const Prepared *prepared)
+        : tree(&tree), record(&record), prepared(prepared), outer(nullptr) {
+        if (Traits::has_prepare && prepared != nullptr) {
+            outer = top();
+            top() = this;
+        }
+    }
+
+    template <class recType, class Metric>
+    Tree<recType, Metric>::PreparedQuery::~PreparedQuery() {
+        if (Traits::has_prepare && prepared != nullptr)
+            top() = outer;
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::PreparedQuery *&Tree<recType, Metric>::PreparedQuery::top() {
+        static thread_local PreparedQuery *current = nullptr;
+        return current;
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance Tree<recType, Metric>::metric(const NodeType &a, const NodeType &b) const {
+        return prepared_metric_(a, b.data, &b.prepared, std::integral_constant<bool, Traits::has_prepare>());
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance Tree<recType, Metric>::metric(const NodeType &a, const recType &q) const {
+        return prepared_metric_(a, q, nullptr, std::integral_constant<bool, Traits::has_prepare>());
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::metric(const NodeType &a, const NodeType &b, Distance bound) const {
+        return prepared_metric_(a, b.data, &b.prepared, std::integral_constant<bool, Traits::has_prepare>(), bound);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::metric(const NodeType &a, const recType &q, Distance bound) const {
+        return prepared_metric_(a, q, nullptr, std::integral_constant<bool, Traits::has_prepare>(), bound);
+    }
+
+    template <class recType, class Metric>
+    template <class... Bound>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::prepared_metric_(const NodeType &a, const recType &q, const Prepared *prepared, std::true_type,
+                                            Bound... bound) const {
+        // q is either the query of a scope on this thread or prepared here, for a query no call has prepared
+        if (prepared == nullptr)
+            prepared = scoped_(q);
+        if (prepared == nullptr)
+            return call_(a.prepared, metric_.prepare(q), bound...);
+        return call_(a.prepared, *prepared, bound...);
+    }
+
+    template <class recType, class Metric>
+    template <class... Bound>
+    typename Tree<recType, Metric>::Distance
+    Tree<recType, Metric>::prepared_metric_(const NodeType &a, const recType &q, const Prepared *, std::false_type,
+                                            Bound... bound) const {
+        return call_(a.data, q, bound...);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance Tree<recType, Metric>::bound_(Distance radius, Distance maxdist) {
+        if (radius >= std::numeric_limits<Distance>::max() - maxdist)
+            return std::numeric_limits<Distance>::max();
+        return radius + maxdist;
+    }
+
+    template <class recType, class Metric>
+    auto Tree<recType, Metric>::scoped_(const recType &q) const -> const Prepared * {
+        for (auto scope = PreparedQuery::top(); scope != nullptr; scope = scope->outer)
+            if (scope->record == &q && scope->tree == this)
+                return scope->prepared;
+        return nullptr;
+    }
+
+    template <class recType, class Metric>
+    auto Tree<recType, Metric>::query_argument_(const recType &q, Prepared &scratch, std::true_type) const -> const Argument & {
+        if (auto prepared = scoped_(q))
+            return *prepared;
+        scratch = metric_.prepare(q);
+        return scratch;
+    }
+
+    template <class recType, class Metric>
+    template <std::size_t I>
+    bool Tree<recType, Metric>::lower_bounded_(const LowerBounds &bounds, const Argument &a, const Argument &b, Distance bound,
+                                               LowerBoundCounts &counts, Distance &lower,
+                                               std::integral_constant<std::size_t, I>) const {
+        lower = std::get<I>(bounds)(a, b);
+        if (lower > bound) {
+            counts[I]++;
+            return true;
+        }
+        return lower_bounded_(bounds, a, b, bound, counts, lower, std::integral_constant<std::size_t, I + 1>());
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::count_lower_bounds_(const LowerBoundCounts &counts) const {
+        for (std::size_t i = 0; i < counts.size(); ++i)
+            if (counts[i] > 0)
+                lower_bound_counts_[i].fetch_add(counts[i], std::memory_order_relaxed);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::LowerBoundStats Tree<recType, Metric>::lower_bound_stats() const {
+        LowerBoundStats stats;
+        for (std::size_t i = 0; i < Traits::lower_bound_count; ++i)
+            stats.pruned.push_back(lower_bound_counts_[i].load(std::memory_order_relaxed));
+        stats.evaluated = lower_bound_counts_.back().load(std::memory_order_relaxed);
+        return stats;
+    }
+
+/*** only exact results are cached, a hit reports the distances spent on validating the entry ***/
+    template <class recType, class Metric>
+    bool Tree<recType, Metric>::cached_(const recType &p, std::size_t k, Distance distance, Context &ctx,
+                                        const QueryOptions &options) const {
+        if (cache_ == nullptr || options.epsilon != 0 || options.budgeted())
+            return false;
+        std::size_t evaluations = 0;
+        auto dist = [&](const recType &a, const recType &b) {
+                        evaluations++;
+                        return metric(a, b);
+                    };
+        if (!cache_->find(p, k, distance, ctx.result, dist))
+            return false;
+        ctx.evaluations = evaluations;
+        ctx.visited = 0;
+        ctx.exact = true;
+        return true;
+    }
+
+/*** a knn result depends on the records up to its k-th distance only, a range result on those within the radius ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::remember_(const recType &p, std::size_t k, Distance distance, const Context &ctx,
+                                          const QueryOptions &options) const {
+        if (cache_ == nullptr || options.epsilon != 0 || options.budgeted() || !ctx.exact)
+            return;
+        Distance radius = distance;
+        if (k > 0)
+            radius = ctx.result.size() < k ? std::numeric_limits<Distance>::max() : ctx.result.back().second;
+        cache_->store(p, k, distance, ctx.result, radius);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr
+    Tree<recType, Metric>::nn_impl(const recType &p, Context &ctx, const QueryOptions &options) const {
+        PreparedQuery prepared(*this, p);
+        if (cached_(p, 1, 0, ctx, options))
+            return ctx.result.empty() ? nullptr : ctx.result[0].first;
+        Node_ptr nn = nn_search_(p, ctx, options);
+        if (cache_ && nn != nullptr)
+            remember_(p, 1, 0, ctx, options); // shared with knn(p, 1)
+        return nn;
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_impl(const recType &p, unsigned k, Context &ctx, const QueryOptions &options) const {
+        PreparedQuery prepared(*this, p);
+        if (cached_(p, k, 0, ctx, options))
+            return;
+        knn_search_(p, k, ctx, options);
+        remember_(p, k, 0, ctx, options);
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rnn_impl(const recType &p, Distance distance, Context &ctx, const QueryOptions &options) const {
+        PreparedQuery prepared(*this, p);
+        if (cached_(p, 0, distance, ctx, options))
+            return;
+        rnn_search_(p, distance, ctx, options);
+        remember_(p, 0, distance, ctx, options);
+    }
+
+/*
+   _|  _)  |  |                      |
+   _|   |  |   _|   -_)   _| -_)   _` |
+ _|    _| _| \__| \___| _| \___| \__,_|
+  filtered search with attribute summaries
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::set_summary(std::function<AttributeSummary(Node_ptr)> f) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        summary_ = std::move(f);
+        summarize_();
+    }
+
+/*** bottom up: a node's summary is its own record merged with its children's ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::summarize_() {
+        struct Policy : WalkPolicy {
+            const std::function<AttributeSummary(Node_ptr)> &summary;
+            Policy(const std::function<AttributeSummary(Node_ptr)> &summary) : summary(summary) {}
+            void leave(Node_ptr node) {
+                node->summary = summary ? summary(node) : AttributeSummary();
+                for (auto child : node->children)
+                    node->summary.merge(child->summary);
+            }
+        } policy(summary_);
+        if (root == nullptr)
+            return;
+        Context ctx;
+        walk(root, Distance(0), policy, ctx);
+    }
+
+/***
+  best first search over the subtrees the filter admits. Records are offered only if pred accepts
+  them, subtrees are expanded while their lower bound can beat the k-th accepted distance (knn) or
+  the radius (k == 0).
+*/
+    template <class recType, class Metric>
+    template <class Predicate>
+    void Tree<recType, Metric>::filtered_search_(const recType &p, std::size_t k, Distance radius, Predicate &pred,
+                                                 const AttributeFilter &filter, Context &ctx,
+                                                 const QueryOptions &options) const {
+        PreparedQuery prepared(*this, p);
+        using Candidate = typename Context::Candidate;
+        auto &result = ctx.result;
+        auto &frontier = ctx.frontier;
+        result.clear();
+        frontier.clear();
+        BudgetPolicy budget(options, ctx);
+        // without summaries every subtree may hold a match
+        auto admits = [&](Node_ptr node) { return !summary_ || filter.admits(node->summary); };
+        if (root == nullptr || !admits(root)) {
+            ctx.evaluations = 0;
+            return;
+        }
+
+        auto farther = [](const std::pair<Node_ptr, Distance> &a,
+                          const std::pair<Node_ptr, Distance> &b) {
+                           return a.second < b.second;
+                       };
+        auto looser = [](const Candidate &a, const Candidate &b) { return a.bound > b.bound; };
+        auto bound = [&]() {
+                         if (k == 0)
+                             return radius;
+                         return result.size() < k ? std::numeric_limits<Distance>::max()
+                                                  : result.front().second;
+                     };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (!(dist < bound()) || !pred(node))
+                             return;
+                         if (k == 0) {
+                             result.emplace_back(node, dist);
+                         } else if (result.size() < k) {
+                             result.emplace_back(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         } else {
+                             std::pop_heap(result.begin(), result.end(), farther);
+                             result.back() = std::make_pair(node, dist);
+                             std::push_heap(result.begin(), result.end(), farther);
+                         }
+                     };
+
+        Distance dist_root = root->dist(p);
+        offer(root, dist_root);
+        frontier.push_back({Distance(0), dist_root, root});
+        while (!frontier.empty()) {
+            std::pop_heap(frontier.begin(), frontier.end(), looser);
+            Candidate current = frontier.back();
+            frontier.pop_back();
+            if (!(bound() > budget.relaxed(current.bound)))
+                break; // every remaining subtree is at least as far
+            if (!budget.charge(current.node))
+                break;
+            for (auto child : current.node->children) {
+                if (!admits(child)) {
+                    ctx.evaluations--; // charged, but never evaluated
+                    continue;
+                }
+                Distance dist_child = child->dist(p);
+                offer(child, dist_child);
+                Distance lower = dist_child - child->maxdist;
+                if (!child->children.empty() && bound() > budget.relaxed(lower)) {
+                    frontier.push_back({lower, dist_child, child});
+                    std::push_heap(frontier.begin(), frontier.end(), looser);
+                }
+            }
+        }
+        if (k > 0)
+            std::sort_heap(result.begin(), result.end(), farther);
+    }
+
+    template <class recType, class Metric>
+    template <class Predicate>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::knn_if(const recType &p, unsigned k, Predicate pred, const AttributeFilter &filter) const {
+        Context ctx;
+        return knn_if(p, k, pred, filter, ctx);
+    }
+
+    template <class recType, class Metric>
+    template <class Predicate>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::rnn_if(const recType &p, Distance distance, Predicate pred, const AttributeFilter &filter) const {
+        Context ctx;
+        return rnn_if(p, distance, pred, filter, ctx);
+    }
+
+    template <class recType, class Metric>
+    template <class Predicate>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::knn_if(const recType &p, unsigned k, Predicate pred, const AttributeFilter &filter,
+                                  Context &ctx, const QueryOptions &options) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        if (k == 0) {
+            ctx.result.clear();
+            return ctx.result;
+        }
+        filtered_search_(p, k, std::numeric_limits<Distance>::max(), pred, filter, ctx, options);
+        return ctx.result;
+    }
+
+    template <class recType, class Metric>
+    template <class Predicate>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::rnn_if(const recType &p, Distance distance, Predicate pred, const AttributeFilter &filter,
+                                  Context &ctx, const QueryOptions &options) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        filtered_search_(p, 0, distance, pred, filter, ctx, options);
+        return ctx.result;
+    }
+
+/*
+  |
+   _ \   _| _ \ \ \  \ / (_-<   -_)
+ _.__/ _| \___/  \_/\_/  ___/ \___|
+  incremental neighbour browsing
+*/
+    template <class recType, class Metric>
+    NeighbourRange<recType, Metric> Tree<recType, Metric>::neighbours(const recType &p) const {
+        return NeighbourRange<recType, Metric>(*this, p);
+    }
+
+    template <class recType, class Metric>
+    NeighbourRange<recType, Metric>::NeighbourRange(const Tree<recType, Metric> &tree, const recType &query)
+        : query(query), lock(tree.global_mut), tree(&tree), prepared(tree.prepare_(query)) {
+        if (tree.root == nullptr) {
+            finished = true;
+            return;
+        }
+        evaluations_ = 1;
+        push(tree.root, tree.prepared_metric_(*tree.root, this->query, &prepared));
+        advance();
+    }
+
+/*** offer the record of node and, if it has children, its subtree ***/
+    template <class recType, class Metric>
+    void NeighbourRange<recType, Metric>::push(Node_ptr node, Distance dist) {
+        heap.push_back({dist, dist, node, true});
+        std::push_heap(heap.begin(), heap.end(), later);
+        if (!node->children.empty()) {
+            heap.push_back({dist - node->maxdist, dist, node, false});
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+
+    template <class recType, class Metric>
+    void NeighbourRange<recType, Metric>::advance() {
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Entry top = heap.back();
+            heap.pop_back();
+            if (top.record) {
+                current = value_type(top.node, top.dist);
+                return;
+            }
+            // nothing in the heap can be closer than this subtree, expand it
+            for (auto child : top.node->children) {
+                evaluations_++;
+                push(child, tree->prepared_metric_(*child, query, &prepared));
+            }
+        }
+        finished = true;
+    }
+
+/*
+  |               |       |
+   _ \   _` |   _|   _|     \
+ _.__/ \__,_| \__| \__| _| _|
+  batch queries
+*/
+/***
+  run query(q, ctx), which leaves its neighbours in ctx.result, for every query on the thread pool under one read lock.
+  stride > 0 reserves stride slots per query and compacts afterwards, stride == 0 collects
+  variable sized results per worker and copies them into place.
+*/
+    template <class recType, class Metric>
+    template <class Query>
+    void Tree<recType, Metric>::batch_(const std::vector<recType> &queries, std::size_t stride,
+                                       BatchResult<Distance> &out, Query query) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+
+        auto n = queries.size();
+        out.offsets.assign(n + 1, 0);
+        if (root == nullptr || n == 0) {
+            out.ids.clear();
+            out.distances.clear();
+            return;
+        }
+        auto &pool = ThreadPool::global();
+        std::vector<Context> contexts(pool.size() + 1); // scratch of each worker, reused over its queries
+        std::size_t grain = std::max<std::size_t>(1, n / ((pool.size() + 1) * 8));
+        std::vector<std::size_t> counts(n);
+
+        if (stride > 0) {
+            out.ids.resize(n * stride);
+            out.distances.resize(n * stride);
+            pool.parallel_for(n, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+                auto &ctx = contexts[worker];
+                for (auto i = begin; i < end; ++i) {
+                    query(queries[i], ctx);
+                    counts[i] = ctx.result.size();
+                    for (std::size_t j = 0; j < counts[i]; ++j) {
+                        out.ids[i * stride + j] = ctx.result[j].first->ID;
+                        out.distances[i * stride + j] = ctx.result[j].second;
+                    }
+                }
+            });
+            pack_(out, counts, stride);
+            return;
+        }
+
+        // results stay in the worker that found them until their offsets are known
+        struct Found {
+            std::vector<unsigned> ids;
+            std::vector<Distance> distances;
+        };
+        std::vector<Found> found(contexts.size());
+        std::vector<std::pair<std::size_t, std::size_t>> origin(n); // (worker, first entry)
+        pool.parallel_for(n, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            auto &ctx = contexts[worker];
+            auto &f = found[worker];
+            for (auto i = begin; i < end; ++i) {
+                query(queries[i], ctx);
+                origin[i] = std::make_pair(worker, f.ids.size());
+                counts[i] = ctx.result.size();
+                for (auto &r : ctx.result) {
+                    f.ids.push_back(r.first->ID);
+                    f.distances.push_back(r.second);
+                }
+            }
+        });
+        for (std::size_t i = 0; i < n; ++i)
+            out.offsets[i + 1] = out.offsets[i] + counts[i];
+        out.ids.resize(out.offsets[n]);
+        out.distances.resize(out.offsets[n]);
+        pool.parallel_for(n, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker) {
+            for (auto i = begin; i < end; ++i) {
+                auto &f = found[origin[i].first];
+                std::copy_n(f.ids.begin() + origin[i].second, counts[i], out.ids.begin() + out.offsets[i]);
+                std::copy_n(f.distances.begin() + origin[i].second, counts[i],
+                            out.distances.begin() + out.offsets[i]);
+            }
+        });
+    }
+
+/*** close the gaps left by queries with fewer than stride results (tree smaller than k, budgets) ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::pack_(BatchResult<Distance> &out, const std::vector<std::size_t> &counts,
+                                      std::size_t stride) {
+        std::size_t pos = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            if (pos != i * stride) {
+                std::copy_n(out.ids.begin() + i * stride, counts[i], out.ids.begin() + pos);
+                std::copy_n(out.distances.begin() + i * stride, counts[i], out.distances.begin() + pos);
+            }
+            pos += counts[i];
+            out.offsets[i + 1] = pos;
+        }
+        out.ids.resize(pos);
+        out.distances.resize(pos);
+    }
+
+/***
+  knn for a group of queries in one depth first walk. Every node record is loaded once for all
+  queries still interested in its subtree, their distances are computed in one pass and each query
+  prunes with its own k-th distance. Children are expanded nearest (over the group) first.
+
+  With to_center the group is a tight cluster around queries[0]: a child is evaluated once against
+  the center and a query only evaluates it itself if |d(center, child) - d(query, center)|, a lower
+  bound of its distance, does not already rule out the child's record and subtree.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_group_(const recType *queries, const Prepared *const *prepared, std::size_t count,
+                                           unsigned k, GroupContext &g, const QueryOptions &options,
+                                           const Distance *to_center) const {
+        using Frame = typename GroupContext::Frame;
+        auto farther = [](const std::pair<Node_ptr, Distance> &a,
+                          const std::pair<Node_ptr, Distance> &b) {
+                           return a.second < b.second;
+                       };
+        auto relaxed = [&](Distance lower_bound) {
+                           return options.epsilon == 0 ? lower_bound : Distance(lower_bound * (1 + options.epsilon));
+                       };
+        auto bound = [&](std::size_t j) {
+                         return g.sizes[j] < k ? std::numeric_limits<Distance>::max() : g.results[j * k].second;
+                     };
+        auto measure = [&](Node_ptr node, std::size_t j) {
+                           return prepared_metric_(*node, queries[j], prepared != nullptr ? prepared[j] : nullptr);
+                       };
+        auto offer = [&](std::size_t j, Node_ptr node, Distance dist) {
+                         auto heap = g.results.begin() + j * k;
+                         if (g.sizes[j] < k) {
+                             heap[g.sizes[j]++] = std::make_pair(node, dist);
+                             std::push_heap(heap, heap + g.sizes[j], farther);
+                         } else if (dist < heap->second) {
+                             std::pop_heap(heap, heap + k, farther);
+                             heap[k - 1] = std::make_pair(node, dist);
+                             std::push_heap(heap, heap + k, farther);
+                         }
+                     };
+
+        g.results.resize(count * k);
+        g.sizes.assign(count, 0);
+        g.active.clear();
+        g.frames.clear();
+        for (std::size_t j = 0; j < count; ++j) {
+            Distance dist = measure(root, j);
+            offer(j, root, dist);
+            g.active.emplace_back(j, dist);
+        }
+        g.frames.push_back(Frame{root, 0, count});
+
+        while (!g.frames.empty()) {
+            // the top frame owns the tail of active
+            Frame frame = g.frames.back();
+            g.frames.pop_back();
+            Node_ptr node = frame.node;
+            g.queries.clear();
+            for (auto t = frame.begin; t < frame.end; ++t) {
+                auto &a = g.active[t];
+                if (bound(a.first) > relaxed(a.second - node->maxdist)) // bounds shrank since the push
+                    g.queries.push_back(a.first);
+            }
+            g.active.resize(frame.begin);
+            auto m = g.queries.size();
+            if (m == 0)
+                continue;
+
+            auto n = node->children.size();
+            g.dists.resize(n * m);
+            g.order.clear();
+            for (std::size_t i = 0; i < n; ++i) {
+                Node_ptr child = node->children[i];
+                if (i + 1 < n)
+                    METRIC_SPACE_PREFETCH(&node->children[i + 1]->data);
+                Distance nearest = std::numeric_limits<Distance>::max();
+                Distance center = to_center ? measure(child, 0) : Distance(0);
+                for (std::size_t t = 0; t < m; ++t) {
+                    auto j = g.queries[t];
+                    if (to_center) {
+                        Distance lower = center > to_center[j] ? center - to_center[j] : to_center[j] - center;
+                        if (!(bound(j) > relaxed(lower - child->maxdist))) {
+                            g.dists[i * m + t] = std::numeric_limits<Distance>::max();
+                            continue;
+                        }
+                    }
+                    Distance dist = to_center && j == 0 ? center : measure(child, j);
+                    g.dists[i * m + t] = dist;
+                    offer(j, child, dist);
+                    nearest = std::min(nearest, dist);
+                }
+                if (!child->children.empty())
+                    g.order.emplace_back(nearest - child->maxdist, i);
+            }
+            // farthest first onto the stack, so the nearest child is expanded next
+            std::sort(g.order.begin(), g.order.end(),
+                      [](const std::pair<Distance, int> &a, const std::pair<Distance, int> &b) {
+                          return a.first > b.first;
+                      });
+            for (auto &o : g.order) {
+                Node_ptr child = node->children[o.second];
+                auto begin = g.active.size();
+                for (std::size_t t = 0; t < m; ++t) {
+                    Distance dist = g.dists[o.second * m + t];
+                    if (dist != std::numeric_limits<Distance>::max() && bound(g.queries[t]) > relaxed(dist - child->maxdist))
+                        g.active.emplace_back(g.queries[t], dist);
+                }
+                if (g.active.size() > begin)
+                    g.frames.push_back(Frame{child, begin, g.active.size()});
+            }
+        }
+        for (std::size_t j = 0; j < count; ++j) {
+            auto heap = g.results.begin() + j * k;
+            std::sort_heap(heap, heap + g.sizes[j], farther);
+        }
+    }
+
+/*** the range version of knn_group_, a query follows a child while it can reach a record closer than distance, as rnn ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rnn_group_(const recType *queries, const Prepared *const *prepared, std::size_t count,
+                                           Distance distance, GroupContext &g, const Distance *to_center) const {
+        using Frame = typename GroupContext::Frame;
+        auto measure = [&](Node_ptr node, std::size_t j) {
+                           return prepared_metric_(*node, queries[j], prepared != nullptr ? prepared[j] : nullptr);
+                       };
+        g.active.clear();
+        g.frames.clear();
+        for (std::size_t j = 0; j < count; ++j) {
+            Distance dist = measure(root, j);
+            if (dist < distance)
+                g.found.emplace_back(j, root, dist);
+            if (dist - root->maxdist < distance)
+                g.active.emplace_back(j, dist);
+        }
+        if (!g.active.empty())
+            g.frames.push_back(Frame{root, 0, g.active.size()});
+
+        while (!g.frames.empty()) {
+            Frame frame = g.frames.back();
+            g.frames.pop_back();
+            Node_ptr node = frame.node;
+            g.queries.clear();
+            for (auto t = frame.begin; t < frame.end; ++t)
+                g.queries.push_back(g.active[t].first);
+            g.active.resize(frame.begin);
+            auto m = g.queries.size();
+
+            for (auto child : node->children) {
+                Distance center = to_center ? measure(child, 0) : Distance(0);
+                auto begin = g.active.size();
+                for (std::size_t t = 0; t < m; ++t) {
+                    auto j = g.queries[t];
+                    if (to_center) {
+                        Distance lower = center > to_center[j] ? center - to_center[j] : to_center[j] - center;
+                        if (!(lower - child->maxdist < distance))
+                            continue;
+                    }
+                    Distance dist = to_center && j == 0 ? center : measure(child, j);
+                    if (dist < distance)
+                        g.found.emplace_back(j, child, dist);
+                    if (!child->children.empty() && dist - child->maxdist < distance)
+                        g.active.emplace_back(j, dist);
+                }
+                if (g.active.size() > begin)
+                    g.frames.push_back(Frame{child, begin, g.active.size()});
+            }
+        }
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_batch_grouped_(const std::vector<recType> &queries, unsigned k,
+                                                   BatchResult<Distance> &out,
+                                                   const QueryOptions &options) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+
+        auto n = queries.size();
+        out.offsets.assign(n + 1, 0);
+        if (root == nullptr || n == 0 || k == 0) {
+            out.ids.clear();
+            out.distances.clear();
+            return;
+        }
+        auto &pool = ThreadPool::global();
+        std::vector<GroupContext> contexts(pool.size() + 1);
+        std::vector<std::size_t> counts(n);
+        out.ids.resize(n * k);
+        out.distances.resize(n * k);
+
+        // with a result cache every query is looked up first and only the misses form groups
+        bool cached = cache_ != nullptr && options.epsilon == 0;
+        std::vector<Context> lookups(cached ? pool.size() + 1 : 0);
+        std::vector<std::size_t> pending;
+        if (cached) {
+            std::vector<char> hit(n, 0);
+            std::size_t grain = std::max<std::size_t>(1, n / ((pool.size() + 1) * 8));
+            pool.parallel_for(n, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+                auto &ctx = lookups[worker];
+                for (auto i = begin; i < end; ++i) {
+                    if (!cached_(queries[i], k, 0, ctx, options))
+                        continue;
+                    hit[i] = 1;
+                    counts[i] = ctx.result.size();
+                    for (std::size_t r = 0; r < counts[i]; ++r) {
+                        out.ids[i * k + r] = ctx.result[r].first->ID;
+                        out.distances[i * k + r] = ctx.result[r].second;
+                    }
+                }
+            });
+            for (std::size_t i = 0; i < n; ++i)
+                if (!hit[i])
+                    pending.push_back(i);
+        }
+
+        auto m = cached ? pending.size() : n;
+        std::size_t group = options.group_size;
+        std::size_t groups = (m + group - 1) / group;
+        std::size_t grain = std::max<std::size_t>(1, groups / ((pool.size() + 1) * 4));
+        pool.parallel_for(groups, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            auto &g = contexts[worker];
+            for (auto c = begin; c < end; ++c) {
+                auto first = c * group;
+                auto count = std::min(group, m - first);
+                const recType *members = queries.data() + first;
+                if (cached) {
+                    g.records.resize(count);
+                    for (std::size_t j = 0; j < count; ++j)
+                        g.records[j] = queries[pending[first + j]];
+                    members = g.records.data();
+                }
+                g.forms.resize(count);
+                g.prepared.resize(count);
+                for (std::size_t j = 0; j < count; ++j) {
+                    g.forms[j] = prepare_(members[j]);
+                    g.prepared[j] = &g.forms[j];
+                }
+                knn_group_(members, g.prepared.data(), count, k, g, options);
+                for (std::size_t j = 0; j < count; ++j) {
+                    auto i = cached ? pending[first + j] : first + j;
+                    counts[i] = g.sizes[j];
+                    for (std::size_t r = 0; r < g.sizes[j]; ++r) {
+                        out.ids[i * k + r] = g.results[j * k + r].first->ID;
+                        out.distances[i * k + r] = g.results[j * k + r].second;
+                    }
+                    if (cached) {
+                        auto &ctx = lookups[worker];
+                        auto result = g.results.begin() + j * k;
+                        ctx.result.assign(result, result + g.sizes[j]);
+                        ctx.exact = true;
+                        remember_(members[j], k, 0, ctx, options);
+                    }
+                }
+            }
+        });
+        pack_(out, counts, k);
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::nn_batch(const std::vector<recType> &queries,
+                                         BatchResult<Distance> &out,
+                                         const QueryOptions &options) const {
+        if (options.group_size > 1)
+            return knn_batch(queries, 1, out, options);
+        batch_(queries, 1, out, [&](const recType &q, Context &ctx) { nn_impl(q, ctx, options); });
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_batch(const std::vector<recType> &queries, unsigned k,
+                                          BatchResult<Distance> &out,
+                                          const QueryOptions &options) const {
+        // groups walk without budgets, a budgeted batch runs query by query
+        if (options.group_size > 1 && !options.budgeted())
+            return knn_batch_grouped_(queries, k, out, options);
+        batch_(queries, k, out, [&](const recType &q, Context &ctx) { knn_impl(q, k, ctx, options); });
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rnn_batch(const std::vector<recType> &queries, Distance distance,
+                                          BatchResult<Distance> &out,
+                                          const QueryOptions &options) const {
+        batch_(queries, 0, out, [&](const recType &q, Context &ctx) { rnn_impl(q, distance, ctx, options); });
+    }
+
+    template <class recType, class Metric>
+    BatchResult<typename Tree<recType, Metric>::Distance>
+    Tree<recType, Metric>::nn_batch(const std::vector<recType> &queries,
+                                    const QueryOptions &options) const {
+        BatchResult<Distance> out;
+        nn_batch(queries, out, options);
+        return out;
+    }
+
+    template <class recType, class Metric>
+    BatchResult<typename Tree<recType, Metric>::Distance>
+    Tree<recType, Metric>::knn_batch(const std::vector<recType> &queries, unsigned k,
+                                     const QueryOptions &options) const {
+        BatchResult<Distance> out;
+        knn_batch(queries, k, out, options);
+        return out;
+    }
+
+    template <class recType, class Metric>
+    BatchResult<typename Tree<recType, Metric>::Distance>
+    Tree<recType, Metric>::rnn_batch(const std::vector<recType> &queries, Distance distance,
+                                     const QueryOptions &options) const {
+        BatchResult<Distance> out;
+        rnn_batch(queries, distance, out, options);
+        return out;
+    }
+
+/*
+    _)       _)
+     |   _ \  |    \
+     | \___/ _| _| _|
+ __/
+  all k nearest neighbours between two trees
+*/
+    template <class recType, class Metric>
+    BatchResult<typename Tree<recType, Metric>::Distance>
+    Tree<recType, Metric>::knn_join(const Tree &other, unsigned k) const {
+        BatchResult<Distance> out;
+        knn_join(other, k, out);
+        return out;
+    }
+
+/***
+  the records of this tree in depth first order are cut into groups, consecutive records are close
+  to each other and so a group is a small ball of queries. Each group walks other together
+  (knn_group_ with its first record as center), so the query side prunes a whole reference subtree
+  for all of its records with one distance, like a dual tree traversal cut at group level.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_join(const Tree &other, unsigned k, BatchResult<Distance> &out) const {
+        // both read locks at once, a.knn_join(b) next to b.knn_join(a) and a waiting writer must not deadlock
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut, std::defer_lock);
+        std::shared_lock<std::shared_timed_mutex> lk_other(other.global_mut, std::defer_lock);
+        if (&other == this)
+            lk.lock();
+        else
+            std::lock(lk, lk_other);
+        knn_join_(other, k, out);
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::knn_join_(const Tree &other, unsigned k, BatchResult<Distance> &out) const {
+        bool self = &other == this;
+        auto n = index_.size();
+        out.offsets.assign(n + 1, 0);
+        if (root == nullptr || other.root == nullptr || k == 0) {
+            out.ids.clear();
+            out.distances.clear();
+            return;
+        }
+        std::vector<Node_ptr> order;
+        order.reserve(N);
+        std::vector<Node_ptr> stack(1, root);
+        while (!stack.empty()) {
+            Node_ptr node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            stack.insert(stack.end(), node->children.rbegin(), node->children.rend());
+        }
+
+        // a self join also finds the record itself, it is dropped when the result is written
+        std::size_t wanted = k + (self ? 1 : 0);
+        const std::size_t group = 32;
+        std::size_t groups = (order.size() + group - 1) / group;
+        std::vector<std::size_t> counts(n, 0);
+        out.ids.resize(n * k);
+        out.distances.resize(n * k);
+        auto &pool = ThreadPool::global();
+        std::vector<GroupContext> contexts(pool.size() + 1);
+        std::size_t grain = std::max<std::size_t>(1, groups / ((pool.size() + 1) * 4));
+        pool.parallel_for(groups, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            auto &g = contexts[worker];
+            for (auto c = begin; c < end; ++c) {
+                auto first = c * group;
+                auto count = std::min(group, order.size() - first);
+                g.records.resize(count);
+                g.prepared.resize(count);
+                g.to_center.resize(count);
+                for (std::size_t j = 0; j < count; ++j) {
+                    g.records[j] = order[first + j]->data;
+                    g.prepared[j] = &order[first + j]->prepared; // the records were prepared on insert
+                    g.to_center[j] = j == 0 ? Distance(0) : metric(*order[first + j], *order[first]);
+                }
+                other.knn_group_(g.records.data(), g.prepared.data(), count, wanted, g, QueryOptions(), g.to_center.data());
+                for (std::size_t j = 0; j < count; ++j) {
+                    Node_ptr q = order[first + j];
+                    std::size_t written = 0;
+                    for (std::size_t r = 0; r < g.sizes[j] && written < k; ++r) {
+                        auto &nb = g.results[j * wanted + r];
+                        if (self && nb.first == q)
+                            continue;
+                        out.ids[q->ID * k + written] = nb.first->ID;
+                        out.distances[q->ID * k + written] = nb.second;
+                        written++;
+                    }
+                    counts[q->ID] = written;
+                }
+            }
+        });
+        pack_(out, counts, k);
+    }
+
+/***
+  a pair is kept by the query with the smaller ID only, so every pair is decided by one distance and
+  the rows stay consistent even for a metric with rounding asymmetries
+*/
+    template <class recType, class Metric>
+    std::vector<std::vector<std::pair<std::size_t, typename Tree<recType, Metric>::Distance>>>
+    Tree<recType, Metric>::range_pairs(Distance distance) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+
+        std::vector<std::vector<std::pair<std::size_t, Distance>>> upper(index_.size()); // neighbours with a larger ID
+        // depth first, so a group of consecutive records is a small ball
+        std::vector<Node_ptr> order;
+        order.reserve(N);
+        std::vector<Node_ptr> stack(root != nullptr ? 1 : 0, root);
+        while (!stack.empty()) {
+            Node_ptr node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            stack.insert(stack.end(), node->children.rbegin(), node->children.rend());
+        }
+
+        const std::size_t group = 32;
+        std::size_t groups = (order.size() + group - 1) / group;
+        auto &pool = ThreadPool::global();
+        std::vector<GroupContext> contexts(pool.size() + 1);
+        std::size_t grain = std::max<std::size_t>(1, groups / ((pool.size() + 1) * 4));
+        pool.parallel_for(groups, grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            auto &g = contexts[worker];
+            for (auto c = begin; c < end; ++c) {
+                auto first = c * group;
+                auto count = std::min(group, order.size() - first);
+                g.records.resize(count);
+                g.prepared.resize(count);
+                g.to_center.resize(count);
+                for (std::size_t j = 0; j < count; ++j) {
+                    g.records[j] = order[first + j]->data;
+                    g.prepared[j] = &order[first + j]->prepared; // the records were prepared on insert
+                    g.to_center[j] = j == 0 ? Distance(0) : metric(*order[first + j], *order[first]);
+                }
+                g.found.clear();
+                rnn_group_(g.records.data(), g.prepared.data(), count, distance, g, g.to_center.data());
+                for (auto &f : g.found) {
+                    auto id = order[first + std::get<0>(f)]->ID;
+                    if (std::get<1>(f)->ID > id)
+                        upper[id].emplace_back(std::get<1>(f)->ID, std::get<2>(f));
+                }
+                for (std::size_t j = 0; j < count; ++j) {
+                    auto &row = upper[order[first + j]->ID];
+                    std::sort(row.begin(), row.end());
+                }
+            }
+        });
+
+        return upper;
+    }
+
+/*
+        |
+   _| | /    \     \
+ _|   _\_\ _| _| _| _|
+  reverse k nearest neighbours
+*/
+    template <class recType, class Metric>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::rknn(const recType &q, unsigned k) const {
+        Context ctx;
+        rknn(q, k, ctx);
+        return std::move(ctx.result);
+    }
+
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::rknn(const recType &q, unsigned k, Context &ctx) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        std::lock_guard<std::mutex> lk_rknn(rknn_mut);
+        PreparedQuery prepared(*this, q);
+        ctx.result.clear();
+        ctx.exact = true;
+        ctx.evaluations = 0;
+        ctx.visited = 0;
+        if (root == nullptr || k == 0)
+            return ctx.result;
+        rknn_refresh_(k);
+
+        auto &c = *rknn_;
+        Context verify;
+        std::vector<std::pair<Node_ptr, Distance>> found;
+        rknn_walk_(q, ctx, [&](Node_ptr x, Distance dist) {
+                              // a radius from before later inserts may have shrunk since
+                              if (c.exact_at[x->ID] != c.inserts) {
+                                  c.radius[x->ID] = rknn_radius_(x, verify);
+                                  c.exact_at[x->ID] = c.inserts;
+                                  ctx.evaluations += verify.evaluations;
+                              }
+                              if (dist <= c.radius[x->ID])
+                                  found.emplace_back(x, dist);
+                          });
+        std::sort(found.begin(), found.end(),
+                  [](const std::pair<Node_ptr, Distance> &a, const std::pair<Node_ptr, Distance> &b) {
+                      return a.second < b.second;
+                  });
+        ctx.result = std::move(found);
+        return ctx.result;
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::set_rknn_cache(unsigned k) {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        std::lock_guard<std::mutex> lk_rknn(rknn_mut);
+        if (k == 0) {
+            rknn_.reset();
+            return;
+        }
+        rknn_refresh_(k);
+    }
+
+/*** k + 1 nearest from the node itself, the first of them is the record ***/
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance Tree<recType, Metric>::rknn_radius_(Node_ptr node, Context &ctx) const {
+        auto k = rknn_->k;
+        finger_(node->data, k + 1, node, ctx);
+        return ctx.result.size() == k + 1 ? ctx.result.back().second : std::numeric_limits<Distance>::max();
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rknn_maxima_() const {
+        auto &c = *rknn_;
+        c.subtree.assign(index_.size(), Distance(0));
+        c.root = root;
+        std::vector<Node_ptr> order;
+        if (root != nullptr)
+            order.push_back(root);
+        for (std::size_t i = 0; i < order.size(); ++i)
+            order.insert(order.end(), order[i]->children.begin(), order[i]->children.end());
+        // children come after their parent, so backwards every child is final before its parent
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            Node_ptr node = *it;
+            Distance m = c.radius[node->ID];
+            for (auto child : node->children)
+                m = std::max(m, c.subtree[child->ID]);
+            c.subtree[node->ID] = m;
+        }
+    }
+
+/***
+  the radii of erased records' neighbours may grow, those are exactly the records that had an erased
+  one within their stored radius, and the stored radii still find them. Inserted records get their
+  radius computed, with the ones to refresh spread over ThreadPool::global(). Without a structural
+  change (erase or a new root) only the ancestors of refreshed records need their maxima raised.
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::rknn_refresh_(unsigned k) const {
+        if (!rknn_)
+            rknn_.reset(new RknnCache);
+        auto &c = *rknn_;
+        auto n = index_.size();
+        if (!c.built || c.k != k) {
+            c.k = k;
+            BatchResult<Distance> join;
+            knn_join_(*this, k, join);
+            c.radius.assign(n, std::numeric_limits<Distance>::max());
+            for (std::size_t id = 0; id < n; ++id)
+                if (join.offsets[id + 1] - join.offsets[id] == k)
+                    c.radius[id] = join.distances[join.offsets[id + 1] - 1];
+            c.exact_at.assign(n, c.inserts);
+            c.pending.clear();
+            c.erased.clear();
+            c.built = true;
+            rknn_maxima_();
+            return;
+        }
+        if (c.pending.empty() && c.erased.empty())
+            return;
+
+        c.radius.resize(n, Distance(0)); // pending records are no candidates of the erase walk
+        c.exact_at.resize(n, 0);
+        c.subtree.resize(n, Distance(0));
+        bool restructured = !c.erased.empty() || c.root != root;
+        std::vector<unsigned> stale;
+        if (!c.erased.empty()) {
+            rknn_maxima_();
+            Context ctx;
+            for (auto &e : c.erased)
+                rknn_walk_(e, ctx, [&](Node_ptr x, Distance) { stale.push_back(x->ID); });
+            c.erased.clear();
+        }
+        for (auto id : c.pending)
+            if (index_[id] != nullptr)
+                stale.push_back(id);
+        c.pending.clear();
+        std::sort(stale.begin(), stale.end());
+        stale.erase(std::unique(stale.begin(), stale.end()), stale.end());
+
+        auto &pool = ThreadPool::global();
+        std::vector<Context> contexts(pool.size() + 1);
+        std::size_t grain = std::max<std::size_t>(1, stale.size() / ((pool.size() + 1) * 4));
+        pool.parallel_for(stale.size(), grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker worker) {
+            for (auto i = begin; i < end; ++i) {
+                c.radius[stale[i]] = rknn_radius_(index_[stale[i]], contexts[worker]);
+                c.exact_at[stale[i]] = c.inserts;
+            }
+        });
+
+        if (restructured) {
+            rknn_maxima_();
+            return;
+        }
+        for (auto id : stale) {
+            for (Node_ptr a = index_[id]; a != nullptr && c.subtree[a->ID] < c.radius[id]; a = a->parent)
+                c.subtree[a->ID] = c.radius[id];
+        }
+    }
+
+/***
+  depth first, a child is first bounded through its parent distance, |d(q, node) - parent_dist|, and
+  only evaluated if that bound minus its maxdist does not exceed the largest radius in its subtree
+*/
+    template <class recType, class Metric>
+    template <class Callback>
+    void Tree<recType, Metric>::rknn_walk_(const recType &q, Context &ctx, Callback callback) const {
+        auto &c = *rknn_;
+        if (root == nullptr)
+            return;
+        std::vector<std::pair<Node_ptr, Distance>> stack;
+        stack.emplace_back(root, root->dist(q));
+        ctx.evaluations++;
+        while (!stack.empty()) {
+            Node_ptr node = stack.back().first;
+            Distance dist = stack.back().second;
+            stack.pop_back();
+            ctx.visited++;
+            if (dist - node->maxdist > c.subtree[node->ID])
+                continue;
+            if (dist <= c.radius[node->ID])
+                callback(node, dist);
+            for (auto child : node->children) {
+                Distance lower = dist > child->parent_dist ? dist - child->parent_dist : child->parent_dist - dist;
+                if (lower - child->maxdist > c.subtree[child->ID])
+                    continue;
+                stack.emplace_back(child, child->dist(q));
+                ctx.evaluations++;
+            }
+        }
+    }
+
+/*
+   _|
+   _| \ \
+ _| _| _|
+  farthest neighbours
+*/
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Node_ptr Tree<recType, Metric>::fn(const recType &q) const {
+        Context ctx;
+        kfn(q, 1, ctx);
+        return ctx.result.empty() ? nullptr : ctx.result[0].first;
+    }
+
+    template <class recType, class Metric>
+    std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>>
+    Tree<recType, Metric>::kfn(const recType &q, unsigned k) const {
+        Context ctx;
+        kfn(q, k, ctx);
+        return std::move(ctx.result);
+    }
+
+    template <class recType, class Metric>
+    const std::vector<std::pair<typename Tree<recType, Metric>::Node_ptr, typename Tree<recType, Metric>::Distance>> &
+    Tree<recType, Metric>::kfn(const recType &q, unsigned k, Context &ctx) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        kfn_(q, k, ctx);
+        return ctx.result;
+    }
+
+/*** the mirror of knn_best_first_: a max-heap of subtrees by upper bound, the k farthest in a min-heap ***/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::kfn_(const recType &q, unsigned k, Context &ctx, const Prepared *form) const {
+        Prepared own;
+        if (form == nullptr) {
+            own = prepare_(q);
+            form = &own;
+        }
+        PreparedQuery prepared(*this, q, form);
+        using Candidate = typename Context::Candidate;
+        auto &result = ctx.result;
+        auto &frontier = ctx.frontier;
+        result.clear();
+        frontier.clear();
+        ctx.exact = true;
+        ctx.evaluations = 0;
+        ctx.visited = 0;
+        if (root == nullptr || k == 0)
+            return;
+
+        auto nearer = [](const std::pair<Node_ptr, Distance> &a, const std::pair<Node_ptr, Distance> &b) {
+                          return a.second > b.second;
+                      };
+        auto lower_bound = [](const Candidate &a, const Candidate &b) { return a.bound < b.bound; };
+        // the k-th farthest distance so far, nothing closer can enter the result
+        auto kth = [&]() {
+                       return result.size() < k ? std::numeric_limits<Distance>::lowest() : result.front().second;
+                   };
+        auto offer = [&](Node_ptr node, Distance dist) {
+                         if (result.size() < k) {
+                             result.emplace_back(node, dist);
+                             std::push_heap(result.begin(), result.end(), nearer);
+                         } else if (dist > result.front().second) {
+                             std::pop_heap(result.begin(), result.end(), nearer);
+                             result.back() = std::make_pair(node, dist);
+                             std::push_heap(result.begin(), result.end(), nearer);
+                         }
+                     };
+
+        Distance dist = root->dist(q);
+        ctx.evaluations++;
+        offer(root, dist);
+        frontier.push_back(Candidate{dist + root->maxdist, dist, root});
+        while (!frontier.empty()) {
+            std::pop_heap(frontier.begin(), frontier.end(), lower_bound);
+            Candidate c = frontier.back();
+            frontier.pop_back();
+            if (!(c.bound > kth()))
+                break; // every remaining subtree is bounded by this one
+            ctx.visited++;
+            for (auto child : c.node->children) {
+                if (!(c.dist + child->parent_dist + child->maxdist > kth()))
+                    continue;
+                Distance d = child->dist(q);
+                ctx.evaluations++;
+                offer(child, d);
+                if (!child->children.empty() && d + child->maxdist > kth()) {
+                    frontier.push_back(Candidate{d + child->maxdist, d, child});
+                    std::push_heap(frontier.begin(), frontier.end(), lower_bound);
+                }
+            }
+        }
+        std::sort_heap(result.begin(), result.end(), nearer);
+    }
+
+    template <class recType, class Metric>
+    typename Tree<recType, Metric>::Distance Tree<recType, Metric>::diameter(unsigned sweeps) const {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        Distance longest = 0;
+        if (root == nullptr)
+            return longest;
+        Context ctx;
+        Node_ptr from = root;
+        for (unsigned i = 0; i < sweeps; ++i) {
+            kfn_(from->data, 1, ctx, &from->prepared);
+            if (i > 0 && !(ctx.result[0].second > longest))
+                break; // the sweep came back, a longer pair needs another start
+            longest = std::max(longest, ctx.result[0].second);
+            from = ctx.result[0].first;
+        }
+        return longest;
+    }
+
+/*
+        _)             |
+   _ \  | \ \ /  _ \   _|   (_-<
+  .__/ _|  \_/ \___/ \__| ___/
+ _|
+  pivot filter
+*/
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::set_pivots(unsigned count) {
+        std::unique_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        pivots_.clear();
+        pivot_forms_.clear();
+        pivot_table_.clear();
+        count = std::min<unsigned>(count, N);
+        if (count == 0)
+            return;
+
+        // farthest first: start with the record farthest from the root, then always the one farthest from all pivots so far
+        Context ctx;
+        kfn_(root->data, 1, ctx, &root->prepared);
+        Node_ptr next = ctx.result[0].first;
+        pivot_table_.assign(index_.size() * count, Distance(0));
+        std::vector<Distance> nearest(index_.size(), std::numeric_limits<Distance>::max());
+        for (unsigned i = 0; i < count; ++i) {
+            pivots_.push_back(next->data);
+            pivot_forms_.push_back(next->prepared);
+            pivot_column_(i, count);
+            Distance farthest = std::numeric_limits<Distance>::lowest();
+            for (std::size_t id = 0; id < index_.size(); ++id) {
+                if (index_[id] == nullptr)
+                    continue;
+                nearest[id] = std::min(nearest[id], pivot_table_[id * count + i]);
+                if (nearest[id] > farthest) {
+                    farthest = nearest[id];
+                    next = index_[id];
+                }
+            }
+        }
+    }
+
+    template <class recType, class Metric>
+    void Tree<recType, Metric>::pivot_column_(std::size_t i, std::size_t stride) {
+        auto &pool = ThreadPool::global();
+        std::size_t grain = std::max<std::size_t>(1, index_.size() / ((pool.size() + 1) * 4));
+        pool.parallel_for(index_.size(), grain, [&](std::size_t begin, std::size_t end, ThreadPool::Worker) {
+            for (auto id = begin; id < end; ++id)
+                if (index_[id] != nullptr)
+                    pivot_table_[id * stride + i] = call_(argument_(*index_[id]), pivot_argument_(i));
+        });
+    }
+
+    template <class recType, class Metric>
+    const typename Tree<recType, Metric>::Distance *Tree<recType, Metric>::query_pivots_(const recType &p, Context &ctx) const {
+        if (pivots_.empty())
+            return nullptr;
+        // on the form of the query scope, like every other distance of the query
+        Prepared scratch;
+        const Argument &q = query_argument_(p, scratch);
+        ctx.pivots.resize(pivots_.size());
+        for (std::size_t i = 0; i < pivots_.size(); ++i)
+            ctx.pivots[i] = call_(q, pivot_argument_(i));
+        return ctx.pivots.data();
+    }
+
+/*
+  _)
+  (_-<  | _  /   -_)
+  ___/ _| ___| \___|
+  tree size
+*/
+    template <class recType, class Metric> size_t Tree<recType, Metric>::size() {
+        std::shared_lock<std::shared_timed_mutex> lk(global_mut);
+        (void)lk;
+        return size_t(N);
+    }
+
+/*
+   |        \ \   /           |
+  _|   _ \ \ \ /  -_)   _|   _|   _ \   _|
   \__| \___/  \_/ \___| \__| \__| \___/ _|
   export to vector
 */
@@ -784,6 +3232,8 @@ namespace metric_space {
 
     template <class recType, class Metric>
     recType Tree<recType, Metric>::operator[](size_t id) {
+        if (id < index_.size() && index_[id] != nullptr)
+            return index_[id]->data;
         // iterate through tree with stack
         std::stack<Node_ptr> stack;
         Node_ptr current = root;
@@ -892,51 +3342,34 @@ namespace metric_space {
 
     template <class recType, class Metric>
     void Tree<recType, Metric>::print_(NodeType *node_p, std::ostream &ostr) const {
-        static std::string depth2;
-
-        static char depth[2056];
-        static int di = 0;
-
-        auto push = [&](char c) {
-                        depth[di++] = ' ';
-                        depth[di++] = c;
-                        depth[di++] = ' ';
-                        depth[di++] = ' ';
-                        depth[di] = 0;
-                    };
-
-        auto pop = [&]() { depth[di -= 4] = 0; };
-        //    recType pd;
-        // if (node_p->parent) {
-        //     //        auto  pd = node_p->parent->data;
-        //     std::cout << "(" << node_p->ID << ',' << node_p->parent_dist << ','
-        //               << node_p->level << ',' << node_p->data << ","
-        //               << node_p->parent->ID << ")" << std::endl;
-        //     // std::cout << "(" << node_p->level<< ',' << node_p->data << ")" <<
-        //     // std::endl;
-        // } else {
-        //     // std::cout << "(" <<   node_p->level<< ',' <<  node_p->data << ")" <<
-        //     // std::endl;
-        //     std::cout << "(" << node_p->ID << ',' << node_p->parent_dist << ','
-        //               << node_p->level << ',' << node_p->data << ","
-        //               << " no_parent )" << std::endl;
-        // }
-        ostr << "(" << node_p->ID << ")" << std::endl;
-        if (node_p->children.empty())
-            return;
-
-        for (std::size_t i = 0; i < node_p->children.size(); ++i) {
-            ostr << depth;
-            if (i < node_p->children.size() - 1) {
-                ostr << " ├──";
-                push('|');
-            } else {
-                ostr << " └──";
-                push(' ');
+        struct Policy : WalkPolicy {
+            std::ostream &ostr;
+            Node_ptr start;
+            std::string depth;
+            Policy(std::ostream &ostr, Node_ptr start) : ostr(ostr), start(start) {}
+
+            bool visit(Node_ptr node, Distance) {
+                ostr << "(" << node->ID << ")" << std::endl;
+                return true;
             }
-            print_(node_p->children[i], ostr);
-            pop();
-        }
+            bool prune(Node_ptr parent, Node_ptr child, Distance) {
+                ostr << depth;
+                if (child != parent->children.back()) {
+                    ostr << " ├──";
+                    depth += " |  ";
+                } else {
+                    ostr << " └──";
+                    depth += "    ";
+                }
+                return false;
+            }
+            void leave(Node_ptr node) {
+                if (node != start)
+                    depth.resize(depth.size() - 4);
+            }
+        } policy(ostr, node_p);
+        Context ctx;
+        walk(node_p, Distance(0), policy, ctx);
     }
 
 /*** traverse the tree from root and do something with every node ***/
@@ -1015,18 +3448,25 @@ namespace metric_space {
     template <class Archive>
     inline void Tree<recType, Metric>::serialize_aux(Node_ptr node,
                                                      Archive &archive) {
-        SerializedNode<recType, Metric> sn(node);
-        if (node->children.size() > 0) {
-            // sn.save(archive, 0);
-            archive << SERIALIZATION_NVP2("node", sn);
-            for (auto &c : node->children) {
-                serialize_aux(c, archive);
-            }
-            SerializedNode<recType, Metric> snn(nullptr);
-            archive << SERIALIZATION_NVP2("node", snn);
-        } else {
-            archive << SERIALIZATION_NVP2("node", sn);
-        }
+        // pre-order, every node with children is closed by a null node
+        struct Policy : WalkPolicy {
+            Archive &archive;
+            explicit Policy(Archive &archive) : archive(archive) {}
+
+            bool visit(Node_ptr node, Distance) {
+                SerializedNode<recType, Metric> sn(node);
+                archive << SERIALIZATION_NVP2("node", sn);
+                return true;
+            }
+            void leave(Node_ptr node) {
+                if (node->children.size() > 0) {
+                    SerializedNode<recType, Metric> snn(nullptr);
+                    archive << SERIALIZATION_NVP2("node", snn);
+                }
+            }
+        } policy(archive);
+        Context ctx;
+        walk(node, Distance(0), policy, ctx);
     }
 
     template <class recType, class Metric>
@@ -1077,6 +3517,40 @@ namespace metric_space {
         } catch (...) { /* hack to catch end of stream */
         }
         root = node.node;
+        if (cache_)
+            cache_->clear();
+        if (distance_cache_)
+            distance_cache_->clear();
+        if (rknn_)
+            rknn_->built = false;
+
+        // maxdist and subtree sizes come with the archive, the ID index is rebuilt without metric calls
+        index_.clear();
+        pivot_table_.clear();
+        next_id = 0;
+        N = 0;
+        if (root == nullptr)
+            return;
+        std::stack<Node_ptr> nodeStack;
+        nodeStack.push(root);
+        while (!nodeStack.empty()) {
+            Node_ptr curNode = nodeStack.top();
+            nodeStack.pop();
+            curNode->set_tree(this);
+            curNode->prepared = prepare_(curNode->data);
+            if (curNode->ID >= index_.size())
+                index_.resize(curNode->ID + 1, nullptr);
+            index_[curNode->ID] = curNode;
+            next_id = std::max(next_id, curNode->ID + 1);
+            N++;
+            for (const auto &child : *curNode)
+                nodeStack.push(child);
+        }
+        if (summary_)
+            summarize_();
+        pivot_table_.assign(index_.size() * pivots_.size(), Distance(0));
+        for (std::size_t i = 0; i < pivots_.size(); ++i)
+            pivot_column_(i, pivots_.size());
     }
     template <class recType, class Metric>
     inline bool Tree<recType, Metric>::same_tree(const Node_ptr lhs,
@@ -1084,50 +3558,98 @@ namespace metric_space {
         std::shared_lock<std::shared_timed_mutex> lk(global_mut);
         (void)lk;
 
-        if (lhs == rhs) {
-            return true;
-        }
-        if (lhs->ID != rhs->ID || lhs->level != rhs->level ||
-            lhs->parent_dist != rhs->parent_dist || lhs->data != rhs->data) {
-            return false;
-        }
-
-        if (lhs->children.size() != rhs->children.size())
-            return false;
-        for (std::size_t i = 0; i < lhs->children.size(); i++) {
-            if (!same_tree(lhs->children[i], rhs->children[i]))
+        // walk lhs and follow the same path in rhs on a parallel stack of (node, next child)
+        struct Policy : WalkPolicy {
+            std::vector<std::pair<Node_ptr, std::size_t>> rhs;
+            bool equal = true;
+
+            bool visit(Node_ptr l, Distance) {
+                Node_ptr r = rhs.back().first;
+                if (l == r)
+                    return false;
+                if (l->ID != r->ID || l->level != r->level ||
+                    l->parent_dist != r->parent_dist || l->data != r->data ||
+                    l->children.size() != r->children.size()) {
+                    equal = false;
+                    return false;
+                }
+                return true;
+            }
+            bool prune(Node_ptr, Node_ptr, Distance) {
+                auto &top = rhs.back();
+                Node_ptr r = top.first->children[top.second++];
+                rhs.emplace_back(r, 0);
                 return false;
-        }
-        return true;
+            }
+            void leave(Node_ptr) { rhs.pop_back(); }
+            bool done() const { return !equal; }
+        } policy;
+        policy.rhs.emplace_back(rhs, 0);
+        Context ctx;
+        walk(lhs, Distance(0), policy, ctx);
+        return policy.equal;
     }
 
     template <typename recType, class Metric>
     inline Node<recType, Metric> *Tree<recType, Metric>::insert_(Node_ptr p,
                                                                  Node_ptr x) {
-        auto children = sortChildrenByDistance(p, x);
-        auto child_idx = std::get<0>(children);
-        for (auto qi : child_idx) {
-            auto &q = p->children[qi];
-            if (q->dist(x) <= q->covdist()) {
-                auto q1 = insert_(q, x);
-                p->children[qi] = q1;
-                q1->parent = p;
-                q1->parent_dist = p->dist(q1);
-                // for(std::size_t i =0; i <  p->children.size(); i++) {
-                //   if(p->children[i] == q) {
-                //     p->children[i] = q1;
-                //     break;
-                //   }
-                //}
-                return p;
-            }
-        }
-        p->children.push_back(x);
-        x->parent = p;
-        x->parent_dist = p->dist(x);
-        x->level = p->level - 1;
+        // descend into the nearest child that covers x, attach x below the last node on that path
+        struct Policy : WalkPolicy {
+            const TreeType &tree;
+            Node_ptr x;
+            Node_ptr parent = nullptr;
+            Distance parent_dist = 0;
+            bool chosen = false;
+            bool attached = false;
+            Policy(const TreeType &tree, Node_ptr x) : tree(tree), x(x) {}
+
+            bool visit(Node_ptr node, Distance dist) {
+                // every node on the path gets x (and the subtree x may carry) as descendant
+                node->maxdist = std::max(node->maxdist, dist + x->maxdist);
+                node->summary.merge(x->summary);
+                node->subtree_size += x->subtree_size;
+                parent = node;
+                parent_dist = dist;
+                chosen = false;
+                return true;
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const {
+                // a child beyond its covering distance is never chosen, its distance is not needed exactly
+                auto begin = children.size();
+                auto bounds = tree.lower_bounds_();
+                LowerBoundCounts counts{};
+                for (std::size_t i = 0; i < node->children.size(); ++i) {
+                    Node_ptr child = node->children[i];
+                    Distance lower = 0;
+                    if (Traits::lower_bound_count > 0 &&
+                        tree.lower_bounded_(bounds, tree.argument_(*child), tree.argument_(*x), child->covdist(), counts, lower))
+                        children.emplace_back(lower, int(i));
+                    else
+                        children.emplace_back(child->dist(x, child->covdist()), int(i));
+                }
+                tree.count_lower_bounds_(counts);
+                std::sort(children.begin() + begin, children.end());
+            }
+            bool prune(Node_ptr, Node_ptr q, Distance d) {
+                if (chosen || d > q->covdist())
+                    return true;
+                chosen = true;
+                return false;
+            }
+            void leave(Node_ptr node) {
+                if (attached || node != parent)
+                    return;
+                node->children.push_back(x);
+                x->parent = node;
+                x->parent_dist = parent_dist;
+                x->level = node->level - 1;
+                attached = true;
+            }
+            bool done() const { return attached; }
+        } policy(*this, x);
+        Context ctx;
+        walk(p, p->dist(x), policy, ctx);
         return p;
-        //  return rebalance(p,x);
     }
 
     template <typename recType, class Metric>
@@ -1276,46 +3798,71 @@ namespace metric_space {
         std::unordered_set<std::size_t> &parsed_points,
         const std::vector<std::size_t> &distribution_sizes, std::size_t &cur_idx,
         std::vector<std::vector<std::size_t>> &result) {
-        auto childs = this->sortChildrenByDistance(proot, center);
-        auto idx = std::get<0>(childs);
-        auto dists = std::get<1>(childs);
-        bool is_root_added = false;
-        if (dists.empty() || dists[0] > proot->dist(center)) {
-            if (parsed_points.find(proot->ID) == parsed_points.end()) {
-                result[cur_idx].push_back(proot->ID);
-                parsed_points.insert(proot->ID);
-                is_root_added = true;
-                if (update_idx(cur_idx, distribution_sizes, result))
-                    return true;
+        // children are visited nearest first, a node joins the result as soon as
+        // the child distance at the same position (by child index) exceeds its own distance
+        struct Frame {
+            Distance dist;     // distance of the node to center
+            std::size_t begin; // its segment in the ordered children
+            std::size_t index; // position of the next child
+        };
+        struct Policy : WalkPolicy {
+            TreeType &tree;
+            const recType &center;
+            std::unordered_set<std::size_t> &parsed_points;
+            const std::vector<std::size_t> &distribution_sizes;
+            std::size_t &cur_idx;
+            std::vector<std::vector<std::size_t>> &result;
+            std::vector<Frame> frames;
+            std::vector<std::pair<Distance, int>> *children = nullptr;
+            bool finished = false;
+            Policy(TreeType &tree, const recType &center, std::unordered_set<std::size_t> &parsed_points,
+                   const std::vector<std::size_t> &distribution_sizes, std::size_t &cur_idx,
+                   std::vector<std::vector<std::size_t>> &result)
+                : tree(tree), center(center), parsed_points(parsed_points),
+                  distribution_sizes(distribution_sizes), cur_idx(cur_idx), result(result) {}
+
+            void add(Node_ptr node) {
+                if (parsed_points.find(node->ID) == parsed_points.end()) {
+                    result[cur_idx].push_back(node->ID);
+                    parsed_points.insert(node->ID);
+                    finished = tree.update_idx(cur_idx, distribution_sizes, result);
+                }
             }
-        }
-        std::size_t index = 0;
-        for (auto i : idx) {
-            if (!is_root_added && dists[index] > proot->dist(center)) {
-                if (parsed_points.find(proot->ID) == parsed_points.end()) {
-                    result[cur_idx].push_back(proot->ID);
-                    parsed_points.insert(proot->ID);
-                    is_root_added = true;
-                    if (update_idx(cur_idx, distribution_sizes, result))
+            Distance child_dist(Node_ptr node, std::size_t i) const {
+                auto &frame = frames.back();
+                for (auto k = frame.begin; k < frame.begin + node->children.size(); ++k)
+                    if ((*children)[k].second == static_cast<int>(i))
+                        return (*children)[k].first;
+                return Distance(0);
+            }
+            bool visit(Node_ptr, Distance dist) {
+                frames.push_back({dist, 0, 0});
+                return true;
+            }
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &ordered) {
+                children = &ordered;
+                frames.back().begin = tree.sortChildrenByDistance(node, center, ordered);
+                if (node->children.empty() || child_dist(node, 0) > frames.back().dist)
+                    add(node);
+            }
+            bool prune(Node_ptr parent, Node_ptr child, Distance) {
+                auto index = frames.back().index++;
+                if (child_dist(parent, index) > frames.back().dist) {
+                    add(parent);
+                    if (finished)
                         return true;
                 }
+                return parsed_points.find(child->ID) != parsed_points.end();
             }
-
-            if (parsed_points.find(proot->children[i]->ID) == parsed_points.end())
-                if (grab_sub_tree(proot->children[i], center, parsed_points,
-                                  distribution_sizes, cur_idx, result))
-                    return true;
-            index++;
-        }
-        if (!is_root_added) {
-            if (parsed_points.find(proot->ID) == parsed_points.end()) {
-                result[cur_idx].push_back(proot->ID);
-                parsed_points.insert(proot->ID);
-                if (update_idx(cur_idx, distribution_sizes, result))
-                    return true;
+            void leave(Node_ptr node) {
+                add(node);
+                frames.pop_back();
             }
-        }
-        return false;
+            bool done() const { return finished; }
+        } policy(*this, center, parsed_points, distribution_sizes, cur_idx, result);
+        Context ctx;
+        walk(proot, proot->dist(center), policy, ctx);
+        return policy.finished;
     }
 
     template <typename recType, typename Metric>
@@ -9,19 +9,30 @@ Signal Empowering Technology ®Michael Welsch
 #ifndef _METRIC_SPACE_TREE_HPP
 #define _METRIC_SPACE_TREE_HPP
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bitset>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <stack>
 #include <map>
 #include <vector>
 #include <shared_mutex>
+#include <mutex>
 #include <numeric>
 #include <cmath>
 #include <string>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <tuple>
 #include <unordered_set>
+#include "thread_pool.hpp"
+#include "result_cache.hpp"
+#include "distance_cache.hpp"
+#include "metric_traits.hpp"
 namespace metric_space
 {
 /*
@@ -40,9 +51,191 @@ namespace metric_space
     template<typename, typename>
     class Node;
 
+    template<typename, typename>
+    class Tree;
+
     struct unsorted_distribution_exception : public std::exception {};
     struct bad_distribution_exception : public std::exception {};
 
+/*** order in which nn, knn and rnn expand the tree ***/
+    enum class SearchOrder {
+        depth_first,      // children of a node in ascending distance, recursively
+        best_first,       // globally closest lower bound first, from a frontier heap (nn and knn)
+        level_synchronous // cover set by cover set, all children of a level evaluated in one batch
+    };
+
+/*** per call search options, the defaults give an exact search ***/
+    struct QueryOptions {
+        double epsilon = 0;                           // prune with (1 + epsilon) * lower bound, results within that factor
+        std::size_t max_evaluations = 0;              // metric evaluations, 0 = unlimited
+        std::size_t max_visited = 0;                  // visited nodes, 0 = unlimited
+        std::chrono::nanoseconds max_time{0};         // wall clock time, 0 = unlimited
+        SearchOrder order = SearchOrder::depth_first; // rnn falls back to depth first for best_first
+        std::size_t group_size = 0;                   // nn_batch/knn_batch only: queries walking the tree together, 0 or 1 = one by one
+        bool parallel = false;                        // depth first nn, knn and rnn without budget: split into subtree tasks on ThreadPool::global()
+        std::size_t parallel_children = 0;            // evaluate the children of a node on ThreadPool::global() from this many on, 0 = never (expensive metrics)
+
+        bool budgeted() const { return max_evaluations > 0 || max_visited > 0 || max_time.count() > 0; }
+    };
+
+/***
+  aggregate of user attributes over a subtree: the categories present (e.g. tenants) and the
+  range of one numeric attribute (e.g. a timestamp). Filled per record by the function given to
+  Tree::set_summary and merged up the tree on insert.
+*/
+    struct AttributeSummary {
+        std::bitset<64> categories;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+
+        AttributeSummary() = default;
+        AttributeSummary(std::size_t category, double value) : min(value), max(value) { categories.set(category); } // of one record
+
+        void merge(const AttributeSummary &other) {
+            categories |= other.categories;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+        }
+    };
+
+/*** what a filtered query needs: any of the categories (all set = no restriction) and a value in [min, max] ***/
+    struct AttributeFilter {
+        std::bitset<64> categories = std::bitset<64>().set();
+        double min = -std::numeric_limits<double>::infinity();
+        double max = std::numeric_limits<double>::infinity();
+
+        bool admits(const AttributeSummary &summary) const { // false: no record with this summary can pass
+            return (categories.all() || (categories & summary.categories).any()) &&
+                   summary.max >= min && summary.min <= max;
+        }
+    };
+
+/*** caller owned scratch buffers and result storage, reusable across queries ***/
+    template <class recType, class Metric>
+    struct QueryContext
+    {
+        using Node_ptr = Node<recType, Metric> *;
+        using Distance = typename std::result_of<Metric(recType, recType)>::type;
+
+        struct Frame {
+            Node_ptr node;    // node whose children are walked
+            std::size_t begin; // first entry of its segment in children
+            std::size_t next;  // next entry to descend into
+        };
+
+        struct Candidate {
+            Distance bound;   // lower bound of the distance to anything in the subtree
+            Distance dist;    // distance to the node itself
+            Node_ptr node;
+        };
+
+        std::vector<std::pair<Distance, int>> children;    // ordered distances to children, one segment per frame
+        std::vector<Frame> frames;                         // explicit stack of the traversal engine
+        std::vector<Candidate> frontier;                   // min-heap of subtrees still to expand (best first), cover set (level synchronous)
+        std::vector<Candidate> cover;                      // next cover set (level synchronous)
+        std::vector<Node_ptr> level;                       // children of the cover set, evaluated in one batch
+        std::vector<Distance> level_dists;
+        std::vector<std::pair<Node_ptr, Distance>> result; // neighbours found by the last query
+        std::vector<Distance> pivots;                      // distances of the query to the tree's pivots
+        std::vector<Distance> closest;                     // max-heap of the k closest children of a node so far
+        std::atomic<Distance> *shared_bound = nullptr;     // pruning bound shared by the tasks of a parallel query
+
+        /*** report of the last query ***/
+        bool exact = true;           // false if epsilon or a budget cut the search, result is the best so far
+        std::size_t evaluations = 0; // metric evaluations spent
+        std::size_t visited = 0;     // nodes visited
+
+        void reserve(std::size_t children_size, std::size_t result_size, std::size_t depth = 64) {
+            children.reserve(children_size);
+            frames.reserve(depth);
+            frontier.reserve(children_size);
+            result.reserve(result_size);
+        }
+    };
+
+/*** flat results of a batch query, the neighbours of query i are [offsets[i], offsets[i + 1]) ***/
+    template <class Distance>
+    struct BatchResult
+    {
+        std::vector<std::size_t> offsets; // queries + 1 entries
+        std::vector<unsigned> ids;        // node IDs
+        std::vector<Distance> distances;  // distances to the query, same order as ids
+
+        std::size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; } // number of queries
+    };
+
+/***
+  lazy neighbours of a query in ascending distance, see Tree::neighbours
+
+  a min-heap keyed by lower bound holds records (keyed by their distance) and unexpanded subtrees
+  (keyed by distance - maxdist). Each ++ pops until a record surfaces, so only the subtrees that
+  can hold something closer than the next record get expanded. The range holds a read lock on the
+  tree until it is destroyed, don't modify the tree from the same thread while it lives. Iterators
+  refer to the range, it must not be moved once begin() was called.
+*/
+    template <class recType, class Metric>
+    class NeighbourRange
+    {
+    public:
+        using Node_ptr = Node<recType, Metric> *;
+        using Distance = typename std::result_of<Metric(recType, recType)>::type;
+        using value_type = std::pair<Node_ptr, Distance>;
+
+        class iterator
+        {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = NeighbourRange::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const value_type *;
+            using reference = const value_type &;
+
+            iterator(NeighbourRange *range = nullptr) : range(range) {}
+            reference operator*() const { return range->current; }
+            pointer operator->() const { return &range->current; }
+            iterator &operator++() {
+                range->advance();
+                return *this;
+            }
+            bool operator==(const iterator &other) const { return at_end() == other.at_end(); }
+            bool operator!=(const iterator &other) const { return !(*this == other); }
+
+        private:
+            bool at_end() const { return range == nullptr || range->finished; }
+            NeighbourRange *range;
+        };
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+        std::size_t evaluations() const { return evaluations_; } // metric evaluations spent so far
+
+    private:
+        friend class Tree<recType, Metric>;
+        struct Entry {
+            Distance key;  // distance of a record, lower bound of a subtree
+            Distance dist; // distance to the node
+            Node_ptr node;
+            bool record;   // record or subtree below node
+        };
+        // heap order: the smallest key on top, records before subtrees of the same key
+        static bool later(const Entry &a, const Entry &b) {
+            return a.key > b.key || (a.key == b.key && !a.record && b.record);
+        }
+
+        NeighbourRange(const Tree<recType, Metric> &tree, const recType &query);
+        void push(Node_ptr node, Distance dist);
+        void advance();
+
+        recType query;
+        std::shared_lock<std::shared_timed_mutex> lock;
+        const Tree<recType, Metric> *tree;
+        typename Tree<recType, Metric>::Prepared prepared; // of query, once for the whole walk
+        std::vector<Entry> heap;
+        value_type current;
+        bool finished = false;
+        std::size_t evaluations_ = 0;
+    };
+
 /*
   __ __|              
      |   _ | -_)   -_) 
@@ -56,6 +249,7 @@ namespace metric_space
     private:
         //  class Node; // Node Class (see implementation for details)
         friend class Node<recType, Metric>;
+        friend class NeighbourRange<recType, Metric>;
 
         /*** Types ***/
         Metric metric_;
@@ -66,6 +260,9 @@ namespace metric_space
         using rset_t = std::tuple<Node_ptr, std::vector<Node_ptr>, std::vector<Node_ptr>>;
         //  typedef typename std::result_of<Metric(recType, recType)>::type Distance;
         using Distance = typename std::result_of<Metric(recType,recType)>::type;
+        using Context = QueryContext<recType, Metric>;
+        using Traits = metric_traits<Metric, recType>;
+        using Prepared = typename Traits::prepared_type; // no_prepared_form for metrics without prepare
 
         /*** Properties ***/
         Distance base = 2;                  // Base for estemating the covering of the tree
@@ -74,12 +271,74 @@ namespace metric_space
         std::atomic<int> max_scale;         // Minimum scale
         int truncate_level = -1;                 // Relative level below which the tree is truncated
         std::atomic<unsigned> N;            // Number of points in the cover tree
+        unsigned next_id = 0;               // ID of the next record, IDs are never reused
+        std::vector<Node_ptr> index_;       // node of every ID, nullptr once erased
         mutable std::shared_timed_mutex global_mut; // lock for changing the root
+        std::function<AttributeSummary(Node_ptr)> summary_; // attributes of one record, empty = no summaries
+        using Cache = ResultCache<recType, std::vector<std::pair<Node_ptr, Distance>>, Distance>;
+        std::unique_ptr<Cache> cache_;                      // results of repeated queries, empty = no cache
+        std::unique_ptr<DistanceCache<Distance>> distance_cache_; // distances between two nodes, empty = no memo
+        mutable std::array<std::atomic<std::size_t>, Traits::lower_bound_count + 1> lower_bound_counts_{}; // see lower_bound_stats
+
+        /*** per ID k nearest neighbour radius for rknn, kept as upper bounds over inserts and refreshed lazily ***/
+        struct RknnCache {
+            unsigned k = 0;
+            bool built = false;
+            std::vector<Distance> radius;         // distance of a record to its k-th nearest other record, at least
+            std::vector<Distance> subtree;        // max radius over the subtree of a node
+            std::vector<std::uint64_t> exact_at;  // radius is exact while inserts equals this
+            std::uint64_t inserts = 0;
+            std::vector<unsigned> pending;        // inserted since the last refresh, radius not known yet
+            std::vector<recType> erased;          // erased since the last refresh
+            Node_ptr root = nullptr;              // root the subtree maxima were computed under
+        };
+        mutable std::unique_ptr<RknnCache> rknn_; // empty until the first rknn query
+        mutable std::mutex rknn_mut;              // rknn queries update the cache, one at a time
+
+        std::vector<recType> pivots_;             // reference records of the pivot filter, empty = off
+        std::vector<Prepared> pivot_forms_;       // their prepared forms, see metric_traits.hpp
+        std::vector<Distance> pivot_table_;       // distance of every ID to every pivot, pivots_.size() per ID
 
         /*** Imlementation Methodes ***/
+
+        /*** default hooks of the traversal engine, policies hide the ones they need ***/
+        struct WalkPolicy {
+            bool visit(Node_ptr, Distance) { return true; }         // entering a node, false skips its children
+            void order(Node_ptr node, std::vector<std::pair<Distance, int>> &children) const; // append children in visiting order
+            bool prune(Node_ptr, Node_ptr, Distance) { return false; } // (parent, child, child distance), true skips the child
+            void leave(Node_ptr) {}                                  // all children of a visited node are done
+            bool done() const { return false; }                      // abort the whole traversal
+        };
+        template <class Policy>
+        void walk(Node_ptr start, Distance dist_start, Policy &policy, Context &ctx) const;
+
+        /*** search policies charge every visited node against the QueryOptions budget ***/
+        struct BudgetPolicy : WalkPolicy {
+            const QueryOptions &options;
+            Context &ctx;
+            std::chrono::steady_clock::time_point deadline;
+            bool exhausted = false;
+            std::atomic<Distance> *shared;                 // ctx.shared_bound
+            BudgetPolicy(const QueryOptions &options, Context &ctx);
+            bool charge(Node_ptr node);                    // false once the budget is spent
+            Distance relaxed(Distance lower_bound) const;  // lower bound scaled by (1 + epsilon)
+            Distance radius(Distance bound) const;         // lower bounds from here on are pruned, bound / (1 + epsilon)
+            Distance bound(Distance local) const;          // the tighter of local and the shared bound
+            void publish(Distance local);                  // lower the shared bound to local
+            bool done() const { return exhausted; }
+        };
+
         template <typename pointOrNodeType>
         std::tuple<std::vector<int>, std::vector<Distance>>
         sortChildrenByDistance(Node_ptr p, pointOrNodeType x) const;
+        template <typename pointOrNodeType>
+        std::size_t sortChildrenByDistance(Node_ptr p, const pointOrNodeType &x, std::vector<std::pair<Distance, int>> &sorted,
+                                           std::size_t parallel = 0) const; // parallel: evaluate on the pool from this many children on
+        void sortPivotedChildren_(Node_ptr p, const recType &x, std::vector<std::pair<Distance, int>> &sorted, std::size_t parallel,
+                                  const Distance *pivots, Context &ctx, Distance radius,
+                                  std::size_t k) const; // drops children whose subtree is at least radius away from x, k of knn or 0
+        const Distance *query_pivots_(const recType &p, Context &ctx) const; // nullptr without pivots
+        void pivot_column_(std::size_t i, std::size_t stride); // distances of every record to pivot i into the table
 
         bool grab_sub_tree(Node_ptr proot, const recType & center, std::unordered_set<std::size_t> & parsed_points,
                                                           const std::vector<std::size_t> &distribution_sizes,
@@ -101,10 +360,77 @@ namespace metric_space
 
         //  template <typename pointOrNodeType>
         Node_ptr insert_(Node_ptr p, Node_ptr x);
-
-        void nn_(Node_ptr current, Distance dist_current, const recType &p, std::pair<Node_ptr, Distance> &nn) const;
-        std::size_t knn_(Node_ptr current, Distance dist_current, const recType &p, std::vector<std::pair<Node_ptr, Distance>> &nnList, std::size_t nnSize) const;
-        void rnn_(Node_ptr current, Distance dist_current, const recType &p, Distance distance, std::vector<std::pair<Node_ptr, Distance>> &nnList) const;
+        Node_ptr make_node_(const recType &x); // new unattached node with the next ID, registered in the index
+        bool within_(const recType &p, Distance r, Distance dist_root, std::vector<std::pair<Node_ptr, Distance>> *path,
+                     Context &ctx) const; // with path, also record the insert descent of p
+        void attach_(const std::vector<std::pair<Node_ptr, Distance>> &path, Node_ptr x);
+
+        // pivots: distances of p to the pivots (query_pivots_), children are then filtered before they are evaluated
+        void nn_(Node_ptr current, Distance dist_current, const recType &p, std::pair<Node_ptr, Distance> &nn, Context &ctx, const QueryOptions &options,
+                 const Distance *pivots = nullptr) const;
+        std::size_t knn_(Node_ptr current, Distance dist_current, const recType &p, std::vector<std::pair<Node_ptr, Distance>> &nnList, std::size_t nnSize, Context &ctx, const QueryOptions &options,
+                         const Distance *pivots = nullptr) const;
+        void knn_best_first_(const recType &p, std::size_t k, Context &ctx, const QueryOptions &options) const;
+        void level_search_(const recType &p, std::size_t k, Distance radius, Context &ctx, const QueryOptions &options) const; // k == 0: range search
+        void parallel_search_(const recType &p, std::size_t k, Distance radius, Context &ctx, const QueryOptions &options) const; // k == 0: range search
+        void finger_(const recType &p, std::size_t k, Node_ptr hint, Context &ctx) const; // knn starting at hint
+        template <class Sink>
+        void rnn_(Node_ptr current, Distance dist_current, const recType &p, Distance distance, Sink &sink, Context &ctx, const QueryOptions &options,
+                  const Distance *pivots = nullptr) const; // sink(node, dist) per hit
+        template <class Predicate>
+        void filtered_search_(const recType &p, std::size_t k, Distance radius, Predicate &pred, const AttributeFilter &filter,
+                              Context &ctx, const QueryOptions &options) const; // k == 0: range search
+        void summarize_(); // recompute the attribute summaries of all nodes
+
+        /*** query bodies, the caller holds the read lock. The _impl ones go through the result cache ***/
+        Node_ptr nn_impl(const recType &p, Context &ctx, const QueryOptions &options) const;
+        void knn_impl(const recType &p, unsigned k, Context &ctx, const QueryOptions &options) const;
+        void rnn_impl(const recType &p, Distance distance, Context &ctx, const QueryOptions &options) const;
+        Node_ptr nn_search_(const recType &p, Context &ctx, const QueryOptions &options) const; // leaves {nearest, distance} in ctx.result
+        void knn_search_(const recType &p, unsigned k, Context &ctx, const QueryOptions &options) const;
+        void rnn_search_(const recType &p, Distance distance, Context &ctx, const QueryOptions &options) const;
+        bool cached_(const recType &p, std::size_t k, Distance distance, Context &ctx, const QueryOptions &options) const;
+        void remember_(const recType &p, std::size_t k, Distance distance, const Context &ctx, const QueryOptions &options) const;
+        template <class Query>
+        void batch_(const std::vector<recType> &queries, std::size_t stride, BatchResult<Distance> &out, Query query) const;
+        static void pack_(BatchResult<Distance> &out, const std::vector<std::size_t> &counts, std::size_t stride);
+        void knn_join_(const Tree &other, unsigned k, BatchResult<Distance> &out) const; // the caller holds both read locks
+
+        /*** rknn internals, the caller holds the read lock and rknn_mut ***/
+        void rknn_refresh_(unsigned k) const; // build for k, or bring in the inserts and erases since the last query
+        void rknn_maxima_() const;            // recompute all subtree maxima
+        Distance rknn_radius_(Node_ptr node, Context &ctx) const;
+        template <class Callback>
+        void rknn_walk_(const recType &q, Context &ctx, Callback callback) const; // callback(node, dist) for dist <= radius
+        void kfn_(const recType &q, unsigned k, Context &ctx,
+                  const Prepared *prepared = nullptr) const; // the caller holds the read lock; prepared: form of q, e.g. of its node
+
+        /*** scratch of a query group walking the tree together ***/
+        struct GroupContext {
+            struct Frame {
+                Node_ptr node;
+                std::size_t begin, end; // its active queries in active
+            };
+            std::vector<std::pair<Node_ptr, Distance>> results; // k slots per query, a max-heap each
+            std::vector<std::size_t> sizes;                     // filled slots per query
+            std::vector<std::pair<std::size_t, Distance>> active; // (query, distance to the frame node), one segment per frame
+            std::vector<Frame> frames;
+            std::vector<std::size_t> queries; // active queries of the node being expanded
+            std::vector<Distance> dists;      // children x active queries
+            std::vector<std::pair<Distance, int>> order;
+            std::vector<recType> records;   // queries of a join group
+            std::vector<Prepared> forms;    // prepared forms of a batch group
+            std::vector<const Prepared *> prepared; // of each query, forms or the nodes of a join
+            std::vector<Distance> to_center; // their distances to the first one
+            std::vector<std::tuple<std::size_t, Node_ptr, Distance>> found; // (query, node, distance) of a range walk
+        };
+        // prepared: form of each query, nullptr if the metric has none
+        void knn_group_(const recType *queries, const Prepared *const *prepared, std::size_t count, unsigned k, GroupContext &g,
+                        const QueryOptions &options,
+                        const Distance *to_center = nullptr) const; // to_center: queries are close to queries[0], prune through it
+        void rnn_group_(const recType *queries, const Prepared *const *prepared, std::size_t count, Distance distance, GroupContext &g,
+                        const Distance *to_center = nullptr) const; // appends to g.found, in no particular order
+        void knn_batch_grouped_(const std::vector<recType> &queries, unsigned k, BatchResult<Distance> &out, const QueryOptions &options) const;
 
         void print_(NodeType *node_p, std::ostream & ostr) const;
 
@@ -129,6 +455,82 @@ namespace metric_space
 
         Distance metric(const recType & p1, const recType & p2) const { return metric_(p1,p2);}
 
+        /*** the query of the running call prepared once on this thread, found again by address in Node::dist ***/
+        struct PreparedQuery {
+            const TreeType *tree;
+            const recType *record;
+            Prepared own;
+            const Prepared *prepared; // own, or the form of a scope on another thread
+            PreparedQuery *outer;     // scope of an enclosing call, a join or an rknn query may nest them
+
+            PreparedQuery(const TreeType &tree, const recType &record);
+            PreparedQuery(const TreeType &tree, const recType &record, const Prepared *prepared); // borrows prepared, e.g. on a worker
+            PreparedQuery(const PreparedQuery &) = delete;
+            PreparedQuery &operator=(const PreparedQuery &) = delete;
+            ~PreparedQuery();
+            static PreparedQuery *&top();
+        };
+        Prepared prepare_(const recType &r) const { return prepare_(r, std::integral_constant<bool, Traits::has_prepare>()); }
+        Prepared prepare_(const recType &r, std::true_type) const { return metric_.prepare(r); }
+        Prepared prepare_(const recType &, std::false_type) const { return Prepared(); }
+        Distance metric(const NodeType &a, const NodeType &b) const; // on the prepared forms if there are
+        Distance metric(const NodeType &a, const recType &q) const;
+        Distance metric(const NodeType &a, const NodeType &b, Distance bound) const; // exact up to bound, see metric_traits.hpp
+        Distance metric(const NodeType &a, const recType &q, Distance bound) const;
+        const Prepared *scoped_(const recType &q) const; // prepared form of q if a scope on this thread holds it
+        Distance prepared_metric_(const NodeType &a, const recType &q, const Prepared *prepared) const {
+            return prepared_metric_(a, q, prepared, std::integral_constant<bool, Traits::has_prepare>());
+        }
+        template <class... Bound>
+        Distance prepared_metric_(const NodeType &a, const recType &q, const Prepared *prepared, std::true_type, Bound... bound) const;
+        template <class... Bound>
+        Distance prepared_metric_(const NodeType &a, const recType &q, const Prepared *prepared, std::false_type, Bound... bound) const;
+        template <class Arg>
+        Distance call_(const Arg &a, const Arg &b) const { return metric_(a, b); }
+        template <class Arg>
+        Distance call_(const Arg &a, const Arg &b, Distance bound) const {
+            return call_(a, b, bound, std::integral_constant<bool, Traits::has_bounded>());
+        }
+        template <class Arg>
+        Distance call_(const Arg &a, const Arg &b, Distance bound, std::true_type) const { return metric_(a, b, bound); }
+        template <class Arg>
+        Distance call_(const Arg &a, const Arg &b, Distance, std::false_type) const { return metric_(a, b); }
+        static Distance bound_(Distance radius, Distance maxdist); // radius + maxdist without overflow
+
+        /*** the lower bound cascade of the metric, see metric_traits.hpp ***/
+        using Argument = typename Traits::argument_type;
+        using LowerBounds = typename Traits::lower_bounds_type;
+        using LowerBoundCounts = std::array<std::size_t, Traits::lower_bound_count + 1>; // per bound, then the full evaluations
+        const Argument &argument_(const NodeType &a) const { return argument_(a, std::integral_constant<bool, Traits::has_prepare>()); }
+        const Argument &argument_(const NodeType &a, std::true_type) const { return a.prepared; }
+        const Argument &argument_(const NodeType &a, std::false_type) const { return a.data; }
+        const Argument &query_argument_(const recType &q, Prepared &scratch) const {
+            return query_argument_(q, scratch, std::integral_constant<bool, Traits::has_prepare>());
+        }
+        const Argument &query_argument_(const recType &q, Prepared &scratch, std::true_type) const; // scratch if q has no scope here
+        const Argument &query_argument_(const recType &q, Prepared &, std::false_type) const { return q; }
+        const Argument &pivot_argument_(std::size_t i) const {
+            return pivot_argument_(i, std::integral_constant<bool, Traits::has_prepare>());
+        }
+        const Argument &pivot_argument_(std::size_t i, std::true_type) const { return pivot_forms_[i]; }
+        const Argument &pivot_argument_(std::size_t i, std::false_type) const { return pivots_[i]; }
+        LowerBounds lower_bounds_() const { return lower_bounds_(std::integral_constant<bool, (Traits::lower_bound_count > 0)>()); }
+        LowerBounds lower_bounds_(std::true_type) const { return metric_.lower_bounds(); }
+        LowerBounds lower_bounds_(std::false_type) const { return LowerBounds(); }
+        bool lower_bounded_(const LowerBounds &bounds, const Argument &a, const Argument &b, Distance bound, LowerBoundCounts &counts,
+                            Distance &lower) const { // true: some bound is above bound, lower is that one
+            return lower_bounded_(bounds, a, b, bound, counts, lower, std::integral_constant<std::size_t, 0>());
+        }
+        template <std::size_t I>
+        bool lower_bounded_(const LowerBounds &bounds, const Argument &a, const Argument &b, Distance bound, LowerBoundCounts &counts,
+                            Distance &lower, std::integral_constant<std::size_t, I>) const;
+        bool lower_bounded_(const LowerBounds &, const Argument &, const Argument &, Distance, LowerBoundCounts &counts, Distance &,
+                            std::integral_constant<std::size_t, Traits::lower_bound_count>) const {
+            counts.back()++;
+            return false;
+        }
+        void count_lower_bounds_(const LowerBoundCounts &counts) const; // adds to lower_bound_counts_
+
     public:
         /***
           cluster tree nodes according to distribution
@@ -189,17 +591,174 @@ namespace metric_space
 
         bool insert(const recType &p);              // insert data record into the cover tree
         Node_ptr insert(Node_ptr p, Node_ptr x);
-        bool insert_if(const recType &p, Distance treshold);              // insert data record into the cover tree only if distance bigger than a treshold
-        std::size_t insert_if(const std::vector<recType> &p, Distance treshold); // insert data record into the cover tree
+        bool insert_if(const recType &p, Distance treshold);              // insert data record into the cover tree only if no record is within treshold
+        std::size_t insert_if(const std::vector<recType> &p, Distance treshold); // insert data records into the cover tree, skipping near duplicates
         bool insert(const std::vector<recType> &p); // insert data record into the cover tree
         bool erase(const recType &p);               // erase data record into the cover tree
         recType operator[](size_t id);              // access a data record by ID
 
         /*** Nearest Neighbour search ***/
+        bool exists_within(const recType &p, Distance r) const;                                                // true as soon as any record within r is found
         Node_ptr nn(const recType &p) const;                                                                   // nearest Neighbour
-        std::vector<std::pair<Node_ptr, Distance>> knn(const recType &p, unsigned k = 10) const;               // k-Nearest Neighbours
+        std::vector<std::pair<Node_ptr, Distance>> knn(const recType &p, unsigned k = 10,
+                                                       SearchOrder order = SearchOrder::depth_first) const; // k-Nearest Neighbours
         std::vector<std::pair<Node_ptr, Distance>> rnn(const recType &queryPt, Distance distance = 1.0) const; // Range Search
 
+        /*** Nearest Neighbour search with caller owned buffers, no heap allocation once ctx is warmed up ***/
+        Node_ptr nn(const recType &p, Context &ctx) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &knn(const recType &p, unsigned k, Context &ctx,
+                                                              SearchOrder order = SearchOrder::depth_first) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &rnn(const recType &queryPt, Distance distance, Context &ctx) const;
+
+        /*** approximate or budgeted search, ctx.exact tells whether the result is exact or the best so far ***/
+        Node_ptr nn(const recType &p, Context &ctx, const QueryOptions &options) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &knn(const recType &p, unsigned k, Context &ctx, const QueryOptions &options) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &rnn(const recType &queryPt, Distance distance, Context &ctx, const QueryOptions &options) const;
+
+        /*** range search streamed into callback(node, dist), nothing is materialized ***/
+        template <class Callback>
+        void rnn(const recType &queryPt, Distance distance, Callback callback) const;
+        /*** number of records within distance, subtrees entirely in range are added by their size without evaluating them ***/
+        std::size_t rnn_count(const recType &queryPt, Distance distance) const;
+        std::size_t rnn_count(const recType &queryPt, Distance distance, Context &ctx) const; // ctx reports the evaluations
+
+        /***
+          finger search: start at hint (e.g. the previous result of a temporally coherent stream) and
+          climb towards the root, evaluating an ancestor or one of its other subtrees only if its bound
+          through the stored parent distances can still beat the k-th distance. Exact; hint must be a
+          node of this tree, nullptr starts at the root.
+          Subtrees of a cover tree overlap, so the climb usually reaches the root and bounds the
+          siblings on every level: the saving over a root search is large only while the queries stay
+          among the stored records around hint, and small (10-20%) once the stream runs ahead of them.
+          A hinted insert is placed below the first covering ancestor of hint instead of the best one
+          and evaluates the ancestors above it whose maxdist may grow; it spends less than half the
+          distances of a root insert and later queries on such a tree cost a few percent more.
+        */
+        Node_ptr nn(const recType &p, Node_ptr hint) const;
+        std::vector<std::pair<Node_ptr, Distance>> knn(const recType &p, unsigned k, Node_ptr hint) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &knn(const recType &p, unsigned k, Node_ptr hint, Context &ctx) const;
+        std::vector<std::pair<Node_ptr, Distance>> knn_by_id(unsigned id, unsigned k) const; // neighbours of a stored record, itself included
+        Node_ptr insert(const recType &p, Node_ptr hint); // insert below the first ancestor of hint that covers p, returns the new node
+        Node_ptr get_node(unsigned id) const;             // node of a record, nullptr if the ID is unknown or erased
+
+
+        /***
+          filtered search: only records with pred(node) == true are returned. With summaries enabled
+          (set_summary) every subtree whose summary the filter does not admit is skipped without
+          evaluating a single distance, pred must then imply filter.admits of the record's own summary.
+        */
+        template <class Predicate>
+        std::vector<std::pair<Node_ptr, Distance>> knn_if(const recType &p, unsigned k, Predicate pred,
+                                                          const AttributeFilter &filter = AttributeFilter()) const;
+        template <class Predicate>
+        std::vector<std::pair<Node_ptr, Distance>> rnn_if(const recType &p, Distance distance, Predicate pred,
+                                                          const AttributeFilter &filter = AttributeFilter()) const;
+        template <class Predicate>
+        const std::vector<std::pair<Node_ptr, Distance>> &knn_if(const recType &p, unsigned k, Predicate pred, const AttributeFilter &filter,
+                                                                 Context &ctx, const QueryOptions &options = QueryOptions()) const;
+        template <class Predicate>
+        const std::vector<std::pair<Node_ptr, Distance>> &rnn_if(const recType &p, Distance distance, Predicate pred, const AttributeFilter &filter,
+                                                                 Context &ctx, const QueryOptions &options = QueryOptions()) const;
+        /*** keep per subtree attribute summaries, f gives the attributes of one record. Recomputes all nodes ***/
+        void set_summary(std::function<AttributeSummary(Node_ptr)> f);
+
+        /***
+          cache exact nn, knn and rnn results (including batches, a grouped one groups its misses only)
+          keyed by hash(query) and k or the radius, capacity 0 turns it off. Every insert or erase
+          starts a new epoch that makes all entries stale; by_region keeps entries whose query ball
+          the changed record is outside of.
+        */
+        using CacheStats = typename Cache::Stats;
+        void set_cache(std::size_t capacity, std::function<std::size_t(const recType &)> hash, bool by_region = false);
+        CacheStats cache_stats() const;
+        void invalidate_cache(const recType &center, Distance radius); // records within radius of center changed outside the tree
+        void invalidate_cache();                                       // drop every entry
+
+        /***
+          memo of distances between two nodes by their IDs, for expensive metrics: inserts, erases
+          (reinserting the orphaned children) and rebalancing compare the same pairs again and again.
+          capacity 0 turns it off; defining METRIC_SPACE_DISABLE_DISTANCE_CACHE compiles it out of
+          Node::dist altogether.
+        */
+        using DistanceCacheStats = typename DistanceCache<Distance>::Stats;
+        void set_distance_cache(std::size_t capacity);
+        DistanceCacheStats distance_cache_stats() const;
+
+        /***
+          how often each lower bound of the metric (see metric_traits.hpp) ruled a child out during nn, knn,
+          rnn and insert since the tree was built, and how many children passed all of them and were evaluated
+        */
+        struct LowerBoundStats {
+            std::vector<std::size_t> pruned; // per bound, in the order the metric lists them
+            std::size_t evaluated = 0;
+        };
+        LowerBoundStats lower_bound_stats() const;
+
+        /*** neighbours in ascending distance, computed lazily while iterating, for when k is not known in advance ***/
+        NeighbourRange<recType, Metric> neighbours(const recType &p) const;
+
+        /*** batch search: one read lock, queries spread over ThreadPool::global(), flat results ***/
+        BatchResult<Distance> nn_batch(const std::vector<recType> &queries, const QueryOptions &options = QueryOptions()) const;
+        BatchResult<Distance> knn_batch(const std::vector<recType> &queries, unsigned k, const QueryOptions &options = QueryOptions()) const;
+        BatchResult<Distance> rnn_batch(const std::vector<recType> &queries, Distance distance, const QueryOptions &options = QueryOptions()) const;
+        void nn_batch(const std::vector<recType> &queries, BatchResult<Distance> &out, const QueryOptions &options = QueryOptions()) const; // reuses the storage of out
+        void knn_batch(const std::vector<recType> &queries, unsigned k, BatchResult<Distance> &out, const QueryOptions &options = QueryOptions()) const;
+        void rnn_batch(const std::vector<recType> &queries, Distance distance, BatchResult<Distance> &out, const QueryOptions &options = QueryOptions()) const;
+
+        /***
+          all k nearest neighbours: for every record of this tree its k nearest records in other, in
+          one dual tree traversal spread over ThreadPool::global(). The neighbours of the record with
+          ID i are [offsets[i], offsets[i + 1]), ids are IDs in other. other == *this is a self join,
+          a record is not its own neighbour then.
+        */
+        BatchResult<Distance> knn_join(const Tree &other, unsigned k) const;
+        void knn_join(const Tree &other, unsigned k, BatchResult<Distance> &out) const; // reuses the storage of out
+
+        /***
+          similarity self join: every pair of records closer than distance (strictly, as rnn). Row i
+          holds the neighbours of the record with ID i that have a larger ID, ascending, so every
+          pair is listed once; erased IDs have empty rows. The records are searched in groups like
+          knn_join. metric::graph::range_join (details/graph/range_join.hpp) turns the rows into a
+          sparse graph with connected component labels.
+        */
+        std::vector<std::vector<std::pair<std::size_t, Distance>>> range_pairs(Distance distance) const;
+
+        /***
+          reverse k nearest neighbours: the records x that would have q among their k nearest
+          neighbours, d(x, q) <= distance of x to its k-th nearest other record. Ascending by distance.
+          The first query for a k runs an all kNN self join for these radii and keeps their maximum per
+          subtree, so a subtree farther from q than all of its radii is pruned. Inserts only shrink
+          radii, the stored ones stay upper bounds and are made exact when a record becomes a
+          candidate; erases refresh the records that had the erased one within their radius.
+        */
+        std::vector<std::pair<Node_ptr, Distance>> rknn(const recType &q, unsigned k) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &rknn(const recType &q, unsigned k, Context &ctx) const; // ctx reports the evaluations
+        void set_rknn_cache(unsigned k); // build the radii for k ahead of the first query, 0 drops them
+
+        /***
+          pivot filtering for expensive metrics: count records far apart (farthest first) become pivots
+          and every node keeps its distances to them, computed at insert. nn, knn and rnn (depth first)
+          then evaluate the query against the pivots once and skip every child whose triangle bound
+          max_p |d(q, p) - d(child, p)| already rules out its subtree, without calling the metric on it.
+          count metric calls per insert and per query, 0 turns it off.
+        */
+        void set_pivots(unsigned count);
+        const std::vector<recType> &pivots() const { return pivots_; }
+
+        /***
+          farthest neighbours, descending by distance. Best first on the upper bound d(q, node) + maxdist,
+          a child is bounded by d(q, parent) + parent_dist + maxdist before it is evaluated at all.
+        */
+        Node_ptr fn(const recType &q) const;
+        std::vector<std::pair<Node_ptr, Distance>> kfn(const recType &q, unsigned k) const;
+        const std::vector<std::pair<Node_ptr, Distance>> &kfn(const recType &q, unsigned k, Context &ctx) const; // ctx reports the evaluations
+        /***
+          approximate diameter: the longest distance met by alternating farthest neighbour sweeps (at
+          most sweeps of them). It is a distance between two records, so never above the diameter, and at
+          least half of it; 2 * maxdist of the root is the matching upper bound.
+        */
+        Distance diameter(unsigned sweeps = 4) const;
+
         /*** utilitys ***/
         size_t size(); // return node size.
         void traverse(const std::function<void(Node_ptr)> &f);
@@ -235,6 +794,12 @@ namespace metric_space
         }
     };
 
+    /*** all k nearest neighbours in B of every record of A, see Tree::knn_join ***/
+    template <class recType, class Metric>
+    auto knn_join(const Tree<recType, Metric> &A, const Tree<recType, Metric> &B, unsigned k) -> decltype(A.knn_join(B, k)) {
+        return A.knn_join(B, k);
+    }
+
 } // end namespace
 
 #include "tree.cpp" // include the implementation
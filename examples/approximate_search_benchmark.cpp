@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../metric_space.hpp"
+
+/*** recall against latency of approximate and budgeted knn, prints csv for plotting ***/
+int main()
+{
+    using recType = std::vector<double>;
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    const int n_records = 20000;
+    const int n_queries = 200;
+    const int rec_dim = 8;
+    const unsigned k = 10;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    auto random_record = [&]() {
+        recType r(rec_dim);
+        for (auto &v : r)
+            v = dist(gen);
+        return r;
+    };
+
+    std::vector<recType> records;
+    for (int i = 0; i < n_records; ++i)
+        records.push_back(random_record());
+    std::vector<recType> queries;
+    for (int i = 0; i < n_queries; ++i)
+        queries.push_back(random_record());
+
+    metric_space::Tree<recType> cTree(records);
+    metric_space::QueryContext<recType, Metric> ctx;
+
+    /*** ground truth ***/
+    std::vector<std::vector<unsigned>> truth;
+    for (auto &q : queries) {
+        std::vector<unsigned> ids;
+        for (auto &nb : cTree.knn(q, k))
+            ids.push_back(nb.first->ID);
+        std::sort(ids.begin(), ids.end());
+        truth.push_back(ids);
+    }
+
+    auto run = [&](const std::string &mode, const std::string &parameter,
+                   const metric_space::QueryOptions &options) {
+        double recall = 0;
+        std::size_t exact = 0;
+        std::size_t evaluations = 0;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            auto &knn = cTree.knn(queries[i], k, ctx, options);
+            std::vector<unsigned> ids;
+            for (auto &nb : knn)
+                ids.push_back(nb.first->ID);
+            std::sort(ids.begin(), ids.end());
+            std::vector<unsigned> hits;
+            std::set_intersection(ids.begin(), ids.end(), truth[i].begin(), truth[i].end(),
+                                  std::back_inserter(hits));
+            recall += double(hits.size()) / k;
+            exact += ctx.exact;
+            evaluations += ctx.evaluations;
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / double(n_queries);
+        std::cout << mode << ", " << parameter << ", " << recall / n_queries << ", " << latency << ", "
+                  << evaluations / n_queries << ", " << exact << std::endl;
+    };
+
+    std::cout << "mode, parameter, recall, latency [us], evaluations, exact results" << std::endl;
+    run("exact", "-", metric_space::QueryOptions());
+    for (double epsilon : {0.1, 0.25, 0.5, 1.0, 2.0}) {
+        metric_space::QueryOptions options;
+        options.epsilon = epsilon;
+        run("epsilon", std::to_string(epsilon), options);
+    }
+    for (std::size_t evaluations : {100, 250, 500, 1000, 2000}) {
+        metric_space::QueryOptions options;
+        options.max_evaluations = evaluations;
+        run("max_evaluations", std::to_string(evaluations), options);
+        options.order = metric_space::SearchOrder::best_first;
+        run("max_evaluations best_first", std::to_string(evaluations), options);
+    }
+    for (std::size_t visited : {10, 25, 50, 100, 200}) {
+        metric_space::QueryOptions options;
+        options.max_visited = visited;
+        run("max_visited", std::to_string(visited), options);
+    }
+    for (int us : {20, 50, 100, 200}) {
+        metric_space::QueryOptions options;
+        options.max_time = std::chrono::microseconds(us);
+        run("max_time [us]", std::to_string(us), options);
+    }
+    return 0;
+}
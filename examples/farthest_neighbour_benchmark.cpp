@@ -0,0 +1,87 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../metric_space.hpp"
+
+/*** farthest neighbours and diameter: covering bound branch and bound vs a linear scan ***/
+int main()
+{
+    using recType = std::vector<double>;
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    const int n_queries = 200;
+    const unsigned k = 10;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    std::normal_distribution<double> normal(0, 0.3);
+    auto us = [](std::chrono::high_resolution_clock::time_point a, std::chrono::high_resolution_clock::time_point b) {
+        return double(std::chrono::duration_cast<std::chrono::microseconds>(b - a).count());
+    };
+
+    std::cout << "data, dim, n, kfn [us/query], kfn distances/query, scan [us/query], diameter [ms], diameter, "
+                 "double sweep scan [ms], sweep diameter"
+              << std::endl;
+    for (int gaussian = 0; gaussian < 2; ++gaussian) {
+        for (int dim : {2, 4, 8}) {
+            const int n = 200000;
+            std::vector<recType> records(n, recType(dim));
+            for (auto &r : records)
+                for (auto &v : r)
+                    v = gaussian ? normal(gen) : dist(gen);
+            std::vector<recType> queries(n_queries, recType(dim));
+            for (auto &r : queries)
+                for (auto &v : r)
+                    v = dist(gen);
+            metric_space::Tree<recType> tree(records);
+            metric_space::QueryContext<recType, Metric> ctx;
+            Metric metric;
+
+            std::size_t evaluations = 0;
+            double checksum = 0;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            for (auto &q : queries) {
+                checksum += tree.kfn(q, k, ctx).back().second;
+                evaluations += ctx.evaluations;
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            double scan_checksum = 0;
+            std::vector<double> dists(n);
+            for (auto &q : queries) {
+                for (int i = 0; i < n; ++i)
+                    dists[i] = metric(records[i], q);
+                std::nth_element(dists.begin(), dists.begin() + (k - 1), dists.end(), std::greater<double>());
+                scan_checksum += dists[k - 1];
+            }
+            auto t3 = std::chrono::high_resolution_clock::now();
+            if (std::abs(checksum - scan_checksum) > 1e-9 * checksum)
+                std::cout << "mismatch: " << checksum << " " << scan_checksum << std::endl;
+
+            auto diameter = tree.diameter();
+            auto t4 = std::chrono::high_resolution_clock::now();
+            // the same sweeps with a scan for every farthest record
+            auto farthest = [&](const recType &q) {
+                std::size_t best = 0;
+                double best_dist = -1;
+                for (int i = 0; i < n; ++i) {
+                    double d = metric(records[i], q);
+                    if (d > best_dist) {
+                        best = i;
+                        best_dist = d;
+                    }
+                }
+                return best;
+            };
+            auto a = farthest(records[0]);
+            auto b = farthest(records[a]);
+            double sweep = metric(records[a], records[b]);
+            auto t5 = std::chrono::high_resolution_clock::now();
+
+            std::cout << (gaussian ? "gaussian" : "uniform") << ", " << dim << ", " << n << ", "
+                      << us(t1, t2) / n_queries << ", " << evaluations / n_queries << ", " << us(t2, t3) / n_queries
+                      << ", " << us(t3, t4) / 1000 << ", " << diameter << ", " << us(t4, t5) / 1000 << ", " << sweep
+                      << std::endl;
+        }
+    }
+    return 0;
+}
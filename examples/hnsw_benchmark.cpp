@@ -0,0 +1,72 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../metric_space.hpp"
+
+/*** knn recall and latency of the HNSW graph against the cover tree, over growing intrinsic dimension ***/
+using recType = std::vector<double>;
+
+static std::atomic<std::size_t> evaluations(0);
+
+struct Counting_L2 {
+    double operator()(const recType &a, const recType &b) const {
+        evaluations++;
+        return metric_space::L2_Metric_STL<recType>()(a, b);
+    }
+};
+
+int main()
+{
+    const unsigned k = 10;
+    std::mt19937 gen(42);
+    std::normal_distribution<double> dist(0, 1);
+    auto random_records = [&](int n, int dim) {
+        std::vector<recType> records(n, recType(dim));
+        for (auto &r : records)
+            for (auto &v : r)
+                v = dist(gen);
+        return records;
+    };
+    auto ms = [](std::chrono::high_resolution_clock::time_point a, std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+    };
+    auto us = [](std::chrono::high_resolution_clock::time_point a, std::chrono::high_resolution_clock::time_point b) {
+        return double(std::chrono::duration_cast<std::chrono::microseconds>(b - a).count());
+    };
+
+    std::cout << "dim, index, build [ms], knn [us/query], distances/query, recall@" << k << std::endl;
+    for (int dim : {4, 16, 64}) {
+        auto records = random_records(10000, dim);
+        auto queries = random_records(200, dim);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        metric_space::Tree<recType, Counting_L2> tree(records);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        evaluations = 0;
+        std::vector<double> kth; // exact distance of the k-th neighbour
+        for (auto &q : queries)
+            kth.push_back(tree.knn(q, k).back().second);
+        auto t3 = std::chrono::high_resolution_clock::now();
+        std::cout << dim << ", tree, " << ms(t1, t2) << ", " << us(t2, t3) / queries.size() << ", "
+                  << evaluations / double(queries.size()) << ", 1" << std::endl;
+
+        t1 = std::chrono::high_resolution_clock::now();
+        metric::graph::HNSW<recType, Counting_L2> graph(records);
+        t2 = std::chrono::high_resolution_clock::now();
+        auto build = ms(t1, t2);
+        for (std::size_t ef : {10, 40, 160}) {
+            evaluations = 0;
+            std::size_t hits = 0;
+            t1 = std::chrono::high_resolution_clock::now();
+            for (std::size_t i = 0; i < queries.size(); ++i)
+                for (auto &found : graph.knn(queries[i], k, ef))
+                    hits += found.second <= kth[i];
+            t2 = std::chrono::high_resolution_clock::now();
+            std::cout << dim << ", hnsw ef " << ef << ", " << build << ", " << us(t1, t2) / queries.size() << ", "
+                      << evaluations / double(queries.size()) << ", " << hits / double(queries.size() * k) << std::endl;
+        }
+    }
+    return 0;
+}
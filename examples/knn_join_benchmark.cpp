@@ -0,0 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../metric_space.hpp"
+
+/*** all k nearest neighbours: n independent knn searches vs one dual tree knn_join ***/
+static std::atomic<std::size_t> evaluations(0);
+
+template <typename Container>
+struct Counting_L2 {
+    double operator()(const Container &a, const Container &b) const {
+        evaluations++;
+        return metric_space::L2_Metric_STL<Container>()(a, b);
+    }
+};
+
+int main()
+{
+    using recType = std::vector<double>;
+    using Tree = metric_space::Tree<recType, Counting_L2<recType>>;
+    const unsigned k = 10;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    auto random_records = [&](int n, int dim) {
+        std::vector<recType> records(n, recType(dim));
+        for (auto &r : records)
+            for (auto &v : r)
+                v = dist(gen);
+        return records;
+    };
+
+    std::cout << "dim, |A|, |B|, n x knn [ms], n x knn distances, knn_join [ms], knn_join distances, self join [ms], self join distances"
+              << std::endl;
+    for (int dim : {2, 4, 8}) {
+        for (int n : {10000, 50000}) {
+            auto a_records = random_records(n, dim);
+            auto b_records = random_records(n, dim);
+            Tree A(a_records);
+            Tree B(b_records);
+
+            evaluations = 0;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            double checksum = 0;
+            for (auto &q : a_records)
+                checksum += B.knn(q, k).back().second;
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::size_t single = evaluations;
+
+            evaluations = 0;
+            auto join = A.knn_join(B, k);
+            auto t3 = std::chrono::high_resolution_clock::now();
+            std::size_t dual = evaluations;
+            double join_checksum = 0;
+            for (std::size_t i = 0; i < join.size(); ++i)
+                join_checksum += join.distances[join.offsets[i + 1] - 1];
+            if (std::abs(join_checksum - checksum) > 1e-6 * checksum)
+                std::cout << "mismatch: " << checksum << " " << join_checksum << std::endl;
+
+            evaluations = 0;
+            auto t4 = std::chrono::high_resolution_clock::now();
+            A.knn_join(A, k);
+            auto t5 = std::chrono::high_resolution_clock::now();
+            std::size_t self = evaluations;
+
+            auto ms = [](std::chrono::high_resolution_clock::time_point a, std::chrono::high_resolution_clock::time_point b) {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+            };
+            std::cout << dim << ", " << n << ", " << n << ", " << ms(t1, t2) << ", " << single << ", " << ms(t2, t3) << ", "
+                      << dual << ", " << ms(t4, t5) << ", " << self << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../metric_space.hpp"
+
+/*** compare depth first, best first and level synchronous nn and knn for growing k ***/
+int main()
+{
+    using recType = std::vector<double>;
+    const int n_records = 20000;
+    const int n_queries = 200;
+    const int rec_dim = 8;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    auto random_record = [&]() {
+        recType r(rec_dim);
+        for (auto &v : r)
+            v = dist(gen);
+        return r;
+    };
+
+    std::vector<recType> records;
+    for (int i = 0; i < n_records; ++i)
+        records.push_back(random_record());
+    std::vector<recType> queries;
+    for (int i = 0; i < n_queries; ++i)
+        queries.push_back(random_record());
+
+    metric_space::Tree<recType> cTree(records);
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+
+    auto run = [&](unsigned k, metric_space::SearchOrder order) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (auto &q : queries)
+            cTree.knn(q, k, ctx, order);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / double(n_queries);
+    };
+
+    auto run_nn = [&](metric_space::SearchOrder order) {
+        metric_space::QueryOptions options;
+        options.order = order;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (auto &q : queries)
+            cTree.nn(q, ctx, options);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / double(n_queries);
+    };
+
+    run_nn(metric_space::SearchOrder::depth_first); // warm up ctx
+    std::cout << "nn: depth_first " << run_nn(metric_space::SearchOrder::depth_first)
+              << " us/query, best_first " << run_nn(metric_space::SearchOrder::best_first)
+              << " us/query, level_synchronous " << run_nn(metric_space::SearchOrder::level_synchronous)
+              << " us/query" << std::endl;
+
+    std::cout << "k, depth_first [us/query], best_first [us/query], level_synchronous [us/query]" << std::endl;
+    for (unsigned k : {1u, 2u, 5u, 10u, 20u, 50u, 100u, 200u, 500u, 1000u}) {
+        run(k, metric_space::SearchOrder::depth_first); // warm up ctx
+        auto depth_first = run(k, metric_space::SearchOrder::depth_first);
+        auto best_first = run(k, metric_space::SearchOrder::best_first);
+        auto level_synchronous = run(k, metric_space::SearchOrder::level_synchronous);
+        std::cout << k << ", " << depth_first << ", " << best_first << ", " << level_synchronous << std::endl;
+    }
+    return 0;
+}
@@ -1,3 +1,5 @@
 #include "details/matrix.hpp"
 #include "details/graph.hpp"
 #include "details/tree.hpp"
+#include "details/graph/hnsw.hpp"
+#include "details/graph/range_join.hpp"
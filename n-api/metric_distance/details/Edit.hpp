@@ -1,6 +1,8 @@
 #ifndef _METRIC_DISTANCE_EDIT_HPP
 #define _METRIC_DISTANCE_EDIT_HPP
 
+#include <tuple>
+
 namespace metric
 {
 
@@ -16,6 +18,16 @@ namespace metric
             template<typename Container>
             distance_type operator()(const Container &str1, const Container &str2) const;
 
+            /*** every edit changes the length by one at most, see metric_space::metric_traits ***/
+            struct LengthDifference
+            {
+                template<typename Container>
+                distance_type operator()(const Container &str1, const Container &str2) const {
+                    return str1.size() > str2.size() ? str1.size() - str2.size() : str2.size() - str1.size();
+                }
+            };
+            std::tuple<LengthDifference> lower_bounds() const { return {}; }
+
             
             distance_type operator()(const V* str1, const V* str2) const {
                 return this->operator()(std::basic_string_view<V>(str1), std::basic_string_view<V>(str2));
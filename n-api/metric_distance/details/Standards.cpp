@@ -39,6 +39,24 @@ auto Euclidian<V>::operator()(const Container &a, const Container &b) const -> d
   return std::sqrt(sum);
 }
 
+template <typename V>
+template<typename Container>
+auto Euclidian<V>::operator()(const Container &a, const Container &b, distance_type bound) const -> distance_type
+{
+  static_assert(
+      std::is_floating_point<value_type>::value, "T must be a float type");
+  distance_type sum = 0;
+  distance_type limit = bound * bound;
+  std::size_t n = 0;
+  for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2)
+  {
+    sum += (*it1 - *it2) * (*it1 - *it2);
+    if ((++n & 7) == 0 && sum > limit)
+      break;
+  }
+  return std::sqrt(sum);
+}
+
 template<typename V>
 template<typename Container>
 auto Euclidian_thresholded<V>::operator()(const Container &a, const Container &b) const -> distance_type
@@ -53,6 +71,26 @@ auto Euclidian_thresholded<V>::operator()(const Container &a, const Container &b
     return std::min(thres, value_type(factor * sqrt(sum)));
 }
 
+template<typename V>
+template<typename Container>
+auto Euclidian_thresholded<V>::operator()(const Container &a, const Container &b, distance_type bound) const -> distance_type
+{
+    static_assert(
+        std::is_floating_point<value_type>::value, "T must be a float type");
+    if (!(thres > bound))
+        return (*this)(a, b); // the threshold keeps every distance within bound
+    distance_type sum = 0;
+    distance_type limit = (bound / factor) * (bound / factor);
+    std::size_t n = 0;
+    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2)
+    {
+        sum += (*it1 - *it2) * (*it1 - *it2);
+        if ((++n & 7) == 0 && sum > limit)
+            break;
+    }
+    return std::min(thres, value_type(factor * sqrt(sum)));
+}
+
 template<typename V>
 template<typename Container>
 auto Manhatten<V>::operator()(const Container &a, const Container &b) const -> distance_type
@@ -67,6 +105,23 @@ auto Manhatten<V>::operator()(const Container &a, const Container &b) const -> d
     return sum;
 }
 
+template<typename V>
+template<typename Container>
+auto Manhatten<V>::operator()(const Container &a, const Container &b, distance_type bound) const -> distance_type
+{
+    static_assert(
+        std::is_floating_point<value_type>::value, "T must be a float type");
+    distance_type sum = 0;
+    std::size_t n = 0;
+    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2)
+    {
+        sum += std::abs(*it1 - *it2);
+        if ((++n & 7) == 0 && sum > bound)
+            break;
+    }
+    return sum;
+}
+
 template<typename V>
 template <typename Container>
 auto P_norm<V>::operator()(const Container &a, const Container &b) const -> distance_type
@@ -81,6 +136,24 @@ auto P_norm<V>::operator()(const Container &a, const Container &b) const -> dist
     return std::pow(sum, 1 / p);
 }
 
+template<typename V>
+template <typename Container>
+auto P_norm<V>::operator()(const Container &a, const Container &b, distance_type bound) const -> distance_type
+{
+    static_assert(
+        std::is_floating_point<value_type>::value, "T must be a float type");
+    distance_type sum = 0;
+    distance_type limit = bound > 0 ? std::pow(bound, p) : 0;
+    std::size_t n = 0;
+    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2)
+    {
+        sum += std::pow(std::abs(*it1 - *it2), p);
+        if ((++n & 7) == 0 && sum > limit)
+            break;
+    }
+    return std::pow(sum, 1 / p);
+}
+
 template<typename V>
 template <typename Container>
 auto Cosine<V>::operator()(const Container &A, const Container &B) const -> distance_type
@@ -95,5 +168,29 @@ auto Cosine<V>::operator()(const Container &A, const Container &B) const -> dist
   return dot / (std::sqrt(denom_a) * std::sqrt(denom_b));
 }
 
+template<typename V>
+template <typename Container>
+auto Cosine<V>::prepare(const Container &A) const -> Prepared
+{
+  Prepared a;
+  value_type denom = 0;
+  for (auto it = A.begin(); it != A.end(); ++it)
+  {
+    a.values.push_back(*it);
+    denom += *it * *it;
+  }
+  a.norm = std::sqrt(denom);
+  return a;
+}
+
+template<typename V>
+auto Cosine<V>::operator()(const Prepared &A, const Prepared &B) const -> distance_type
+{
+  value_type dot = 0;
+  for (std::size_t i = 0; i < A.values.size() && i < B.values.size(); ++i)
+    dot += A.values[i] * B.values[i];
+  return dot / (A.norm * B.norm);
+}
+
 } // namespace distance
 } // namespace metric
@@ -1,6 +1,8 @@
 #ifndef _METRIC_DISTANCE_STANDARDS_HPP
 #define _METRIC_DISTANCE_STANDARDS_HPP
 
+#include <vector>
+
 #define DECLARE_METRIC_TYPES                            \
     using value_type = typename Container::value_type;  \
     using distance_type = value_type;                   \
@@ -24,6 +26,9 @@ namespace metric
             template<typename Container>
             distance_type
             operator()(const Container &a, const Container &b) const;
+            /*** stops once the sum of squares passes bound^2, see metric_space::metric_traits ***/
+            template<typename Container>
+            distance_type operator()(const Container &a, const Container &b, distance_type bound) const;
         };
 
 /***  Manhatten/Cityblock (L1) Metric ***/
@@ -37,6 +42,9 @@ namespace metric
 
             template<typename Container>
             distance_type  operator()(const Container &a, const Container &b) const;
+            /*** stops once the sum of absolute differences passes bound, see metric_space::metric_traits ***/
+            template<typename Container>
+            distance_type operator()(const Container &a, const Container &b, distance_type bound) const;
         };
 
 /*** Minkowski (L general) Metric ***/
@@ -53,6 +61,9 @@ namespace metric
 
             template<typename Container>
             distance_type operator()(const Container &a, const Container &b) const;
+            /*** stops once the sum of p-th powers passes bound^p, see metric_space::metric_traits ***/
+            template<typename Container>
+            distance_type operator()(const Container &a, const Container &b, distance_type bound) const;
         };
 
 /*** Minkowski Metric (L... / P_Norm) ***/
@@ -70,6 +81,9 @@ namespace metric
 
             template<typename Container>
             distance_type  operator()(const Container &a, const Container &b) const;
+            /*** stops once the sum of squares passes (bound / factor)^2, plain call if thres is within bound ***/
+            template<typename Container>
+            distance_type operator()(const Container &a, const Container &b, distance_type bound) const;
         };
 
 /*** Cosine Metric ***/
@@ -81,6 +95,16 @@ namespace metric
 
             template<typename Container>
             distance_type  operator()(const Container &a, const Container &b) const;
+
+            /*** values and norm of a vector, see metric_space::metric_traits ***/
+            struct Prepared
+            {
+                std::vector<value_type> values;
+                value_type norm = 0;
+            };
+            template<typename Container>
+            Prepared prepare(const Container &a) const;
+            distance_type operator()(const Prepared &a, const Prepared &b) const;
         };
 
 
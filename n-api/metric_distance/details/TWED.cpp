@@ -1,4 +1,5 @@
 #include "TWED.hpp"
+#include <limits>
 #include <vector>
 
 namespace metric
@@ -6,33 +7,44 @@ namespace metric
 namespace distance
 {
 
-/*** distance measure with time elastic cost matrix. ***/
+/*** the curve as values and their time stamps (positions) ***/
 template <typename V>
 template <typename Container>
-auto TWED<V>::operator()(const Container &As, const Container &Bs) const ->distance_type
+auto TWED<V>::prepare(const Container &As) const -> Prepared
 {
-    std::vector<value_type> A;
-    A.reserve(As.size());
-    std::vector<value_type> timeA;
-    timeA.reserve(As.size());
-
-    std::vector<value_type> B;
-    B.reserve(Bs.size());
-
-    std::vector<value_type> timeB;
-    timeB.reserve(Bs.size());
-
+    Prepared A;
+    A.values.reserve(As.size());
+    A.time.reserve(As.size());
     for (auto it = As.cbegin(); it != As.cend(); ++it)
     {
-        timeA.push_back(std::distance(As.begin(), it)); // Read access to the index of the non-zero element.
-        A.push_back(*it);                               // Read access to the value of the non-zero element.
+        A.time.push_back(std::distance(As.begin(), it)); // Read access to the index of the non-zero element.
+        A.values.push_back(*it);                         // Read access to the value of the non-zero element.
     }
+    return A;
+}
 
-    for (auto it = Bs.cbegin(); it != Bs.cend(); ++it)
-    {
-        timeB.push_back(std::distance(Bs.begin(), it)); // Read access to the index of the non-zero element.
-        B.push_back(*it);                               // Read access to the value of the non-zero element.
-    }
+/*** distance measure with time elastic cost matrix. ***/
+template <typename V>
+template <typename Container>
+auto TWED<V>::operator()(const Container &As, const Container &Bs) const ->distance_type
+{
+    return (*this)(prepare(As), prepare(Bs));
+}
+
+template <typename V>
+auto TWED<V>::operator()(const Prepared &As, const Prepared &Bs) const ->distance_type
+{
+    return (*this)(As, Bs, std::numeric_limits<value_type>::max());
+}
+
+/*** every warping path crosses each row, so a row minimum is a lower bound of the distance ***/
+template <typename V>
+auto TWED<V>::operator()(const Prepared &As, const Prepared &Bs, value_type bound) const ->distance_type
+{
+    const auto &A = As.values;
+    const auto &timeA = As.time;
+    const auto &B = Bs.values;
+    const auto &timeB = Bs.time;
 
     value_type C1, C2, C3;
 
@@ -58,6 +70,7 @@ auto TWED<V>::operator()(const Container &As, const Container &Bs) const ->dista
     {
         // every first element in row
         Di[0] = D0[0] + std::abs(A[i - 1] - A[i]) + elastic * (timeA[i] - timeA[i - 1]) + penalty; // C1
+        value_type row_min = Di[0];
 
         // remaining elements in row
         for (int j = 1; j < sizeB; j++)
@@ -66,7 +79,11 @@ auto TWED<V>::operator()(const Container &As, const Container &Bs) const ->dista
             C2 = Di[j - 1] + std::abs(B[j - 1] - B[j]) + elastic * (timeB[j] - timeB[j - 1]) + penalty;
             C3 = D0[j - 1] + std::abs(A[i] - B[j]) + std::abs(A[i - 1] - B[j - 1]) + elastic * (std::abs(timeA[i] - timeB[j]) + std::abs(timeA[i - 1] - timeB[j - 1]));
             Di[j] = (C1 < ((C2 < C3) ? C2 : C3)) ? C1 : ((C2 < C3) ? C2 : C3); //Di[j] = std::min({C1,C2,C3});
+            if (Di[j] < row_min)
+                row_min = Di[j];
         }
+        if (row_min > bound)
+            return row_min;
         std::swap(D0, Di);
     }
 
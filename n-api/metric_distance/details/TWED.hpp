@@ -1,6 +1,8 @@
 #ifndef _METRIC_DISTANCE_TWED_HPP
 #define _METRIC_DISTANCE_TWED_HPP
 
+#include <vector>
+
 namespace metric
 {
 
@@ -35,6 +37,17 @@ struct TWED
 
   template<typename Container>
   value_type  operator()(const Container &As, const Container &Bs) const;
+
+  /*** values and time stamps of a curve, see metric_space::metric_traits ***/
+  struct Prepared
+  {
+    std::vector<value_type> values;
+    std::vector<value_type> time;
+  };
+  template<typename Container>
+  Prepared prepare(const Container &As) const;
+  value_type operator()(const Prepared &A, const Prepared &B) const;
+  value_type operator()(const Prepared &A, const Prepared &B, value_type bound) const; // stops once a row minimum passes bound
 // #ifdef _BLAZE_BLAZE_H_
 //     typename Container::value_type
 //     operator()(blaze::CompressedVector<Container::value_type> const &As, blaze::CompressedVector<Container::value_type> const &Bs, Container::value_type const &penalty = 0, Container::value_type const &elastic = 1, bool is_zero_padded = false) const;
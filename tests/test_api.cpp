@@ -98,6 +98,31 @@ BOOST_AUTO_TEST_CASE(test_insert_if) {
     BOOST_TEST(tree.insert_if(26,10));
 }
 
+BOOST_AUTO_TEST_CASE(test_insert_if_deduplicates) {
+    std::vector<int> data;
+    for (int i = 0; i < 2000; ++i)
+        data.push_back((i * 7919) % 10007); // scattered over [0, 10007), some within the treshold
+    metric_space::Tree<int,distance<int>> deduplicated;
+    metric_space::Tree<int,distance<int>> reference;
+    std::vector<int> kept;
+    for (auto x : data) {
+        bool duplicate = false;
+        for (auto y : kept)
+            duplicate = duplicate || std::abs(x - y) <= 3;
+        BOOST_TEST(deduplicated.exists_within(x, 3) == duplicate);
+        BOOST_TEST(deduplicated.insert_if(x, 3) == !duplicate);
+        if (!duplicate) {
+            kept.push_back(x);
+            reference.insert(x);
+        }
+    }
+    BOOST_TEST(deduplicated.size() == kept.size());
+    BOOST_TEST(deduplicated.check_covering());
+    // the shared descent puts every record where insert would
+    BOOST_TEST((deduplicated == reference));
+    BOOST_TEST(deduplicated.insert_if(data, 3) == 0u);
+}
+
 BOOST_AUTO_TEST_CASE(test_insert2) {
   std::vector<int> data = {7,8,9,10,11,12,13};
   metric_space::Tree<int,distance<int>> tree;
@@ -115,3 +140,30 @@ BOOST_AUTO_TEST_CASE(test_to_json) {
     std::string json2 = "{\n\"nodes\": [\n{ \"id\":0, \"values\":1},\n{ \"id\":1, \"values\":2}\n],\n\"edges\": [\n{ \"source\":0, \"target\":1, \"distance\":1}\n]}\n";
     BOOST_TEST(tree.to_json() == json2);
 }
+
+struct abs_distance {
+    double operator()(const double &lhs, const double &rhs) const {
+        return std::abs(lhs - rhs);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_deep_chain) {
+    // every point halves the distance to the root, so each one lands one level below the previous
+    metric_space::Tree<double,abs_distance> tree;
+    tree.insert(0.0);
+    double x = 1.0;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(x);
+        x /= 2;
+    }
+    BOOST_TEST(tree.size() == 1001u);
+    int min_level = 0;
+    tree.traverse([&](auto node) { min_level = std::min(min_level, node->level); });
+    BOOST_TEST(min_level <= -900);
+    BOOST_TEST(tree.nn(1.0)->ID == 1u);
+    BOOST_TEST(tree.knn(0.75, 3).size() == 3u);
+    BOOST_TEST(tree.rnn(1.0, 0.3).size() == 1u);
+    std::ostringstream os;
+    tree.print(os);
+    BOOST_TEST(!os.str().empty());
+}
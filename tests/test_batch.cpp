@@ -0,0 +1,237 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_batch
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_thread_pool) {
+    metric_space::ThreadPool pool(3);
+    std::vector<int> hits(10000, 0);
+    std::vector<int> busy(pool.size() + 1, 0);
+    // Boost.Test is not thread safe, the chunks only count violations
+    std::atomic<int> bad_worker(0), shared_worker(0);
+    pool.parallel_for(hits.size(), 7, [&](std::size_t begin, std::size_t end, std::size_t worker) {
+        if (worker > pool.size()) {
+            bad_worker++;
+            return;
+        }
+        if (busy[worker]++ != 0) // no two chunks share a worker at once
+            shared_worker++;
+        for (auto i = begin; i < end; ++i)
+            hits[i]++;
+        busy[worker]--;
+    });
+    BOOST_TEST(bad_worker == 0);
+    BOOST_TEST(shared_worker == 0);
+    for (auto h : hits)
+        BOOST_REQUIRE(h == 1);
+    BOOST_CHECK_THROW(pool.parallel_for(100, 1, [](std::size_t begin, std::size_t, std::size_t) {
+                          if (begin == 42)
+                              throw std::runtime_error("chunk 42");
+                      }),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_matches_single_queries) {
+    metric_space::Tree<recType> tree(random_records(3000, 4, 1));
+    auto queries = random_records(500, 4, 2);
+
+    auto knn = tree.knn_batch(queries, 7);
+    auto nn = tree.nn_batch(queries);
+    auto rnn = tree.rnn_batch(queries, 0.3);
+    BOOST_TEST(knn.size() == queries.size());
+    BOOST_TEST(nn.size() == queries.size());
+    BOOST_TEST(rnn.size() == queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        auto single = tree.knn(queries[i], 7);
+        BOOST_REQUIRE(knn.offsets[i + 1] - knn.offsets[i] == single.size());
+        for (std::size_t j = 0; j < single.size(); ++j) {
+            BOOST_TEST(knn.ids[knn.offsets[i] + j] == single[j].first->ID);
+            BOOST_TEST(knn.distances[knn.offsets[i] + j] == single[j].second);
+        }
+        BOOST_TEST(nn.ids[i] == tree.nn(queries[i])->ID);
+        BOOST_TEST(nn.distances[i] == single[0].second);
+        auto range = tree.rnn(queries[i], 0.3);
+        BOOST_REQUIRE(rnn.offsets[i + 1] - rnn.offsets[i] == range.size());
+        for (std::size_t j = 0; j < range.size(); ++j)
+            BOOST_TEST(rnn.ids[rnn.offsets[i] + j] == range[j].first->ID);
+    }
+
+    // k larger than the tree: fewer results per query, still densely packed
+    metric_space::Tree<recType> small(random_records(5, 4, 3));
+    metric_space::BatchResult<double> out;
+    small.knn_batch(queries, 10, out);
+    BOOST_TEST(out.ids.size() == 5 * queries.size());
+    BOOST_TEST(out.offsets.back() == out.ids.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_grouped_batch) {
+    metric_space::Tree<recType> tree(random_records(3000, 4, 1));
+    auto queries = random_records(333, 4, 2);
+
+    auto single = tree.knn_batch(queries, 7);
+    metric_space::QueryOptions options;
+    for (std::size_t group : {2, 8, 64}) {
+        options.group_size = group;
+        auto grouped = tree.knn_batch(queries, 7, options);
+        BOOST_REQUIRE(grouped.offsets == single.offsets);
+        for (std::size_t i = 0; i < single.distances.size(); ++i)
+            BOOST_TEST(grouped.distances[i] == single.distances[i]);
+        auto nn = tree.nn_batch(queries, options);
+        for (std::size_t i = 0; i < queries.size(); ++i)
+            BOOST_TEST(nn.distances[i] == single.distances[single.offsets[i]]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_queries) {
+    metric_space::Tree<recType> tree(random_records(3000, 4, 1));
+    auto queries = random_records(50, 4, 2);
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+
+    metric_space::QueryOptions options;
+    options.parallel = true;
+    for (std::size_t children : {0, 2}) {
+        options.parallel_children = children;
+        for (auto &q : queries) {
+            auto knn = tree.knn(q, 20);
+            auto &parallel_knn = tree.knn(q, 20, ctx, options);
+            BOOST_REQUIRE(parallel_knn.size() == knn.size());
+            for (std::size_t i = 0; i < knn.size(); ++i)
+                BOOST_TEST(parallel_knn[i].second == knn[i].second);
+            BOOST_TEST(ctx.exact);
+            BOOST_TEST(tree.nn(q, ctx, options)->dist(q) == knn[0].second);
+
+            auto rnn = tree.rnn(q, 0.5);
+            auto parallel_rnn = tree.rnn(q, 0.5, ctx, options);
+            BOOST_REQUIRE(parallel_rnn.size() == rnn.size());
+            auto by_id = [](const std::pair<metric_space::Node<recType, metric_space::L2_Metric_STL<recType>> *, double> &a,
+                            const std::pair<metric_space::Node<recType, metric_space::L2_Metric_STL<recType>> *, double> &b) {
+                return a.first->ID < b.first->ID;
+            };
+            std::sort(rnn.begin(), rnn.end(), by_id);
+            std::sort(parallel_rnn.begin(), parallel_rnn.end(), by_id);
+            for (std::size_t i = 0; i < rnn.size(); ++i)
+                BOOST_TEST(parallel_rnn[i].first == rnn[i].first);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_knn_join) {
+    metric_space::L2_Metric_STL<recType> metric;
+    auto a_records = random_records(1500, 3, 7);
+    auto b_records = random_records(2500, 3, 8);
+    b_records.push_back(b_records[10]); // ties
+    metric_space::Tree<recType> A(a_records);
+    metric_space::Tree<recType> B(b_records);
+    const unsigned k = 7;
+
+    // the k-th distance of every record against brute force, neighbours in ascending distance
+    auto check = [&](const metric_space::BatchResult<double> &join, const std::vector<recType> &queries,
+                     const std::vector<recType> &references, bool self) {
+        BOOST_REQUIRE(join.size() == queries.size());
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            std::vector<double> all;
+            for (std::size_t j = 0; j < references.size(); ++j)
+                if (!self || j != i)
+                    all.push_back(metric(queries[i], references[j]));
+            std::sort(all.begin(), all.end());
+            BOOST_REQUIRE(join.offsets[i + 1] - join.offsets[i] == k);
+            for (std::size_t r = 0; r < k; ++r) {
+                auto pos = join.offsets[i] + r;
+                BOOST_TEST(join.distances[pos] == all[r]);
+                BOOST_TEST(join.distances[pos] == metric(queries[i], references[join.ids[pos]]));
+                if (self)
+                    BOOST_TEST(join.ids[pos] != i);
+            }
+        }
+    };
+    check(A.knn_join(B, k), a_records, b_records, false);
+    check(metric_space::knn_join(B, A, k), b_records, a_records, false);
+    check(A.knn_join(A, k), a_records, a_records, true);
+
+    // erased records get no neighbours and are nobody's neighbour
+    for (std::size_t i = 0; i < a_records.size(); i += 3)
+        A.erase(a_records[i]);
+    auto join = A.knn_join(A, k);
+    for (std::size_t i = 0; i < a_records.size(); ++i) {
+        BOOST_TEST(join.offsets[i + 1] - join.offsets[i] == (i % 3 == 0 ? 0u : k));
+        for (auto pos = join.offsets[i]; pos < join.offsets[i + 1]; ++pos)
+            BOOST_TEST(join.ids[pos] % 3 != 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_range_join) {
+    auto records = random_records(1500, 3, 17);
+    metric_space::Tree<recType> tree(records);
+    metric_space::L2_Metric_STL<recType> metric;
+    const double r = 0.2;
+
+    // brute force pairs and their components
+    std::vector<std::size_t> parent(records.size());
+    for (std::size_t i = 0; i < parent.size(); ++i)
+        parent[i] = i;
+    auto find = [&](std::size_t i) {
+        while (parent[i] != i)
+            i = parent[i];
+        return i;
+    };
+    std::size_t pairs = 0;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        for (std::size_t j = i + 1; j < records.size(); ++j) {
+            if (metric(records[i], records[j]) < r) {
+                pairs++;
+                parent[std::max(find(i), find(j))] = std::min(find(i), find(j));
+            }
+        }
+    }
+
+    std::vector<std::size_t> labels;
+    auto graph = metric::graph::range_join(tree, r, labels);
+    auto m = graph.get_matrix();
+    BOOST_REQUIRE(m.rows() == records.size());
+    BOOST_TEST(graph.getNodesNumber() == records.size());
+    BOOST_TEST(m.nonZeros() == 2 * pairs);
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        for (auto it = m.begin(i); it != m.end(i); ++it) {
+            BOOST_TEST(it->index() != i);
+            BOOST_TEST(it->value() == float(metric(records[i], records[it->index()])));
+        }
+    }
+    for (std::size_t i = 0; i < records.size(); ++i)
+        for (std::size_t j = 0; j < i; ++j)
+            BOOST_TEST((labels[i] == labels[j]) == (find(i) == find(j)));
+    BOOST_TEST(labels[0] == 0u);
+
+    // erased records are isolated and unlabeled
+    for (std::size_t i = 0; i < records.size(); i += 4)
+        tree.erase(records[i]);
+    m = metric::graph::range_join(tree, r, labels).get_matrix();
+    for (std::size_t i = 0; i < records.size(); i += 4) {
+        BOOST_TEST(m.nonZeros(i) == 0u);
+        BOOST_TEST(labels[i] == std::numeric_limits<std::size_t>::max());
+    }
+
+    metric_space::Tree<recType> empty;
+    BOOST_TEST(metric::graph::range_join(empty, r, labels).get_matrix().rows() == 0u);
+    BOOST_TEST(labels.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_range_join_ties) {
+    // a grid: every neighbour sits at exactly 1 or sqrt 2, range_join agrees with rnn on the ties
+    std::vector<recType> records;
+    for (int x = 0; x < 12; ++x)
+        for (int y = 0; y < 12; ++y)
+            records.push_back(recType{double(x), double(y)});
+    metric_space::Tree<recType> tree(records);
+    for (double r : {1.0, 1.5}) {
+        auto m = metric::graph::range_join(tree, r).get_matrix();
+        for (std::size_t i = 0; i < records.size(); ++i)
+            BOOST_TEST(m.nonZeros(i) + 1 == tree.rnn(records[i], r).size());
+    }
+    BOOST_TEST(metric::graph::range_join(tree, 1.0).get_matrix().nonZeros() == 0u);
+}
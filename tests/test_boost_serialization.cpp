@@ -14,6 +14,7 @@
 #include <iostream>
 #include <vector>
 #include "metric_space.hpp"
+#include "test_helpers.hpp"
 template<typename T>
 struct distance {
   int operator()( const T &lhs,  const T &rhs) const {
@@ -74,6 +75,42 @@ BOOST_AUTO_TEST_CASE(test_serialize_boost_binary) {
   BOOST_TEST(tree1 == tree);
 }
 
+template <typename T>
+struct L2 {
+  T operator()(const std::vector<T> &lhs, const std::vector<T> &rhs) const {
+    T sum = 0;
+    for (std::size_t i = 0; i < lhs.size(); ++i)
+      sum += (lhs[i] - rhs[i]) * (lhs[i] - rhs[i]);
+    return std::sqrt(sum);
+  }
+};
+
+BOOST_AUTO_TEST_CASE(test_serialize_boost_keeps_pruning) {
+  auto data = random_records(2000, 8);
+  metric_space::Tree<std::vector<double>, L2<double>> tree;
+  tree.insert(data);
+  std::ostringstream os;
+  boost::archive::binary_oarchive oar(os);
+  tree.serialize(oar);
+  metric_space::Tree<std::vector<double>, L2<double>> tree1;
+  std::istringstream is(os.str());
+  boost::archive::binary_iarchive iar(is);
+  tree1.deserialize(iar, is);
+  BOOST_TEST(tree1 == tree);
+
+  // the loaded tree prunes exactly as the original one
+  metric_space::QueryContext<std::vector<double>, L2<double>> ctx, ctx1;
+  for (const auto &q : random_records(20, 8, 7)) {
+    tree.knn(q, 10, ctx);
+    tree1.knn(q, 10, ctx1);
+    BOOST_TEST(ctx1.evaluations == ctx.evaluations);
+    tree.rnn(q, 0.9, ctx);
+    tree1.rnn(q, 0.9, ctx1);
+    BOOST_TEST(ctx1.evaluations == ctx.evaluations);
+    BOOST_TEST(tree1.rnn_count(q, 0.9) == tree.rnn_count(q, 0.9));
+  }
+}
+
 struct Record {
   float v;
   std::vector<float> vv;
@@ -0,0 +1,92 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_distance_cache
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+static std::atomic<std::size_t> evaluations(0);
+
+struct Counting_L2 {
+    double operator()(const recType &a, const recType &b) const {
+        evaluations++;
+        return metric_space::L2_Metric_STL<recType>()(a, b);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_memo) {
+    metric_space::DistanceCache<double> cache(64);
+    double d = 0;
+    BOOST_TEST(!cache.find(1, 2, d));
+    cache.store(1, 2, 0.5);
+    BOOST_TEST(cache.find(2, 1, d)); // symmetric
+    BOOST_TEST(d == 0.5);
+
+    // bounded: a pair used again and again survives a stream of one-off pairs
+    for (unsigned i = 0; i < 10000; ++i) {
+        cache.store(i + 10, i + 20000, double(i));
+        BOOST_TEST(cache.find(1, 2, d));
+    }
+    BOOST_TEST(cache.stats().entries <= 64u);
+    BOOST_TEST(cache.stats().evictions > 0u);
+    BOOST_TEST(cache.stats().hits == 10001u);
+    cache.clear();
+    BOOST_TEST(!cache.find(1, 2, d));
+    BOOST_TEST(cache.stats().entries == 0u);
+
+    // concurrent use from several threads
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < 4; ++t) {
+        threads.emplace_back([&cache, t]() {
+            double value = 0;
+            for (unsigned i = 0; i < 20000; ++i) {
+                unsigned a = (i * 7 + t) % 500, b = (i * 13) % 500 + 500;
+                if (cache.find(a, b, value))
+                    BOOST_REQUIRE(value == double(a + b));
+                else
+                    cache.store(a, b, double(a + b));
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    BOOST_TEST(cache.stats().hits > 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_tree_memo) {
+    using Tree = metric_space::Tree<recType, Counting_L2>;
+    auto data = random_records(3000, 4, 11);
+
+    Tree plain;
+    evaluations = 0;
+    for (auto &r : data)
+        plain.insert(r);
+    for (std::size_t i = 0; i < data.size(); i += 10)
+        plain.erase(data[i]);
+    std::size_t without = evaluations;
+
+    Tree memo;
+    memo.set_distance_cache(1 << 16);
+    evaluations = 0;
+    for (auto &r : data)
+        memo.insert(r);
+    for (std::size_t i = 0; i < data.size(); i += 10)
+        memo.erase(data[i]);
+    std::size_t with = evaluations;
+
+    // the same tree from fewer metric calls
+    BOOST_TEST(memo == plain);
+    BOOST_TEST(with < without);
+    auto stats = memo.distance_cache_stats();
+    BOOST_TEST(stats.hits > 0u);
+    BOOST_TEST(stats.misses + stats.hits > stats.hits);
+    for (auto &q : random_records(10, 4, 12))
+        BOOST_TEST(memo.knn(q, 5)[4].second == plain.knn(q, 5)[4].second);
+
+    memo.set_distance_cache(0);
+    BOOST_TEST(memo.distance_cache_stats().hits == 0u);
+}
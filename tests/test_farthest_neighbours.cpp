@@ -0,0 +1,45 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_farthest_neighbours
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_farthest_neighbours) {
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    auto data = random_records(3000, 3);
+    metric_space::Tree<recType> tree(data);
+    Metric metric;
+    metric_space::QueryContext<recType, Metric> ctx;
+
+    for (auto &q : random_records(20, 3)) {
+        std::vector<double> all;
+        for (auto &r : data)
+            all.push_back(metric(r, q));
+        std::sort(all.rbegin(), all.rend());
+        auto &kfn = tree.kfn(q, 10, ctx);
+        BOOST_REQUIRE(kfn.size() == 10u);
+        for (std::size_t i = 0; i < kfn.size(); ++i) {
+            BOOST_TEST(kfn[i].second == all[i]);
+            BOOST_TEST(kfn[i].second == metric(kfn[i].first->data, q));
+        }
+        BOOST_TEST(ctx.evaluations < data.size() / 2);
+        BOOST_TEST(metric(tree.fn(q)->data, q) == all[0]);
+    }
+    BOOST_TEST(tree.kfn(data[0], 5000).size() == data.size());
+
+    double diameter = 0;
+    for (std::size_t i = 0; i < data.size(); ++i)
+        for (std::size_t j = i + 1; j < data.size(); ++j)
+            diameter = std::max(diameter, metric(data[i], data[j]));
+    BOOST_TEST(tree.diameter() <= diameter);
+    BOOST_TEST(tree.diameter() >= diameter / 2);
+
+    metric_space::Tree<recType> empty;
+    BOOST_TEST(empty.fn(data[0]) == nullptr);
+    BOOST_TEST(empty.kfn(data[0], 3).empty());
+    BOOST_TEST(empty.diameter() == 0.0);
+}
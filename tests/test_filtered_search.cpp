@@ -0,0 +1,119 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_filtered_search
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+using Metric = metric_space::L2_Metric_STL<recType>;
+using Node_ptr = metric_space::Node<recType, Metric> *;
+
+/*** a record's tenant is its ID % 16, its timestamp the last coordinate ***/
+static metric_space::AttributeSummary attributes(Node_ptr node) {
+    return metric_space::AttributeSummary(node->ID % 16, node->data.back());
+}
+
+BOOST_AUTO_TEST_CASE(test_filtered_queries_are_exact) {
+    auto data = random_records(3000, 4, 1);
+    metric_space::Tree<recType> tree(data);
+    Metric metric;
+    auto queries = random_records(20, 4, 2);
+
+    // tenant 5 and timestamp >= 0.25: about 1 in 40 records
+    metric_space::AttributeFilter filter;
+    filter.categories.reset();
+    filter.categories.set(5);
+    filter.min = 0.25;
+    auto pred = [](Node_ptr node) { return node->ID % 16 == 5 && node->data.back() >= 0.25; };
+
+    // ids[i] is the ID of records[i], records are inserted in order
+    std::vector<unsigned> ids;
+    for (unsigned i = 0; i < data.size(); ++i)
+        ids.push_back(i);
+    auto check = [&](const std::vector<recType> &records) {
+        for (auto &q : queries) {
+            std::vector<double> passing;
+            for (std::size_t i = 0; i < records.size(); ++i)
+                if (ids[i] % 16 == 5 && records[i].back() >= 0.25)
+                    passing.push_back(metric(records[i], q));
+            std::sort(passing.begin(), passing.end());
+
+            auto knn = tree.knn_if(q, 10, pred, filter);
+            BOOST_TEST(knn.size() == std::min<std::size_t>(10, passing.size()));
+            for (std::size_t i = 0; i < knn.size(); ++i) {
+                BOOST_TEST(pred(knn[i].first));
+                BOOST_TEST(knn[i].second == passing[i]);
+            }
+            auto in_range = std::lower_bound(passing.begin(), passing.end(), 0.8) - passing.begin();
+            auto rnn = tree.rnn_if(q, 0.8, pred, filter);
+            BOOST_TEST(rnn.size() == static_cast<std::size_t>(in_range));
+            for (auto &r : rnn)
+                BOOST_TEST(pred(r.first));
+        }
+    };
+
+    // without summaries the predicate alone decides
+    check(data);
+
+    tree.set_summary(attributes);
+    check(data);
+
+    // summaries are kept up to date by inserts and stay valid after erases
+    auto more = random_records(1000, 4, 3);
+    for (auto &r : more) {
+        tree.insert(r);
+        ids.push_back(data.size());
+        data.push_back(r);
+    }
+    check(data);
+    std::vector<recType> kept;
+    std::vector<unsigned> kept_ids;
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        if (i % 3 == 0) {
+            tree.erase(data[i]);
+        } else {
+            kept.push_back(data[i]);
+            kept_ids.push_back(ids[i]);
+        }
+    }
+    ids = kept_ids;
+    check(kept);
+}
+
+BOOST_AUTO_TEST_CASE(test_summaries_prune_selective_filters) {
+    auto data = random_records(5000, 4, 4);
+    metric_space::Tree<recType> tree(data);
+    tree.set_summary(attributes);
+    metric_space::QueryContext<recType, Metric> ctx;
+    auto queries = random_records(20, 4, 5);
+
+    metric_space::AttributeFilter filter;
+    filter.min = 0.9; // about 1 in 20 records, concentrated in a slab of the space
+    auto pred = [](Node_ptr node) { return node->data.back() >= 0.9; };
+    auto everything = [](Node_ptr) { return true; };
+
+    std::size_t pruned = 0, unpruned = 0;
+    for (auto &q : queries) {
+        tree.knn_if(q, 5, pred, filter, ctx);
+        pruned += ctx.evaluations;
+        tree.knn_if(q, 5, pred, metric_space::AttributeFilter(), ctx);
+        unpruned += ctx.evaluations;
+        BOOST_TEST(ctx.exact);
+
+        // an unrestricted filter and predicate is plain knn
+        auto &all = tree.knn_if(q, 5, everything, metric_space::AttributeFilter(), ctx);
+        auto plain = tree.knn(q, 5);
+        BOOST_TEST(all.size() == plain.size());
+        for (std::size_t i = 0; i < all.size(); ++i)
+            BOOST_TEST(all[i].second == plain[i].second);
+    }
+    BOOST_TEST(pruned < unpruned);
+
+    // no subtree admits a tenant nobody has
+    filter = metric_space::AttributeFilter();
+    filter.categories.reset();
+    filter.categories.set(63);
+    BOOST_TEST(tree.knn_if(queries[0], 5, everything, filter).empty());
+}
@@ -0,0 +1,89 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_finger_search
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_finger_search) {
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    Metric metric;
+    metric_space::QueryContext<recType, Metric> ctx;
+
+    // a random walk, every step is inserted below the node of the previous one
+    std::mt19937 gen(7);
+    std::normal_distribution<double> step(0, 0.02);
+    std::vector<recType> walk(1, recType(4, 0.5));
+    for (std::size_t i = 1; i < 500; ++i) {
+        walk.push_back(walk.back());
+        for (auto &v : walk.back())
+            v += step(gen);
+    }
+    metric_space::Node<recType, Metric> *hint = nullptr;
+    for (auto &p : walk) {
+        hint = tree.insert(p, hint);
+        BOOST_TEST(hint->data == p);
+    }
+    BOOST_TEST(tree.check_covering());
+    BOOST_TEST(tree.size() == data.size() + walk.size());
+    data.insert(data.end(), walk.begin(), walk.end());
+
+    // queries along the walk, each starting at the previous answer, are exact and cheaper than from the root
+    std::size_t from_root = 0, from_hint = 0;
+    hint = nullptr;
+    for (std::size_t i = 0; i < walk.size(); i += 5) {
+        recType q = walk[i];
+        q[0] += 0.01;
+        double best = metric(data[0], q);
+        for (auto &r : data)
+            best = std::min(best, metric(r, q));
+        tree.knn(q, 1, ctx);
+        from_root += ctx.evaluations;
+        auto &nn = tree.knn(q, 1, hint, ctx);
+        from_hint += ctx.evaluations;
+        BOOST_TEST(nn[0].second == best);
+        hint = nn[0].first;
+    }
+    BOOST_TEST(from_hint < from_root);
+
+    // hinted inserts widen maxdist by exact distances, later queries prune as well as in a tree built from the root
+    metric_space::Tree<recType> plain, hinted;
+    hint = nullptr;
+    for (auto &p : walk) {
+        plain.insert(p);
+        hint = hinted.insert(p, hint);
+    }
+    std::size_t plain_evaluations = 0, hinted_evaluations = 0;
+    for (auto &q : random_records(50, 4, 3)) {
+        for (auto &v : q)
+            v = 0.5 + v / 4;
+        plain.knn(q, 10, ctx);
+        plain_evaluations += ctx.evaluations;
+        hinted.knn(q, 10, ctx);
+        hinted_evaluations += ctx.evaluations;
+        plain.rnn(q, 0.1, ctx);
+        plain_evaluations += ctx.evaluations;
+        hinted.rnn(q, 0.1, ctx);
+        hinted_evaluations += ctx.evaluations;
+    }
+    BOOST_TEST(hinted_evaluations < plain_evaluations * 1.1);
+
+    // records by ID: the record itself comes first, erased IDs are gone
+    auto knn = tree.knn_by_id(2100, 5);
+    BOOST_TEST(knn.size() == 5u);
+    BOOST_TEST(knn[0].first->ID == 2100u);
+    BOOST_TEST(knn[0].second == 0.0);
+    BOOST_TEST(tree[2100] == walk[100]);
+    tree.erase(walk[100]);
+    BOOST_TEST(tree.get_node(2100) == nullptr);
+    BOOST_TEST(tree.knn_by_id(2100, 5).empty());
+    BOOST_TEST(tree.knn_by_id(100000, 5).empty());
+    BOOST_TEST(tree.get_node(2101)->data == walk[101]);
+    BOOST_TEST(tree.check_covering());
+}
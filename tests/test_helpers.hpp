@@ -0,0 +1,18 @@
+#ifndef _METRIC_SPACE_TEST_HELPERS_HPP
+#define _METRIC_SPACE_TEST_HELPERS_HPP
+
+#include <random>
+#include <vector>
+
+/*** n records of dim coordinates, uniform in [-1, 1], the same for the same seed ***/
+static std::vector<std::vector<double>> random_records(std::size_t n, std::size_t dim, unsigned seed = 42) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    std::vector<std::vector<double>> records(n, std::vector<double>(dim));
+    for (auto &r : records)
+        for (auto &v : r)
+            v = dist(gen);
+    return records;
+}
+
+#endif // _METRIC_SPACE_TEST_HELPERS_HPP
@@ -0,0 +1,83 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_hnsw
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+using Metric = metric_space::L2_Metric_STL<recType>;
+
+/*** share of the exact k nearest distances the graph finds ***/
+template <class Index>
+static double recall(const Index &index, const metric_space::Tree<recType, Metric> &tree, const std::vector<recType> &queries,
+                     unsigned k) {
+    std::size_t hits = 0;
+    for (auto &q : queries) {
+        auto found = index.knn(q, k);
+        auto exact = tree.knn(q, k);
+        BOOST_REQUIRE(found.size() == exact.size());
+        for (std::size_t i = 1; i < found.size(); ++i)
+            BOOST_TEST(found[i - 1].second <= found[i].second);
+        for (auto &f : found)
+            hits += f.second <= exact.back().second;
+    }
+    return double(hits) / (queries.size() * k);
+}
+
+BOOST_AUTO_TEST_CASE(test_empty) {
+    metric::graph::HNSW<recType, Metric> index;
+    BOOST_TEST(index.nn(recType{1, 2}) == nullptr);
+    BOOST_TEST(index.knn(recType{1, 2}, 3).empty());
+    BOOST_TEST(index.max_level() == -1);
+    index.insert(recType{1, 2});
+    BOOST_TEST(index.nn(recType{0, 0})->data == (recType{1, 2}));
+    BOOST_TEST(index.knn(recType{0, 0}, 3).size() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_recall) {
+    auto data = random_records(3000, 16, 1);
+    auto queries = random_records(50, 16, 2);
+    metric_space::Tree<recType, Metric> tree(data);
+
+    // parallel build and one record at a time
+    metric::graph::HNSW<recType, Metric> index(data);
+    metric::graph::HNSW<recType, Metric> serial;
+    for (auto &r : data)
+        serial.insert(r);
+    BOOST_TEST(index.size() == data.size());
+    BOOST_TEST(index[7] == data[7]);
+    BOOST_TEST(index.get_node(7)->ID == 7u);
+    BOOST_TEST(index.max_level() >= 1);
+
+    BOOST_TEST(recall(index, tree, queries, 10) >= 0.9);
+    BOOST_TEST(recall(serial, tree, queries, 10) >= 0.9);
+    for (auto &q : queries)
+        BOOST_TEST(index.knn(q, 10, 500).back().second >= tree.knn(q, 10).back().second);
+
+    // stored records find themselves
+    for (std::size_t i = 0; i < 100; ++i)
+        BOOST_TEST(index.nn(data[i])->ID == i);
+
+    // every record keeps at least one link on layer 0, and none beyond 2 M
+    auto graph = index.get_graph(0);
+    auto m = graph.get_matrix();
+    BOOST_TEST(m.rows() == data.size());
+    for (std::size_t i = 0; i < m.rows(); ++i) {
+        BOOST_TEST(m.nonZeros(i) > 0u);
+        BOOST_TEST(m.nonZeros(i) <= 2 * metric::graph::HNSWOptions().M);
+    }
+
+    // the parallel build keeps every list free of repeats and self links, within M above layer 0
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        auto node = index.get_node(i);
+        for (int layer = 0; layer <= node->level; ++layer) {
+            auto links = node->links[layer];
+            BOOST_TEST(links.size() <= (layer == 0 ? 2 : 1) * metric::graph::HNSWOptions().M);
+            BOOST_TEST(std::count(links.begin(), links.end(), i) == 0);
+            std::sort(links.begin(), links.end());
+            BOOST_TEST((std::adjacent_find(links.begin(), links.end()) == links.end()));
+        }
+    }
+}
@@ -0,0 +1,304 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_metric_traits
+#include <boost/test/unit_test.hpp>
+#include "examples/assets/3dparty/serialize/archive.h"
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+static std::atomic<std::size_t> prepares(0);
+static std::atomic<std::size_t> plain_calls(0);
+
+/*** angle between two vectors, on unit vectors prepared once per record ***/
+static std::vector<double> unit(const recType &r) {
+    double norm = 0;
+    for (auto v : r)
+        norm += v * v;
+    norm = std::sqrt(norm);
+    std::vector<double> u;
+    for (auto v : r)
+        u.push_back(v / norm);
+    return u;
+}
+
+static double angle(const std::vector<double> &a, const std::vector<double> &b) {
+    double dot = 0;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        dot += a[i] * b[i];
+    return std::acos(std::max(-1.0, std::min(1.0, dot)));
+}
+
+struct Angular {
+    struct Prepared {
+        std::vector<double> unit;
+    };
+    Prepared prepare(const recType &r) const {
+        prepares++;
+        return Prepared{unit(r)};
+    }
+    double operator()(const Prepared &a, const Prepared &b) const { return angle(a.unit, b.unit); }
+    double operator()(const recType &a, const recType &b) const {
+        plain_calls++;
+        return angle(unit(a), unit(b));
+    }
+};
+
+/*** the same distance without the hook ***/
+struct PlainAngular {
+    double operator()(const recType &a, const recType &b) const { return angle(unit(a), unit(b)); }
+};
+
+BOOST_AUTO_TEST_CASE(test_detection) {
+    static_assert(metric_space::metric_traits<Angular, recType>::has_prepare, "prepare is detected");
+    static_assert(std::is_same<metric_space::metric_traits<Angular, recType>::prepared_type, Angular::Prepared>::value,
+                  "prepared type");
+    static_assert(!metric_space::metric_traits<PlainAngular, recType>::has_prepare, "no prepare");
+    static_assert(!metric_space::metric_traits<metric_space::L2_Metric_STL<recType>, recType>::has_prepare, "no prepare");
+}
+
+BOOST_AUTO_TEST_CASE(test_prepared_records) {
+    auto data = random_records(1000, 8, 1);
+    auto queries = random_records(20, 8, 2);
+    prepares = 0;
+    plain_calls = 0;
+    metric_space::Tree<recType, Angular> tree(data);
+    metric_space::Tree<recType, PlainAngular> plain(data);
+
+    // once per record, the tree itself never falls back to the plain call
+    BOOST_TEST(prepares == data.size());
+    BOOST_TEST(plain_calls == 0u);
+
+    metric_space::QueryContext<recType, Angular> ctx;
+    for (auto &q : queries) {
+        prepares = 0;
+        auto &result = tree.knn(q, 10, ctx);
+        auto expected = plain.knn(q, 10);
+        BOOST_TEST(prepares == 1u); // once per query
+        BOOST_TEST(ctx.evaluations > 1u);
+        BOOST_REQUIRE(result.size() == expected.size());
+        for (std::size_t i = 0; i < result.size(); ++i)
+            BOOST_TEST(result[i].second == expected[i].second);
+
+        BOOST_TEST(tree.rnn(q, 0.8).size() == plain.rnn(q, 0.8).size());
+        BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        BOOST_TEST(tree.knn(q, 5, tree.nn(q)).back().second == expected[4].second);
+        BOOST_TEST(tree.rnn_count(q, 0.8) == plain.rnn_count(q, 0.8));
+    }
+    BOOST_TEST(plain_calls == 0u);
+
+    // batches, grouped or not, prepare each query once, whatever worker it lands on
+    prepares = 0;
+    auto batch = tree.knn_batch(queries, 10);
+    BOOST_TEST(prepares == queries.size());
+    metric_space::QueryOptions grouped;
+    grouped.group_size = 8;
+    prepares = 0;
+    auto grouped_batch = tree.knn_batch(queries, 10, grouped);
+    BOOST_TEST(prepares == queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        BOOST_TEST(batch.distances[batch.offsets[i] + 9] == plain.knn(queries[i], 10)[9].second);
+        BOOST_TEST(grouped_batch.distances[grouped_batch.offsets[i] + 9] == batch.distances[batch.offsets[i] + 9]);
+    }
+
+    // the tasks of a parallel query borrow the caller's prepared form, browsing prepares once
+    metric_space::QueryOptions parallel;
+    parallel.parallel = true;
+    for (auto &q : queries) {
+        prepares = 0;
+        BOOST_TEST(tree.knn(q, 10, ctx, parallel).back().second == plain.knn(q, 10).back().second);
+        BOOST_TEST(prepares == 1u);
+        prepares = 0;
+        auto range = tree.neighbours(q);
+        std::size_t n = 0;
+        for (auto it = range.begin(); it != range.end() && n < 20; ++it)
+            n++;
+        BOOST_TEST(prepares == 1u);
+    }
+
+    // joins reuse the forms prepared on insert
+    prepares = 0;
+    tree.knn_join(tree, 5);
+    tree.range_pairs(0.3);
+    BOOST_TEST(prepares == 0u);
+    BOOST_TEST(plain_calls == 0u);
+
+    // prepared forms are not serialized, they are made again on load
+    std::ostringstream os;
+    serialize::oarchive<std::ostringstream> oar(os);
+    tree.serialize(oar);
+    std::istringstream is(os.str());
+    serialize::iarchive<std::istringstream> iar(is);
+    metric_space::Tree<recType, Angular> loaded;
+    prepares = 0;
+    loaded.deserialize(iar, is);
+    BOOST_TEST(prepares == data.size());
+    BOOST_TEST(plain_calls == 0u);
+    for (auto &q : queries)
+        BOOST_TEST(loaded.knn(q, 3)[2].second == plain.knn(q, 3)[2].second);
+}
+
+BOOST_AUTO_TEST_CASE(test_prepared_pivots) {
+    auto data = random_records(1000, 8, 1);
+    auto queries = random_records(20, 8, 2);
+    metric_space::Tree<recType, Angular> tree(data);
+    metric_space::Tree<recType, PlainAngular> plain(data);
+
+    // the pivots keep the forms of their records, the table is filled without preparing again
+    prepares = 0;
+    plain_calls = 0;
+    tree.set_pivots(4);
+    BOOST_TEST(tree.pivots().size() == 4u);
+    BOOST_TEST(prepares == 0u);
+
+    // an insert prepares its record once for the tree and all pivots, a query once for the walk and all pivots
+    prepares = 0;
+    tree.insert(queries[0]);
+    plain.insert(queries[0]);
+    BOOST_TEST(prepares == 1u);
+    metric_space::QueryContext<recType, Angular> ctx;
+    for (auto &q : queries) {
+        prepares = 0;
+        BOOST_TEST(tree.knn(q, 10, ctx).back().second == plain.knn(q, 10).back().second);
+        BOOST_TEST(prepares == 1u);
+        prepares = 0;
+        BOOST_TEST(tree.rnn(q, 0.8).size() == plain.rnn(q, 0.8).size());
+        BOOST_TEST(prepares == 1u);
+        prepares = 0;
+        BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        BOOST_TEST(prepares == 1u);
+    }
+    BOOST_TEST(plain_calls == 0u);
+}
+
+/*** L2 without the bounded overload, and one that counts how often it gave up early ***/
+struct PlainL2 {
+    double operator()(const recType &a, const recType &b) const { return metric_space::L2_Metric_STL<recType>()(a, b); }
+};
+
+static std::atomic<std::size_t> abandoned(0);
+
+struct CountingL2 {
+    double operator()(const recType &a, const recType &b) const { return metric_space::L2_Metric_STL<recType>()(a, b); }
+    double operator()(const recType &a, const recType &b, double bound) const {
+        double d = metric_space::L2_Metric_STL<recType>()(a, b, bound);
+        if (d > bound)
+            abandoned++;
+        return d;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_bounded_distances) {
+    static_assert(metric_space::metric_traits<CountingL2, recType>::has_bounded, "bounded is detected");
+    static_assert(metric_space::metric_traits<metric_space::L2_Metric_STL<recType>, recType>::has_bounded, "default metric");
+    static_assert(!metric_space::metric_traits<PlainL2, recType>::has_bounded, "no bounded");
+    static_assert(!metric_space::metric_traits<Angular, recType>::has_bounded, "no bounded on the prepared forms");
+
+    // exact up to the bound, beyond it a lower bound that is above the bound
+    metric_space::L2_Metric_STL<recType> l2;
+    recType a(64, 0.0), b(64, 1.0);
+    BOOST_TEST(l2(a, b, 8.0) == 8.0);
+    BOOST_TEST(l2(a, b, 100.0) == 8.0);
+    double partial = l2(a, b, 1.0);
+    BOOST_TEST(partial > 1.0);
+    BOOST_TEST(partial < 8.0);
+
+    auto data = random_records(2000, 64, 3);
+    auto queries = random_records(20, 64, 4);
+    metric_space::Tree<recType, CountingL2> tree(data);
+    metric_space::Tree<recType, PlainL2> plain(data);
+    BOOST_TEST(tree.check_covering());
+    BOOST_TEST(abandoned > 0u);
+
+    metric_space::QueryOptions approximate;
+    approximate.epsilon = 0.5;
+    for (auto &q : queries) {
+        abandoned = 0;
+        auto result = tree.knn(q, 10);
+        BOOST_TEST(abandoned > 0u);
+        auto expected = plain.knn(q, 10);
+        BOOST_REQUIRE(result.size() == expected.size());
+        for (std::size_t i = 0; i < result.size(); ++i)
+            BOOST_TEST(result[i].second == expected[i].second);
+        BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        BOOST_TEST(tree.rnn(q, 3.0).size() == plain.rnn(q, 3.0).size());
+
+        // approximate results stay within their factor
+        metric_space::QueryContext<recType, CountingL2> ctx;
+        auto &relaxed = tree.knn(q, 10, ctx, approximate);
+        for (std::size_t i = 0; i < relaxed.size(); ++i)
+            BOOST_TEST(relaxed[i].second <= 1.5 * expected[i].second);
+    }
+}
+
+/*** L2 on records with their norms, two lower bounds: one coordinate, then the difference of the norms ***/
+static std::atomic<std::size_t> full_calls(0);
+
+struct CascadeL2 {
+    struct Prepared {
+        recType values;
+        double norm;
+    };
+    struct FirstCoordinate {
+        double operator()(const Prepared &a, const Prepared &b) const { return std::abs(a.values[0] - b.values[0]); }
+    };
+    struct NormDifference {
+        double operator()(const Prepared &a, const Prepared &b) const { return std::abs(a.norm - b.norm); }
+    };
+    Prepared prepare(const recType &r) const {
+        return Prepared{r, metric_space::L2_Metric_STL<recType>()(r, recType(r.size(), 0.0))};
+    }
+    std::tuple<FirstCoordinate, NormDifference> lower_bounds() const { return {}; }
+    double operator()(const Prepared &a, const Prepared &b) const {
+        full_calls++;
+        return metric_space::L2_Metric_STL<recType>()(a.values, b.values);
+    }
+    double operator()(const recType &a, const recType &b) const { return (*this)(prepare(a), prepare(b)); }
+};
+
+BOOST_AUTO_TEST_CASE(test_lower_bound_cascade) {
+    static_assert(metric_space::metric_traits<CascadeL2, recType>::lower_bound_count == 2, "two lower bounds");
+    static_assert(metric_space::metric_traits<PlainL2, recType>::lower_bound_count == 0, "no lower bounds");
+
+    // norms spread over an order of magnitude, so the norm difference has something to rule out
+    auto data = random_records(2000, 16, 5);
+    auto queries = random_records(20, 16, 6);
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> scale(0.2, 3);
+    for (auto &r : data) {
+        auto s = scale(gen);
+        for (auto &v : r)
+            v *= s;
+    }
+    metric_space::Tree<recType, CascadeL2> tree(data);
+    metric_space::Tree<recType, PlainL2> plain(data);
+    BOOST_TEST(tree.check_covering());
+    auto built = tree.lower_bound_stats();
+    BOOST_REQUIRE(built.pruned.size() == 2u);
+    BOOST_TEST(built.pruned[0] + built.pruned[1] > 0u); // insert uses them too
+
+    metric_space::QueryContext<recType, CascadeL2> ctx;
+    metric_space::QueryContext<recType, PlainL2> plain_ctx;
+    for (auto &q : queries) {
+        full_calls = 0;
+        auto &result = tree.knn(q, 10, ctx);
+        auto &expected = plain.knn(q, 10, plain_ctx);
+        BOOST_REQUIRE(result.size() == expected.size());
+        for (std::size_t i = 0; i < result.size(); ++i)
+            BOOST_TEST(result[i].second == expected[i].second);
+        BOOST_TEST(ctx.evaluations == full_calls); // ruled out children are not charged
+        BOOST_TEST(ctx.evaluations < plain_ctx.evaluations);
+        BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        BOOST_TEST(tree.rnn(q, 2.0).size() == plain.rnn(q, 2.0).size());
+    }
+    auto stats = tree.lower_bound_stats();
+    BOOST_TEST(stats.pruned[0] > built.pruned[0]);
+    BOOST_TEST(stats.pruned[1] > built.pruned[1]);
+    BOOST_TEST(stats.evaluated > built.evaluated);
+    BOOST_TEST(plain.lower_bound_stats().pruned.empty());
+}
@@ -0,0 +1,47 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_neighbour_browsing
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_neighbour_browsing) {
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::L2_Metric_STL<recType> metric;
+    auto queries = random_records(20, 4);
+
+    for (auto &q : queries) {
+        std::vector<double> all;
+        for (auto &r : data)
+            all.push_back(metric(r, q));
+        std::sort(all.begin(), all.end());
+
+        // browsing the whole tree visits every record once, in ascending distance
+        std::vector<unsigned> ids;
+        std::size_t i = 0;
+        for (auto &neighbour : tree.neighbours(q)) {
+            BOOST_TEST(neighbour.second == all[i]);
+            BOOST_TEST(neighbour.second == metric(neighbour.first->data, q));
+            ids.push_back(neighbour.first->ID);
+            ++i;
+        }
+        BOOST_TEST(i == all.size());
+        std::sort(ids.begin(), ids.end());
+        BOOST_TEST((std::unique(ids.begin(), ids.end()) == ids.end()));
+
+        // stopping early only pays for what was looked at
+        auto range = tree.neighbours(q);
+        auto it = range.begin();
+        for (std::size_t j = 0; j < 10; ++j, ++it)
+            BOOST_TEST(it->second == all[j]);
+        BOOST_TEST(range.evaluations() < data.size() / 2);
+    }
+
+    metric_space::Tree<recType> empty;
+    auto nothing = empty.neighbours(queries[0]);
+    BOOST_TEST((nothing.begin() == nothing.end()));
+}
@@ -0,0 +1,59 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_pivot_filter
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_pivot_filter) {
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    auto data = random_records(3000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::Tree<recType> plain(data);
+    metric_space::QueryContext<recType, Metric> ctx;
+    tree.set_pivots(8);
+    BOOST_TEST(tree.pivots().size() == 8u);
+
+    auto same = [](const std::vector<std::pair<metric_space::Node<recType, Metric> *, double>> &a,
+                   const std::vector<std::pair<metric_space::Node<recType, Metric> *, double>> &b) {
+        if (a.size() != b.size())
+            return false;
+        for (std::size_t i = 0; i < a.size(); ++i)
+            if (a[i].second != b[i].second)
+                return false;
+        return true;
+    };
+    auto check = [&]() {
+        std::size_t filtered = 0, unfiltered = 0;
+        for (auto q : random_records(30, 4)) {
+            q[1] += 0.05; // the same seed as data
+            auto expected = plain.knn(q, 10, ctx);
+            unfiltered += ctx.evaluations;
+            BOOST_TEST(same(tree.knn(q, 10, ctx), expected));
+            filtered += ctx.evaluations;
+            BOOST_TEST(same(tree.rnn(q, 0.4, ctx), plain.rnn(q, 0.4)));
+            BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        }
+        BOOST_TEST(filtered < unfiltered);
+    };
+    check();
+
+    // inserted records get their pivot distances, erased ones drop out
+    auto more = random_records(500, 4);
+    for (std::size_t i = 0; i < more.size(); ++i) {
+        more[i][0] += 0.5;
+        tree.insert(more[i]);
+        plain.insert(more[i]);
+    }
+    for (std::size_t i = 0; i < data.size(); i += 5) {
+        tree.erase(data[i]);
+        plain.erase(data[i]);
+    }
+    check();
+
+    tree.set_pivots(0);
+    BOOST_TEST(tree.pivots().empty());
+    BOOST_TEST(same(tree.knn(data[1], 10), plain.knn(data[1], 10)));
+}
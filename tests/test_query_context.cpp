@@ -0,0 +1,194 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_query_context
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+/*** counting allocator: every global operator new bumps the counter ***/
+static std::atomic<std::size_t> allocations(0);
+
+void *operator new(std::size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_context_matches_default_api) {
+    auto data = random_records(500, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    auto queries = random_records(20, 4);
+    for (auto &q : queries) {
+        BOOST_TEST(tree.nn(q, ctx) == tree.nn(q));
+        BOOST_TEST((tree.knn(q, 7, ctx) == tree.knn(q, 7)));
+        BOOST_TEST((tree.rnn(q, 0.5, ctx) == tree.rnn(q, 0.5)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_steady_state_queries_do_not_allocate) {
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    auto queries = random_records(50, 4);
+
+    // warm up: let the context grow to its steady state size
+    for (auto &q : queries) {
+        tree.nn(q, ctx);
+        tree.knn(q, 10, ctx);
+        tree.knn(q, 10, ctx, metric_space::SearchOrder::best_first);
+        tree.knn(q, 10, ctx, metric_space::SearchOrder::level_synchronous);
+        tree.rnn(q, 0.3, ctx);
+    }
+
+    std::size_t before = allocations;
+    for (auto &q : queries) {
+        tree.nn(q, ctx);
+        tree.knn(q, 10, ctx);
+        tree.knn(q, 10, ctx, metric_space::SearchOrder::best_first);
+        tree.knn(q, 10, ctx, metric_space::SearchOrder::level_synchronous);
+        tree.rnn(q, 0.3, ctx);
+    }
+    std::size_t after = allocations;
+    BOOST_TEST(after - before == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_best_first_knn) {
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::L2_Metric_STL<recType> metric;
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    auto queries = random_records(20, 4);
+    for (auto &q : queries) {
+        for (unsigned k : {1u, 10u, 100u}) {
+            auto &best_first = tree.knn(q, k, ctx, metric_space::SearchOrder::best_first);
+            BOOST_TEST(best_first.size() == k);
+            for (std::size_t i = 0; i < best_first.size(); ++i) {
+                BOOST_TEST(best_first[i].second == metric(best_first[i].first->data, q));
+                if (i > 0)
+                    BOOST_TEST(best_first[i - 1].second <= best_first[i].second);
+            }
+        }
+        // asking for more than the tree holds returns every record in ascending distance
+        std::vector<double> all;
+        for (auto &r : data)
+            all.push_back(metric(r, q));
+        std::sort(all.begin(), all.end());
+        auto &everything = tree.knn(q, 3000, ctx, metric_space::SearchOrder::best_first);
+        BOOST_TEST(everything.size() == all.size());
+        for (std::size_t i = 0; i < all.size(); ++i)
+            BOOST_TEST(everything[i].second == all[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_queries_are_exact) {
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::L2_Metric_STL<recType> metric;
+    auto queries = random_records(20, 4);
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    metric_space::QueryOptions options;
+
+    auto check = [&](const std::vector<recType> &records) {
+        for (auto &q : queries) {
+            std::vector<double> all;
+            for (auto &r : records)
+                all.push_back(metric(r, q));
+            std::sort(all.begin(), all.end());
+            auto in_range = std::lower_bound(all.begin(), all.end(), 0.4) - all.begin();
+            for (auto order : {metric_space::SearchOrder::depth_first, metric_space::SearchOrder::best_first,
+                               metric_space::SearchOrder::level_synchronous}) {
+                options.order = order;
+                BOOST_TEST(metric(tree.nn(q, ctx, options)->data, q) == all[0]);
+                auto &knn = tree.knn(q, 50, ctx, options);
+                BOOST_TEST(knn.size() == std::min<std::size_t>(50, all.size()));
+                for (std::size_t i = 0; i < knn.size(); ++i)
+                    BOOST_TEST(knn[i].second == all[i]);
+                BOOST_TEST(tree.rnn(q, 0.4, ctx, options).size() == static_cast<std::size_t>(in_range));
+            }
+            // finger search from the answer itself and from an unrelated node
+            for (auto hint : {tree.nn(q), tree.nn(queries[0])}) {
+                auto &knn = tree.knn(q, 50, hint, ctx);
+                BOOST_TEST(knn.size() == std::min<std::size_t>(50, all.size()));
+                for (std::size_t i = 0; i < knn.size(); ++i)
+                    BOOST_TEST(knn[i].second == all[i]);
+            }
+            BOOST_TEST(tree.rnn_count(q, 0.4) == static_cast<std::size_t>(in_range));
+            std::size_t streamed = 0;
+            tree.rnn(q, 0.4, [&](metric_space::Node<recType, metric_space::L2_Metric_STL<recType>> *node, double dist) {
+                BOOST_TEST(dist < 0.4);
+                BOOST_TEST(dist == metric(node->data, q));
+                streamed++;
+            });
+            BOOST_TEST(streamed == static_cast<std::size_t>(in_range));
+        }
+    };
+    check(data);
+
+    // erasing re-parents subtrees, the bounds must stay valid
+    std::vector<recType> kept;
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        if (i % 3 == 0)
+            tree.erase(data[i]);
+        else
+            kept.push_back(data[i]);
+    }
+    check(kept);
+}
+
+BOOST_AUTO_TEST_CASE(test_query_options) {
+    auto data = random_records(2000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::L2_Metric_STL<recType> metric;
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    auto queries = random_records(20, 4);
+
+    for (auto &q : queries) {
+        auto exact = tree.knn(q, 10);
+        tree.knn(q, 10, ctx, metric_space::QueryOptions());
+        BOOST_TEST(ctx.exact);
+
+        // epsilon: every neighbour is within (1 + epsilon) of the true one at its rank
+        metric_space::QueryOptions approximate;
+        approximate.epsilon = 0.5;
+        for (auto order : {metric_space::SearchOrder::depth_first, metric_space::SearchOrder::best_first,
+                           metric_space::SearchOrder::level_synchronous}) {
+            approximate.order = order;
+            auto &knn = tree.knn(q, 10, ctx, approximate);
+            BOOST_TEST(!ctx.exact);
+            BOOST_TEST(knn.size() == exact.size());
+            for (std::size_t i = 0; i < knn.size(); ++i)
+                BOOST_TEST(knn[i].second <= exact[i].second * 1.5 + 1e-12);
+        }
+        BOOST_TEST(metric(tree.nn(q, ctx, approximate)->data, q) <= exact[0].second * 1.5 + 1e-12);
+
+        // budgets are never exceeded and the result is the best found so far
+        metric_space::QueryOptions budget;
+        budget.max_evaluations = 50;
+        auto &knn = tree.knn(q, 10, ctx, budget);
+        BOOST_TEST(!ctx.exact);
+        BOOST_TEST(ctx.evaluations <= 50u);
+        BOOST_TEST(knn.size() <= 10u);
+        budget.order = metric_space::SearchOrder::level_synchronous;
+        tree.knn(q, 10, ctx, budget);
+        BOOST_TEST(ctx.evaluations <= 50u);
+        budget = metric_space::QueryOptions();
+        budget.max_visited = 5;
+        tree.rnn(q, 0.5, ctx, budget);
+        BOOST_TEST(ctx.visited <= 5u);
+        budget = metric_space::QueryOptions();
+        budget.max_time = std::chrono::nanoseconds(1);
+        budget.order = metric_space::SearchOrder::best_first;
+        tree.knn(q, 10, ctx, budget);
+        BOOST_TEST(!ctx.exact);
+    }
+}
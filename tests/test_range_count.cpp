@@ -0,0 +1,28 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_range_count
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_range_count) {
+    auto data = random_records(3000, 4);
+    metric_space::Tree<recType> tree(data);
+    metric_space::L2_Metric_STL<recType> metric;
+    metric_space::QueryContext<recType, metric_space::L2_Metric_STL<recType>> ctx;
+    auto queries = random_records(20, 4);
+
+    for (auto &q : queries) {
+        for (double r : {0.1, 0.5, 1.0, 2.0}) {
+            std::size_t in_range = 0;
+            for (auto &rec : data)
+                in_range += metric(rec, q) < r;
+            BOOST_TEST(tree.rnn_count(q, r, ctx) == in_range);
+        }
+        // everything is in range: only the root is evaluated
+        BOOST_TEST(tree.rnn_count(q, 100.0, ctx) == data.size());
+        BOOST_TEST(ctx.evaluations == 1u);
+    }
+}
@@ -0,0 +1,128 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_result_cache
+#include <boost/test/unit_test.hpp>
+#include <functional>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+using Metric = metric_space::L2_Metric_STL<recType>;
+
+static std::size_t hash_record(const recType &r) {
+    std::size_t h = 0;
+    for (auto v : r)
+        h = h * 31 + std::hash<double>()(v);
+    return h;
+}
+
+static bool same(const std::vector<std::pair<metric_space::Node<recType, Metric> *, double>> &a,
+                 const std::vector<std::pair<metric_space::Node<recType, Metric> *, double>> &b) {
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        if (a[i].second != b[i].second)
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(test_repeated_queries_hit) {
+    auto data = random_records(2000, 4, 1);
+    auto queries = random_records(20, 4, 2);
+    metric_space::Tree<recType> tree(data);
+    metric_space::Tree<recType> plain(data);
+    tree.set_cache(100, hash_record);
+    metric_space::QueryContext<recType, Metric> ctx;
+
+    for (int round = 0; round < 3; ++round) {
+        for (auto &q : queries) {
+            BOOST_TEST(same(tree.knn(q, 10, ctx), plain.knn(q, 10)));
+            if (round > 0)
+                BOOST_TEST(ctx.evaluations == 0u);
+            BOOST_TEST(same(tree.rnn(q, 0.5, ctx), plain.rnn(q, 0.5)));
+            BOOST_TEST(tree.nn(q)->data == plain.nn(q)->data);
+        }
+    }
+    auto stats = tree.cache_stats();
+    BOOST_TEST(stats.misses == 3 * queries.size());
+    BOOST_TEST(stats.hits == 6 * queries.size());
+    BOOST_TEST(stats.entries == 3 * queries.size());
+
+    // batches share the cache
+    auto batch = tree.knn_batch(queries, 10);
+    BOOST_TEST(tree.cache_stats().hits == 7 * queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i)
+        BOOST_TEST(batch.distances[batch.offsets[i] + 9] == plain.knn(queries[i], 10)[9].second);
+
+    // grouped batches look each query up and store the misses of their groups
+    metric_space::QueryOptions grouped;
+    grouped.group_size = 8;
+    batch = tree.knn_batch(queries, 10, grouped);
+    BOOST_TEST(tree.cache_stats().hits == 8 * queries.size());
+    auto nn = tree.nn_batch(queries, grouped);
+    BOOST_TEST(tree.cache_stats().hits == 9 * queries.size());
+    auto fresh = random_records(20, 4, 4);
+    stats = tree.cache_stats();
+    batch = tree.knn_batch(fresh, 5, grouped);
+    BOOST_TEST(tree.cache_stats().misses == stats.misses + fresh.size());
+    BOOST_TEST(tree.cache_stats().entries == stats.entries + fresh.size());
+    auto again = tree.knn_batch(fresh, 5, grouped);
+    BOOST_TEST(tree.cache_stats().hits == stats.hits + fresh.size());
+    BOOST_TEST(again.distances == batch.distances);
+    for (std::size_t i = 0; i < fresh.size(); ++i) {
+        BOOST_TEST(same(tree.knn(fresh[i], 5, ctx), plain.knn(fresh[i], 5)));
+        BOOST_TEST(ctx.evaluations == 0u);
+        BOOST_TEST(nn.distances[i] == plain.nn(queries[i])->dist(queries[i]));
+    }
+
+    // the capacity is a bound, the least recently used entries go first
+    for (auto &q : random_records(500, 4, 3))
+        tree.knn(q, 10);
+    BOOST_TEST(tree.cache_stats().entries <= 100u);
+
+    tree.set_cache(0, hash_record);
+    BOOST_TEST(tree.cache_stats().entries == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_mutations_invalidate) {
+    auto data = random_records(2000, 4, 4);
+    auto queries = random_records(20, 4, 5);
+    for (bool by_region : {false, true}) {
+        metric_space::Tree<recType> tree(data);
+        metric_space::Tree<recType> plain(data);
+        tree.set_cache(100, hash_record, by_region);
+        for (auto &q : queries)
+            tree.knn(q, 5);
+
+        // far away from every query: only the epoch mode forgets its results
+        recType far(4, 10.0);
+        tree.insert(far);
+        plain.insert(far);
+        auto before = tree.cache_stats();
+        for (auto &q : queries)
+            BOOST_TEST(same(tree.knn(q, 5), plain.knn(q, 5)));
+        auto after = tree.cache_stats();
+        BOOST_TEST(after.hits - before.hits == (by_region ? queries.size() : 0u));
+
+        // right next to a query and erasing a neighbour: the result must change
+        recType near = queries[0];
+        near[0] += 1e-3;
+        tree.insert(near);
+        plain.insert(near);
+        BOOST_TEST(same(tree.knn(queries[0], 5), plain.knn(queries[0], 5)));
+        BOOST_TEST(tree.knn(queries[0], 5)[0].first->data == near);
+        auto neighbour = plain.knn(queries[1], 5)[2].first->data;
+        tree.erase(neighbour);
+        plain.erase(neighbour);
+        for (auto &q : queries)
+            BOOST_TEST(same(tree.knn(q, 5), plain.knn(q, 5)));
+
+        // changes the tree does not know about
+        tree.invalidate_cache(queries[3], 0.1);
+        before = tree.cache_stats();
+        tree.knn(queries[3], 5);
+        BOOST_TEST(tree.cache_stats().misses == before.misses + 1);
+        tree.invalidate_cache();
+        BOOST_TEST(tree.cache_stats().entries == 0u);
+    }
+}
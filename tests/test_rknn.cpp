@@ -0,0 +1,80 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE test_rknn
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "metric_space.hpp"
+#include "test_helpers.hpp"
+
+using recType = std::vector<double>;
+
+BOOST_AUTO_TEST_CASE(test_reverse_knn) {
+    using Metric = metric_space::L2_Metric_STL<recType>;
+    auto data = random_records(1500, 3);
+    metric_space::Tree<recType> tree(data);
+    Metric metric;
+    metric_space::QueryContext<recType, Metric> ctx;
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    auto random_record = [&]() {
+        recType r(3);
+        for (auto &v : r)
+            v = uniform(gen);
+        return r;
+    };
+
+    // brute force: x has q among its k nearest if q is not farther than its k-th nearest other record
+    auto check = [&](const std::vector<recType> &records, unsigned k) {
+        std::vector<double> radius;
+        for (auto &x : records) {
+            std::vector<double> dists;
+            for (auto &y : records)
+                if (&x != &y)
+                    dists.push_back(metric(x, y));
+            std::nth_element(dists.begin(), dists.begin() + (k - 1), dists.end());
+            radius.push_back(dists[k - 1]);
+        }
+        std::size_t evaluations = 0;
+        for (int i = 0; i < 20; ++i) {
+            auto q = random_record();
+            std::vector<double> expected;
+            for (std::size_t j = 0; j < records.size(); ++j)
+                if (metric(records[j], q) <= radius[j])
+                    expected.push_back(metric(records[j], q));
+            std::sort(expected.begin(), expected.end());
+            auto &result = tree.rknn(q, k, ctx);
+            evaluations += ctx.evaluations;
+            BOOST_REQUIRE(result.size() == expected.size());
+            for (std::size_t j = 0; j < result.size(); ++j) {
+                BOOST_TEST(result[j].second == expected[j]);
+                BOOST_TEST(result[j].second == metric(result[j].first->data, q));
+            }
+        }
+        BOOST_TEST(evaluations < 20 * records.size() / 2);
+    };
+
+    check(data, 5);
+    check(data, 1);
+
+    // inserts keep the cached radii as bounds, erases refresh their neighbours
+    tree.set_rknn_cache(5);
+    for (int i = 0; i < 100; ++i) {
+        data.push_back(random_record());
+        tree.insert(data.back());
+    }
+    check(data, 5);
+    for (std::size_t i = 0; i < data.size(); i += 7)
+        tree.erase(data[i]);
+    std::vector<recType> kept;
+    for (std::size_t i = 0; i < data.size(); ++i)
+        if (i % 7 != 0)
+            kept.push_back(data[i]);
+    check(kept, 5);
+
+    // with fewer than k other records everyone is a reverse neighbour
+    metric_space::Tree<recType> small(std::vector<recType>(data.begin(), data.begin() + 4));
+    BOOST_TEST(small.rknn(data[10], 4).size() == 4u);
+    BOOST_TEST(small.rknn(data[10], 0).empty());
+    BOOST_TEST(metric_space::Tree<recType>().rknn(data[10], 3).empty());
+}
@@ -24,6 +24,22 @@ BOOST_AUTO_TEST_CASE(test_serialize_simple_fundamental) {
   tree1.deserialize(iar, is);
   BOOST_TEST(tree1.check_covering());
   BOOST_TEST(tree1 == tree);
+  for (int q : {0, 4, 60})
+    for (int r : {2, 10, 100, 1000})
+      BOOST_TEST(tree1.rnn_count(q, r) == tree.rnn_count(q, r));
+  // maxdist comes with the archive and still bounds the distance to every descendant
+  for (unsigned id = 0; id < data.size(); ++id) {
+    auto node = tree1.get_node(id);
+    std::vector<decltype(node)> stack(node->get_children().begin(), node->get_children().end());
+    while (!stack.empty()) {
+      auto d = stack.back();
+      stack.pop_back();
+      BOOST_TEST(std::abs(d->get_data() - node->get_data()) <= node->get_maxdist());
+      stack.insert(stack.end(), d->get_children().begin(), d->get_children().end());
+    }
+  }
+  for (int q : {0, 4, 60})
+    BOOST_TEST(tree1.knn(q, 3)[0].second == tree.knn(q, 3)[0].second);
 }
 
 struct Record {